@@ -0,0 +1,4 @@
+g++ -O2 -pthread -DLODEPNG_NO_COMPILE_ALLOCATORS -DLODEPNG_COMPILE_PHASE_HOOKS -I.\src .\bench\Flimage_FormatBench.cpp .\src\Flimage_Container.cpp .\src\Flimage_Header.cpp .\src\Flimage_Layout.cpp .\src\Flimage_Transform.cpp .\src\Flimage_Dedup.cpp .\src\Flimage_Codec.cpp .\src\Flimage_Sparse.cpp .\src\Flimage_Crypto.cpp .\src\Flimage_Hash.cpp .\src\Flimage_Delta.cpp .\src\Flimage_Shard.cpp .\src\Flimage_Parallel.cpp .\src\Flimage_Race.cpp .\src\Flimage_Pace.cpp .\src\Flimage_Stats.cpp .\src\Flimage_Trace.cpp .\src\Flimage_Arena.cpp .\src\lodepng.cpp -o .\bin\Flimage_FormatBench
+g++ -O2 -pthread -DLODEPNG_NO_COMPILE_ALLOCATORS -DLODEPNG_COMPILE_PHASE_HOOKS -I.\src .\bench\Flimage_Bench.cpp .\src\Flimage_Container.cpp .\src\Flimage_Header.cpp .\src\Flimage_Layout.cpp .\src\Flimage_Transform.cpp .\src\Flimage_Dedup.cpp .\src\Flimage_Codec.cpp .\src\Flimage_Sparse.cpp .\src\Flimage_Crypto.cpp .\src\Flimage_Hash.cpp .\src\Flimage_Delta.cpp .\src\Flimage_Shard.cpp .\src\Flimage_Parallel.cpp .\src\Flimage_Race.cpp .\src\Flimage_Pace.cpp .\src\Flimage_Stats.cpp .\src\Flimage_Trace.cpp .\src\Flimage_Arena.cpp .\src\lodepng.cpp -o .\bin\Flimage_Bench
+g++ -O2 -pthread -DLODEPNG_NO_COMPILE_ALLOCATORS -I.\src .\bench\Flimage_KernelBench.cpp .\src\Flimage_Stats.cpp .\src\Flimage_Trace.cpp .\src\Flimage_Arena.cpp -o .\bin\Flimage_KernelBench
+g++ -O2 -pthread -DLODEPNG_NO_COMPILE_ALLOCATORS -DLODEPNG_COMPILE_PHASE_HOOKS -I.\src .\bench\Flimage_CodecFuzz.cpp .\src\Flimage_Container.cpp .\src\Flimage_Header.cpp .\src\Flimage_Layout.cpp .\src\Flimage_Transform.cpp .\src\Flimage_Dedup.cpp .\src\Flimage_Codec.cpp .\src\Flimage_Sparse.cpp .\src\Flimage_Crypto.cpp .\src\Flimage_Hash.cpp .\src\Flimage_Delta.cpp .\src\Flimage_Shard.cpp .\src\Flimage_Parallel.cpp .\src\Flimage_Race.cpp .\src\Flimage_Pace.cpp .\src\Flimage_Stats.cpp .\src\Flimage_Trace.cpp .\src\Flimage_Arena.cpp .\src\lodepng.cpp -o .\bin\Flimage_CodecFuzz
\ No newline at end of file
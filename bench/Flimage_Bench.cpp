@@ -0,0 +1,548 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define FLIMAGE_BENCH_CLI 1
+#endif
+
+#include "lodepng.h"
+#include "Flimage_Arena.h"
+#include "Flimage_Container.h"
+#include "Flimage_Layout.h"
+
+// End-to-end encode/decode benchmark over a reproducible synthetic corpus, for three targets:
+//   lodepng  lodepng::encode/decode of the payload as one RGBA8 image, the baseline the container builds on
+//   flimage  flimageEncode/flimageDecode in process, with the encoder's default options
+//   cli      the Flimage_Encoder and Flimage_Decoder programs, run in a scratch directory (POSIX only)
+// Reported per run: output ratio, encode and decode MB/s (best of several runs for small payloads), lodepng
+// allocations and arena peak for the in-process targets, and peak RSS of the programs for cli.
+//
+// [Usage] : Flimage_Bench [--sizes=1K,1M,16M] [--classes=text,json,...] [--targets=lodepng,flimage,cli]
+//                         [--bin=<dir with the programs>] [--json=<results.jsonl>] [--compare=<old.jsonl>]
+//                         [--label=<run name>]
+// --json writes one JSON object per line; --compare prints the speed and ratio change against such a file.
+
+static const double kMinSeconds = 0.25;  // small payloads are repeated until this much time is spent...
+static const int kMaxRuns = 20;          // ...but no more often than this
+
+struct BenchResult {
+    std::string target;
+    std::string payload;
+    uint64_t size = 0;
+    uint64_t output = 0;
+    double encodeSeconds = 0;
+    double decodeSeconds = 0;
+    int64_t encodeAllocations = -1;  // -1: not measured
+    int64_t decodeAllocations = -1;
+    int64_t encodePeakKb = -1;       // arena peak in process, peak RSS for cli
+    int64_t decodePeakKb = -1;
+    std::string error;
+};
+
+static uint64_t nextRandom(uint64_t& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static const char* const kClasses[] = {"random", "text", "json", "float32", "jpeg", "sparse", "exe"};
+
+// Log lines with timestamps, a few levels and components, and varying numbers.
+static void makeText(std::vector<unsigned char>& out, size_t size, uint64_t& seed) {
+    static const char* const kLevels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+    static const char* const kWords[] = {"request", "served", "cache", "miss", "for", "user", "session",
+                                         "opened", "closed", "retrying", "upstream", "timeout", "in", "ms"};
+    std::string line;
+    for (uint64_t i = 0; out.size() < size; i++) {
+        line = "2024-03-" + std::to_string(10 + i / 86400 % 20) + "T" + std::to_string(10 + i / 3600 % 14) + ":" +
+               std::to_string(10 + i / 60 % 50) + ":" + std::to_string(10 + i % 50) + " " + kLevels[nextRandom(seed) % 6] +
+               " worker-" + std::to_string(nextRandom(seed) % 16);
+        size_t words = 4 + nextRandom(seed) % 8;
+        for (size_t w = 0; w < words; w++) line += std::string(" ") + kWords[nextRandom(seed) % 14];
+        line += " " + std::to_string(nextRandom(seed) % 5000) + "\n";
+        out.insert(out.end(), line.begin(), line.end());
+    }
+}
+
+// An array of flat records, as an API or a log exporter writes them.
+static void makeJson(std::vector<unsigned char>& out, size_t size, uint64_t& seed) {
+    static const char* const kTags[] = {"\"alpha\"", "\"beta\"", "\"gamma\"", "\"delta\"", "\"prod\"", "\"test\""};
+    std::string record = "[";
+    for (uint64_t id = 0; out.size() < size; id++) {
+        uint64_t r = nextRandom(seed);
+        record += std::string(id ? ",\n" : "\n") + " {\"id\": " + std::to_string(100000 + id) +
+                  ", \"name\": \"user" + std::to_string(r % 100000) + "\", \"email\": \"user" +
+                  std::to_string(r % 100000) + "@example.com\", \"active\": " + (r & 1 ? "true" : "false") +
+                  ", \"score\": " + std::to_string(r % 10000 / 100.0).substr(0, 5) + ", \"tags\": [" +
+                  kTags[r >> 8 & 3] + ", " + kTags[2 + (r >> 12) % 4] + "]}";
+        out.insert(out.end(), record.begin(), record.end());
+        record.clear();
+    }
+}
+
+// Baseline JPEG framing around entropy coded data: high entropy bytes with 0xFF stuffed and restart markers.
+static void makeJpeg(std::vector<unsigned char>& out, size_t size, uint64_t& seed) {
+    static const unsigned char kHeader[] = {
+        0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x48, 0x00, 0x48,
+        0x00, 0x00, 0xFF, 0xDD, 0x00, 0x04, 0x00, 0x40};
+    out.assign(kHeader, kHeader + sizeof(kHeader));
+    out.insert(out.end(), {0xFF, 0xDB, 0x00, 0x43, 0x00});
+    for (int i = 0; i < 64; i++) out.push_back((unsigned char)(2 + i * 3 / 2 + (i % 8)));
+    out.insert(out.end(), {0xFF, 0xC0, 0x00, 0x11, 0x08, 0x04, 0x38, 0x07, 0x80, 0x03,
+                           0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01});
+    out.insert(out.end(), {0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3F, 0x00});
+    unsigned restart = 0;
+    while (out.size() + 2 < size) {
+        uint64_t r = nextRandom(seed);
+        for (int i = 0; i < 8 && out.size() + 2 < size; i++) {
+            unsigned char b = (unsigned char)(r >> (i * 8));
+            out.push_back(b);
+            if (b == 0xFF) out.push_back(0x00);
+        }
+        if (out.size() / 4096 != (out.size() - 8) / 4096) out.insert(out.end(), {0xFF, (unsigned char)(0xD0 + restart++ % 8)});
+    }
+    out.resize(size >= 2 ? size - 2 : 0);
+    out.insert(out.end(), {0xFF, 0xD9});
+}
+
+// x86-64 style code: functions with prologues, register moves, calls to other functions by rel32 and padding,
+// followed by a string table.
+static void makeExe(std::vector<unsigned char>& out, size_t size, uint64_t& seed) {
+    static const unsigned char kOps[][4] = {
+        {0x48, 0x89, 0xC7, 3}, {0x48, 0x8B, 0x45, 3}, {0x89, 0x45, 0xFC, 3}, {0x48, 0x01, 0xD0, 3},
+        {0x85, 0xC0, 0x00, 2}, {0x74, 0x10, 0x00, 2}, {0x31, 0xC0, 0x00, 2}, {0x48, 0x83, 0xEC, 3}};
+    size_t codeSize = size - size / 8;
+    std::vector<size_t> functions;
+    while (out.size() + 16 < codeSize) {
+        functions.push_back(out.size());
+        out.insert(out.end(), {0x55, 0x48, 0x89, 0xE5});
+        size_t body = 8 + nextRandom(seed) % 40;
+        for (size_t i = 0; i < body && out.size() + 16 < codeSize; i++) {
+            uint64_t r = nextRandom(seed);
+            if (r % 5 == 0) {
+                size_t target = functions[(r >> 8) % functions.size()];
+                int32_t rel = (int32_t)((int64_t)target - (int64_t)(out.size() + 5));
+                out.push_back(0xE8);
+                for (int b = 0; b < 4; b++) out.push_back((unsigned char)((uint32_t)rel >> (b * 8)));
+            } else {
+                const unsigned char* op = kOps[r % 8];
+                out.insert(out.end(), op, op + op[3]);
+                if (op[3] == 3 && (r >> 8) % 3 == 0) out.push_back((unsigned char)(r >> 16 & 0x78));
+            }
+        }
+        out.insert(out.end(), {0x5D, 0xC3});
+        while (out.size() % 16) out.push_back(0xCC);
+    }
+    out.resize(codeSize, 0xCC);
+    std::vector<unsigned char> strings;
+    makeText(strings, size - codeSize, seed);
+    for (unsigned char& c : strings) if (c == '\n') c = 0;
+    out.insert(out.end(), strings.begin(), strings.begin() + (size - codeSize));
+}
+
+// FNV-1a, so the corpus is the same whatever standard library built the bench (std::hash isn't).
+static uint64_t nameHash(const std::string& name) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : name) hash = (hash ^ c) * 0x100000001b3ull;
+    return hash;
+}
+
+static std::vector<unsigned char> makePayload(const std::string& name, size_t size) {
+    uint64_t seed = 0x9E3779B97F4A7C15ull ^ nameHash(name) ^ size;
+    seed = seed ? seed : 1;
+    std::vector<unsigned char> data;
+    data.reserve(size + 256);
+    if (name == "random") {
+        data.resize(size);
+        for (size_t i = 0; i < size; i += 8) {
+            uint64_t r = nextRandom(seed);
+            std::memcpy(&data[i], &r, std::min<size_t>(8, size - i));
+        }
+    } else if (name == "text") {
+        makeText(data, size, seed);
+    } else if (name == "json") {
+        makeJson(data, size, seed);
+    } else if (name == "float32") {
+        data.resize(size);
+        for (size_t i = 0; i + 4 <= size; i += 4) {
+            float v = (float)(std::sin(i * 0.00005) * 100.0 + (double)(nextRandom(seed) % 1000) * 1e-4);
+            std::memcpy(&data[i], &v, 4);
+        }
+    } else if (name == "jpeg") {
+        makeJpeg(data, size, seed);
+    } else if (name == "sparse") {
+        // Mostly zero blocks, one in ten 4 KiB blocks holds data
+        data.assign(size, 0);
+        for (size_t block = 0; block < size; block += 4096) {
+            if (nextRandom(seed) % 10) continue;
+            for (size_t i = block; i < std::min(size, block + 4096); i++) data[i] = (unsigned char)nextRandom(seed);
+        }
+    } else if (name == "exe") {
+        makeExe(data, size, seed);
+    } else {
+        throw std::runtime_error("Unknown payload class: " + name);
+    }
+    data.resize(size);
+    return data;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Best time of the job, repeated while it is fast enough to be noisy.
+static double bestTime(const std::function<void()>& job) {
+    double best = 0, total = 0;
+    for (int run = 0; run < kMaxRuns && total < kMinSeconds; run++) {
+        auto start = std::chrono::steady_clock::now();
+        job();
+        double seconds = secondsSince(start);
+        best = run == 0 ? seconds : std::min(best, seconds);
+        total += seconds;
+    }
+    return best;
+}
+
+// Allocations and arena peak of one more run of the job.
+static void measureArena(const std::function<void()>& job, int64_t& allocations, int64_t& peakKb) {
+    flimageArenaClearStats();
+    job();
+    FlimageArenaStats stats = flimageArenaStats();
+    allocations = (int64_t)stats.allocations;
+    peakKb = (int64_t)(stats.peakBytes >> 10);
+}
+
+static void benchLodepng(const std::vector<unsigned char>& payload, BenchResult& result) {
+    FlimageLayout layout = flimagePlanLayout(payload.size(), FlimagePixelFormat::RGBA8);
+    std::vector<unsigned char> image(payload);
+    image.resize((size_t)layout.width * layout.height * 4);
+
+    std::vector<unsigned char> png, pixels;
+    auto encode = [&]() {
+        FlimageArenaScope arena;
+        png.clear();
+        unsigned error = lodepng::encode(png, image, layout.width, layout.height, LCT_RGBA, 8);
+        if (error) throw std::runtime_error(lodepng_error_text(error));
+    };
+    auto decode = [&]() {
+        FlimageArenaScope arena;
+        unsigned width = 0, height = 0;
+        pixels.clear();
+        unsigned error = lodepng::decode(pixels, width, height, png, LCT_RGBA, 8);
+        if (error) throw std::runtime_error(lodepng_error_text(error));
+    };
+    result.encodeSeconds = bestTime(encode);
+    measureArena(encode, result.encodeAllocations, result.encodePeakKb);
+    result.decodeSeconds = bestTime(decode);
+    measureArena(decode, result.decodeAllocations, result.decodePeakKb);
+    if (pixels != image) throw std::runtime_error("Round trip mismatch");
+    result.output = png.size();
+}
+
+static void benchFlimage(const std::string& name, const std::vector<unsigned char>& payload, BenchResult& result) {
+    FlimageFile file;
+    file.name = name;
+    file.ext = "bin";
+    file.data = payload;
+    FlimageEncodeOptions options;
+
+    std::vector<unsigned char> png;
+    FlimageFile decoded;
+    auto encode = [&]() {
+        FlimageArenaScope arena;
+        lodepng::CompressContext context;
+        png = flimageEncode(file, options, context);
+    };
+    auto decode = [&]() {
+        FlimageArenaScope arena;
+        decoded = flimageDecode(png);
+    };
+    result.encodeSeconds = bestTime(encode);
+    measureArena(encode, result.encodeAllocations, result.encodePeakKb);
+    result.decodeSeconds = bestTime(decode);
+    measureArena(decode, result.decodeAllocations, result.decodePeakKb);
+    if (decoded.data != payload) throw std::runtime_error("Round trip mismatch");
+    result.output = png.size();
+}
+
+#ifdef FLIMAGE_BENCH_CLI
+// Runs the program in the directory with output discarded; returns its peak RSS in KiB.
+static int64_t runProgram(const std::string& program, const std::string& arg, const std::string& dir) {
+    pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error("fork failed");
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        if (chdir(dir.c_str()) != 0) _exit(127);
+        execl(program.c_str(), program.c_str(), arg.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) throw std::runtime_error("wait4 failed");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error(program + " failed with status " + std::to_string(WEXITSTATUS(status)));
+#ifdef __APPLE__
+    return (int64_t)(usage.ru_maxrss >> 10);
+#else
+    return (int64_t)usage.ru_maxrss;
+#endif
+}
+
+static bool filesEqual(const std::string& path, const std::vector<unsigned char>& data) {
+    std::ifstream ifs(path, std::ios::binary);
+    std::vector<char> buffer(1 << 20);
+    size_t offset = 0;
+    while (ifs) {
+        ifs.read(buffer.data(), buffer.size());
+        size_t count = (size_t)ifs.gcount();
+        if (count > data.size() - offset || std::memcmp(buffer.data(), data.data() + offset, count) != 0) return false;
+        offset += count;
+    }
+    return offset == data.size();
+}
+
+static void benchCli(const std::string& binDir, const std::string& name, const std::vector<unsigned char>& payload,
+                     BenchResult& result) {
+    namespace fs = std::filesystem;
+    std::string encoder = fs::absolute(fs::path(binDir) / "Flimage_Encoder").string();
+    std::string decoder = fs::absolute(fs::path(binDir) / "Flimage_Decoder").string();
+    if (!fs::exists(encoder) || !fs::exists(decoder))
+        throw std::runtime_error("Flimage_Encoder/Flimage_Decoder not found in " + binDir);
+
+    std::string pattern = (fs::temp_directory_path() / "flimage-bench-XXXXXX").string();
+    if (!mkdtemp(&pattern[0])) throw std::runtime_error("Failed to create a scratch directory");
+    fs::path dir = pattern;
+    struct Cleanup {
+        fs::path dir;
+        ~Cleanup() { std::error_code ec; fs::remove_all(dir, ec); }
+    } cleanup{dir};
+
+    {
+        std::ofstream ofs(dir / (name + ".bin"), std::ios::binary);
+        ofs.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+        if (!ofs) throw std::runtime_error("Failed to write the input file");
+    }
+    fs::create_directory(dir / "out");
+
+    // Start-up cost is part of what the programs cost, so it stays in the times.
+    int64_t rss = 0;
+    result.encodeSeconds = bestTime([&]() { rss = runProgram(encoder, name + ".bin", dir.string()); });
+    result.encodePeakKb = rss;
+    result.output = fs::file_size(dir / (name + ".png"));
+    result.decodeSeconds = bestTime([&]() { rss = runProgram(decoder, "../" + name + ".png", (dir / "out").string()); });
+    result.decodePeakKb = rss;
+    if (!filesEqual((dir / "out" / (name + ".bin")).string(), payload)) throw std::runtime_error("Round trip mismatch");
+}
+#endif
+
+static size_t parseSize(const std::string& text) {
+    size_t pos = 0;
+    double value = std::stod(text, &pos);
+    std::string unit = text.substr(pos);
+    if (unit == "K" || unit == "k") value *= 1024;
+    else if (unit == "M" || unit == "m") value *= 1024.0 * 1024;
+    else if (unit == "G" || unit == "g") value *= 1024.0 * 1024 * 1024;
+    else if (!unit.empty()) throw std::runtime_error("Unknown size unit: " + text);
+    return (size_t)value;
+}
+
+static std::string sizeName(uint64_t size) {
+    static const char* const kUnits[] = {"", "K", "M", "G"};
+    int unit = 0;
+    while (unit < 3 && size >= 1024 && size % 1024 == 0) {
+        size /= 1024;
+        unit++;
+    }
+    return std::to_string(size) + kUnits[unit];
+}
+
+static std::vector<std::string> splitList(const std::string& text) {
+    std::vector<std::string> items;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+static double megabytesPerSecond(uint64_t size, double seconds) {
+    return seconds > 0 ? size / 1e6 / seconds : 0;
+}
+
+static std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        if ((unsigned char)c < 0x20) c = ' ';
+        out += c;
+    }
+    return out;
+}
+
+static std::string toJson(const std::string& label, const BenchResult& r) {
+    auto optional = [](int64_t value) { return value < 0 ? std::string("null") : std::to_string(value); };
+    std::ostringstream os;
+    os << std::setprecision(6) << "{\"label\": \"" << jsonEscape(label) << "\", \"target\": \"" << r.target
+       << "\", \"payload\": \"" << r.payload << "\", \"size\": " << r.size << ", \"output\": " << r.output
+       << ", \"ratio\": " << (r.size ? (double)r.output / r.size : 0)
+       << ", \"encode_mbps\": " << megabytesPerSecond(r.size, r.encodeSeconds)
+       << ", \"decode_mbps\": " << megabytesPerSecond(r.size, r.decodeSeconds)
+       << ", \"encode_allocations\": " << optional(r.encodeAllocations)
+       << ", \"decode_allocations\": " << optional(r.decodeAllocations)
+       << ", \"encode_peak_kb\": " << optional(r.encodePeakKb) << ", \"decode_peak_kb\": " << optional(r.decodePeakKb)
+       << ", \"error\": \"" << jsonEscape(r.error) << "\"}";
+    return os.str();
+}
+
+// Value of a top level field of one result line as written by toJson, without quotes.
+static std::string jsonField(const std::string& line, const std::string& key) {
+    std::string needle = "\"" + key + "\": ";
+    size_t pos = line.find(needle);
+    if (pos == std::string::npos) return "";
+    pos += needle.size();
+    if (pos < line.size() && line[pos] == '"') {
+        size_t end = line.find('"', pos + 1);
+        return end == std::string::npos ? "" : line.substr(pos + 1, end - pos - 1);
+    }
+    size_t end = line.find_first_of(",}", pos);
+    return line.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+}
+
+static std::string resultKey(const std::string& target, const std::string& payload, const std::string& size) {
+    return target + "/" + payload + "/" + size;
+}
+
+static void printCompare(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ifstream ifs(path);
+    if (!ifs.is_open()) throw std::runtime_error("Failed to open " + path);
+    std::map<std::string, std::string> old;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (jsonField(line, "error").empty() && !jsonField(line, "target").empty())
+            old[resultKey(jsonField(line, "target"), jsonField(line, "payload"), jsonField(line, "size"))] = line;
+    }
+
+    auto change = [](double now, double before) {
+        std::ostringstream os;
+        if (before <= 0) return std::string("-");
+        os << std::showpos << std::fixed << std::setprecision(1) << (now / before - 1) * 100 << "%";
+        return os.str();
+    };
+    std::cout << std::endl << "[Compare] : against " << path << std::endl;
+    std::cout << std::left << std::setw(9) << "target" << std::setw(9) << "payload" << std::setw(7) << "size"
+              << std::right << std::setw(10) << "ratio" << std::setw(10) << "enc" << std::setw(10) << "dec" << std::endl;
+    for (const BenchResult& r : results) {
+        auto it = old.find(resultKey(r.target, r.payload, std::to_string(r.size)));
+        if (!r.error.empty() || it == old.end()) continue;
+        double ratio = r.size ? (double)r.output / r.size : 0;
+        std::cout << std::left << std::setw(9) << r.target << std::setw(9) << r.payload << std::setw(7) << sizeName(r.size)
+                  << std::right << std::setw(10) << change(ratio, std::atof(jsonField(it->second, "ratio").c_str()))
+                  << std::setw(10) << change(megabytesPerSecond(r.size, r.encodeSeconds),
+                                             std::atof(jsonField(it->second, "encode_mbps").c_str()))
+                  << std::setw(10) << change(megabytesPerSecond(r.size, r.decodeSeconds),
+                                             std::atof(jsonField(it->second, "decode_mbps").c_str()))
+                  << std::endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        std::vector<std::string> sizes = {"1K", "64K", "1M", "16M"};
+        std::vector<std::string> classes(std::begin(kClasses), std::end(kClasses));
+        std::vector<std::string> targets = {"lodepng", "flimage"};
+#ifdef FLIMAGE_BENCH_CLI
+        targets.push_back("cli");
+#endif
+        std::string binDir = "./bin", jsonPath, comparePath, label = "run";
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 8, "--sizes=") == 0) sizes = splitList(arg.substr(8));
+            else if (arg.compare(0, 10, "--classes=") == 0) classes = splitList(arg.substr(10));
+            else if (arg.compare(0, 10, "--targets=") == 0) targets = splitList(arg.substr(10));
+            else if (arg.compare(0, 6, "--bin=") == 0) binDir = arg.substr(6);
+            else if (arg.compare(0, 7, "--json=") == 0) jsonPath = arg.substr(7);
+            else if (arg.compare(0, 10, "--compare=") == 0) comparePath = arg.substr(10);
+            else if (arg.compare(0, 8, "--label=") == 0) label = arg.substr(8);
+            else throw std::runtime_error("Unknown option: " + arg);
+        }
+
+        std::ofstream json;
+        if (!jsonPath.empty()) {
+            json.open(jsonPath, std::ios::app);
+            if (!json.is_open()) throw std::runtime_error("Failed to open " + jsonPath);
+        }
+
+        std::cout << std::left << std::setw(9) << "target" << std::setw(9) << "payload" << std::setw(7) << "size"
+                  << std::right << std::setw(8) << "ratio" << std::setw(10) << "enc MB/s" << std::setw(10) << "dec MB/s"
+                  << std::setw(11) << "enc allocs" << std::setw(11) << "dec allocs"
+                  << std::setw(11) << "enc peak" << std::setw(11) << "dec peak" << std::endl;
+
+        std::vector<BenchResult> results;
+        for (const std::string& sizeText : sizes) {
+            size_t size = parseSize(sizeText);
+            for (const std::string& name : classes) {
+                std::vector<unsigned char> payload = makePayload(name, size);
+                for (const std::string& target : targets) {
+                    BenchResult r;
+                    r.target = target;
+                    r.payload = name;
+                    r.size = size;
+                    try {
+                        if (target == "lodepng") benchLodepng(payload, r);
+                        else if (target == "flimage") benchFlimage(name, payload, r);
+#ifdef FLIMAGE_BENCH_CLI
+                        else if (target == "cli") benchCli(binDir, name, payload, r);
+#endif
+                        else throw std::runtime_error("Unknown target");
+                    }
+                    catch (const std::exception& e) {
+                        r.error = e.what();
+                    }
+
+                    auto count = [](int64_t value) { return value < 0 ? std::string("-") : std::to_string(value); };
+                    auto kilobytes = [](int64_t value) { return value < 0 ? std::string("-") : std::to_string(value) + "K"; };
+                    std::cout << std::left << std::setw(9) << target << std::setw(9) << name << std::setw(7) << sizeName(size);
+                    if (!r.error.empty()) {
+                        std::cout << " [Error] : " << r.error << std::endl;
+                    } else {
+                        std::cout << std::right << std::setw(8) << std::fixed << std::setprecision(3)
+                                  << (size ? (double)r.output / size : 0) << std::setprecision(1)
+                                  << std::setw(10) << megabytesPerSecond(size, r.encodeSeconds)
+                                  << std::setw(10) << megabytesPerSecond(size, r.decodeSeconds)
+                                  << std::setw(11) << count(r.encodeAllocations) << std::setw(11) << count(r.decodeAllocations)
+                                  << std::setw(11) << kilobytes(r.encodePeakKb) << std::setw(11) << kilobytes(r.decodePeakKb)
+                                  << std::endl;
+                    }
+                    if (json.is_open()) json << toJson(label, r) << std::endl;
+                    results.push_back(r);
+                }
+            }
+        }
+
+        if (!comparePath.empty()) printCompare(comparePath, results);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "[Error] : " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,304 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "lodepng.h"
+#include "Flimage_Arena.h"
+#include "Flimage_Codec.h"
+#include "Flimage_Container.h"
+#include "Flimage_Hash.h"
+
+// Randomized round trips of the payload codecs, and decodes of broken streams. Each iteration makes a payload
+// (random bytes, runs, text over a small alphabet, or repeated blocks with changes) and checks that:
+//   - flimageLzDecompress gives back exactly what flimageLzCompress was given;
+//   - the stream cut short, with trailing bytes added, or with a size that doesn't match is rejected with
+//     std::runtime_error;
+//   - the stream with bits flipped either is rejected with std::runtime_error or decodes to the declared size.
+// Every few iterations the payload also goes through flimageEncode/flimageDecode with each codec, and the PNG,
+// cut short or with a bit flipped, must be rejected or decode to the original payload. Build with
+// -fsanitize=address,undefined to catch reads and writes out of bounds, which the checks can't see. Before the
+// fuzzing, flimageHash128 is checked against vectors of the reference XXH3-128, one per input size class, and
+// encodes with a time budget they meet anyway against the same encodes without one.
+//
+// [Usage] : Flimage_CodecFuzz [--iterations=<n>] [--seed=<n>] [--max-size=<bytes>]
+// A failure prints the seed and iteration; rerun with that seed to reproduce it. The exit code is 1 on failure.
+
+static const int kDefaultIterations = 2000;
+static const size_t kDefaultMaxSize = 1 << 16;
+static const int kContainerEvery = 50;  // iterations between container round trips, which are much slower
+static const int kMutations = 8;        // broken streams tried per iteration and kind
+static const uint64_t kPacePayloads = 8;
+static const size_t kPacePayloadSize = 1 << 19;
+static const double kPaceSeconds = 1000;
+
+static uint64_t nextRandom(uint64_t& state) {
+    // splitmix64
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static size_t randomBelow(uint64_t& state, size_t bound) {
+    return bound ? (size_t)(nextRandom(state) % bound) : 0;
+}
+
+// Mostly small sizes, where the edge cases of the format are, and now and then one up to the maximum.
+static size_t randomSize(uint64_t& state, size_t maxSize) {
+    switch (randomBelow(state, 4)) {
+    case 0: return randomBelow(state, 33);
+    case 1: return randomBelow(state, std::min<size_t>(maxSize, 1024) + 1);
+    default: return randomBelow(state, maxSize + 1);
+    }
+}
+
+static std::vector<unsigned char> makePayload(uint64_t& state, size_t size) {
+    std::vector<unsigned char> data(size);
+    switch (randomBelow(state, 4)) {
+    case 0:
+        for (unsigned char& c : data) c = (unsigned char)nextRandom(state);
+        break;
+    case 1:
+        for (size_t i = 0; i < size;) {
+            unsigned char c = (unsigned char)nextRandom(state);
+            size_t run = 1 + randomBelow(state, 300);
+            for (; run && i < size; run--) data[i++] = c;
+        }
+        break;
+    case 2: {
+        size_t alphabet = 2 + randomBelow(state, 14);
+        for (unsigned char& c : data) c = (unsigned char)('a' + randomBelow(state, alphabet));
+        break;
+    }
+    default: {
+        // Copies at distances up to past the 64 KiB window, with a changed byte here and there.
+        std::vector<unsigned char> block(1 + randomBelow(state, 70000));
+        for (unsigned char& c : block) c = (unsigned char)nextRandom(state);
+        for (size_t i = 0; i < size; i++) {
+            data[i] = block[i % block.size()];
+            if (randomBelow(state, 64) == 0) data[i] = (unsigned char)nextRandom(state);
+        }
+        break;
+    }
+    }
+    return data;
+}
+
+// XXH3-128 of the first `size` bytes of hashVectorInput, from the reference implementation (xxHash 0.8).
+struct HashVector {
+    size_t size;
+    uint64_t low;
+    uint64_t high;
+};
+
+static const HashVector kHashVectors[] = {
+    {0, 0x6001c324468d497full, 0x99aa06d3014798d8ull},
+    {1, 0xd0d496e05c553485ull, 0x9b0498cbe3839becull},
+    {3, 0xcb412fafd0e16539ull, 0x40fd6d4c1733b791ull},
+    {4, 0x94e8a42e3fde2f3cull, 0xcfa7a25b380e8794ull},
+    {8, 0x8cf4595c3ded82c4ull, 0x0ea5595f3c517227ull},
+    {9, 0x0e6590c559b97d51ull, 0x0863d5434d0bb667ull},
+    {16, 0x5f63d26c27fc5ed8ull, 0xaaa7cefba2ec99ecull},
+    {17, 0x4832992d5d4ec78eull, 0x705b74d91fd1110bull},
+    {128, 0x25a6f59a534d8b00ull, 0xe31cc5c076785ee3ull},
+    {129, 0x2e245c759c4b65c3ull, 0xe35528a527842255ull},
+    {240, 0x6c4652972224900dull, 0xaae386df4761e3fcull},
+    {241, 0x98aa8179cc71fcb5ull, 0x593e46d7c38dc0e6ull},
+    {1024, 0x0bd018ef80ebcb8full, 0xafe46da658ad2edeull},
+    {1025, 0xe32bac2d01c31f3bull, 0xcd9a89fc27c25dfdull},
+    {4096, 0x8d2d725c460268bbull, 0xfe6966840e38782aull},
+    {100003, 0xe81a9475222c5464ull, 0x7bb249eeac39d0b3ull},
+};
+
+// The top bytes of a 32-bit LCG, simple to reproduce for any other implementation.
+static std::vector<unsigned char> hashVectorInput(size_t size) {
+    std::vector<unsigned char> data(size);
+    uint32_t state = 1;
+    for (unsigned char& c : data) {
+        state = state * 1103515245u + 12345u;
+        c = (unsigned char)(state >> 24);
+    }
+    return data;
+}
+
+// Returns the number of vectors that don't match.
+static int checkHashVectors() {
+    std::vector<unsigned char> input = hashVectorInput(100003);
+    int failures = 0;
+    for (const HashVector& vector : kHashVectors) {
+        FlimageHash128 hash = flimageHash128(input.data(), vector.size);
+        if (hash.low != vector.low || hash.high != vector.high) {
+            std::cerr << "[Fail] : XXH3-128 of " << vector.size << " bytes doesn't match the reference" << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// Encodes payloads with and without a time budget they are sure to meet: the pace then keeps the unpaced
+// settings throughout, so the paced PNG must not be the larger one. Returns the number of payloads where it is.
+static int checkPacing() {
+    int failures = 0;
+    for (uint64_t payloadState = 0; payloadState < kPacePayloads; payloadState++) {
+        uint64_t state = payloadState;
+        FlimageFile file;
+        file.name = "pace";
+        file.ext = "bin";
+        file.data = makePayload(state, kPacePayloadSize);
+        FlimageEncodeOptions options;
+
+        FlimageArenaScope arena;
+        lodepng::CompressContext context;
+        size_t unpaced = flimageEncode(file, options, context).size();
+        options.pace.seconds = kPaceSeconds;
+        size_t paced = flimageEncode(file, options, context).size();
+        if (paced > unpaced) {
+            std::cerr << "[Fail] : paced encode of payload " << payloadState << " is " << paced << " bytes, unpaced "
+                      << unpaced << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+struct FuzzContext {
+    uint64_t seed;
+    int iteration;
+    int failures = 0;
+
+    void fail(const std::string& what) {
+        failures++;
+        std::cerr << "[Fail] : seed " << seed << ", iteration " << iteration << " : " << what << std::endl;
+    }
+};
+
+// Runs the decode; returns false when it threw std::runtime_error. Any other exception is a failure.
+template <typename Decode>
+static bool decodes(FuzzContext& fuzz, const std::string& what, Decode decode) {
+    try {
+        decode();
+        return true;
+    }
+    catch (const std::runtime_error&) {
+        return false;
+    }
+    catch (const std::exception& e) {
+        fuzz.fail(what + " threw " + e.what());
+        return false;
+    }
+}
+
+static void fuzzLz(FuzzContext& fuzz, uint64_t& state, const std::vector<unsigned char>& payload) {
+    std::vector<unsigned char> stream = flimageLzCompress(payload.data(), payload.size());
+    std::vector<unsigned char> output;
+    if (!decodes(fuzz, "lz round trip", [&]() { output = flimageLzDecompress(stream.data(), stream.size(),
+                                                                             payload.size()); })) {
+        fuzz.fail("lz round trip of " + std::to_string(payload.size()) + " bytes rejected");
+        return;
+    }
+    if (output != payload) fuzz.fail("lz round trip of " + std::to_string(payload.size()) + " bytes differs");
+
+    for (int m = 0; m < kMutations && !stream.empty(); m++) {
+        size_t cut = randomBelow(state, stream.size());
+        if (decodes(fuzz, "truncated lz", [&]() { flimageLzDecompress(stream.data(), cut, payload.size()); }))
+            fuzz.fail("lz stream cut to " + std::to_string(cut) + " of " + std::to_string(stream.size()) +
+                      " bytes accepted");
+    }
+    for (int m = 0; m < kMutations; m++) {
+        std::vector<unsigned char> extended = stream;
+        size_t extra = 1 + randomBelow(state, 16);
+        for (size_t i = 0; i < extra; i++) extended.push_back((unsigned char)nextRandom(state));
+        if (decodes(fuzz, "extended lz", [&]() {
+                flimageLzDecompress(extended.data(), extended.size(), payload.size()); }))
+            fuzz.fail("lz stream with " + std::to_string(extra) + " trailing bytes accepted");
+    }
+    for (uint64_t wrong : {(uint64_t)payload.size() + 1 + randomBelow(state, 100),
+                           (uint64_t)payload.size() - std::min<size_t>(payload.size(), 1 + randomBelow(state, 100))}) {
+        if (wrong == payload.size()) continue;
+        if (decodes(fuzz, "resized lz", [&]() { flimageLzDecompress(stream.data(), stream.size(), wrong); }))
+            fuzz.fail("lz stream of " + std::to_string(payload.size()) + " bytes accepted as " +
+                      std::to_string(wrong));
+    }
+    for (int m = 0; m < kMutations && !stream.empty(); m++) {
+        std::vector<unsigned char> flipped = stream;
+        size_t flips = 1 + randomBelow(state, 3);
+        for (size_t i = 0; i < flips; i++)
+            flipped[randomBelow(state, flipped.size())] ^= (unsigned char)(1u << randomBelow(state, 8));
+        std::vector<unsigned char> result;
+        if (decodes(fuzz, "flipped lz", [&]() {
+                result = flimageLzDecompress(flipped.data(), flipped.size(), payload.size()); }) &&
+            result.size() != payload.size())
+            fuzz.fail("lz stream with flipped bits decoded to the wrong size");
+    }
+}
+
+static void fuzzContainer(FuzzContext& fuzz, uint64_t& state, const std::vector<unsigned char>& payload) {
+    for (FlimageCodec codec : {FlimageCodec::Deflate, FlimageCodec::Lz, FlimageCodec::Zlib}) {
+        std::string name = flimageCodecName(codec);
+        FlimageFile file;
+        file.name = "fuzz";
+        file.ext = "bin";
+        file.data = payload;
+        FlimageEncodeOptions options;
+        options.codec = codec;
+
+        FlimageArenaScope arena;
+        std::vector<unsigned char> png;
+        {
+            lodepng::CompressContext context;
+            png = flimageEncode(file, options, context);
+        }
+        FlimageFile decoded;
+        if (!decodes(fuzz, name + " container", [&]() { decoded = flimageDecode(png); })) {
+            fuzz.fail(name + " container round trip of " + std::to_string(payload.size()) + " bytes rejected");
+            continue;
+        }
+        if (decoded.data != payload) fuzz.fail(name + " container round trip differs");
+
+        for (int m = 0; m < kMutations; m++) {
+            std::vector<unsigned char> broken = png;
+            if (m & 1) broken.resize(randomBelow(state, png.size()));
+            else broken[randomBelow(state, broken.size())] ^= (unsigned char)(1u << randomBelow(state, 8));
+            if (decodes(fuzz, name + " broken container", [&]() { decoded = flimageDecode(broken); }) &&
+                decoded.data != payload)
+                fuzz.fail(name + " container with a broken PNG decoded to other data");
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        int iterations = kDefaultIterations;
+        size_t maxSize = kDefaultMaxSize;
+        uint64_t seed = 1;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 13, "--iterations=") == 0) iterations = std::max(1, std::atoi(arg.c_str() + 13));
+            else if (arg.compare(0, 7, "--seed=") == 0) seed = std::strtoull(arg.c_str() + 7, nullptr, 10);
+            else if (arg.compare(0, 11, "--max-size=") == 0) maxSize = std::strtoull(arg.c_str() + 11, nullptr, 10);
+            else throw std::runtime_error("Unknown option: " + arg);
+        }
+
+        FuzzContext fuzz{seed, 0};
+        fuzz.failures = checkHashVectors() + checkPacing();
+        for (fuzz.iteration = 0; fuzz.iteration < iterations; fuzz.iteration++) {
+            // Every iteration has a state of its own, so what it tests doesn't depend on the ones before.
+            uint64_t state = seed * 0x100000001b3ull + (uint64_t)fuzz.iteration;
+            std::vector<unsigned char> payload = makePayload(state, randomSize(state, maxSize));
+            fuzzLz(fuzz, state, payload);
+            if (fuzz.iteration % kContainerEvery == 0) fuzzContainer(fuzz, state, payload);
+        }
+
+        std::cout << "[Fuzz] : " << iterations << " iterations, seed " << seed << ", " << fuzz.failures
+                  << " failures" << std::endl;
+        return fuzz.failures ? 1 : 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "[Error] : " << e.what() << std::endl;
+        return 1;
+    }
+}
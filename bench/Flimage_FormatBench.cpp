@@ -0,0 +1,142 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "lodepng.h"
+#include "Flimage_Arena.h"
+#include "Flimage_Container.h"
+
+// Compressed size and encode/decode speed of every pixel format, and of the built-in LZ codec, on synthetic
+// payload classes.
+
+struct PayloadClass {
+    const char* name;
+    std::vector<unsigned char> data;
+};
+
+static uint32_t nextRandom(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static std::vector<PayloadClass> makeCorpus(size_t size) {
+    std::vector<PayloadClass> corpus;
+    uint32_t seed = 12345;
+
+    std::vector<unsigned char> random(size);
+    for (auto& b : random) b = (unsigned char)nextRandom(seed);
+    corpus.push_back({"random", random});
+
+    std::string text;
+    for (size_t i = 0; text.size() < size; i++)
+        text += "2024-01-01T00:00:" + std::to_string(i % 60) + " worker-" + std::to_string(i % 7)
+              + " request served in " + std::to_string(nextRandom(seed) % 500) + " ms\n";
+    corpus.push_back({"text", std::vector<unsigned char>(text.begin(), text.begin() + size)});
+
+    std::vector<unsigned char> floats(size);
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        float v = (float)std::sin(i * 0.0001);
+        std::memcpy(&floats[i], &v, 4);
+    }
+    corpus.push_back({"float32", floats});
+
+    std::vector<unsigned char> counters(size);
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t v = 1700000000000ull + i * 125 + nextRandom(seed) % 16;
+        std::memcpy(&counters[i], &v, 8);
+    }
+    corpus.push_back({"int64", counters});
+
+    // 20-byte records: u32 sequence number, two slowly drifting floats, u64 timestamp
+    std::vector<unsigned char> records(size);
+    for (size_t i = 0; i + 20 <= size; i += 20) {
+        uint32_t id = (uint32_t)(i / 20);
+        float x = (float)std::cos(id * 0.001), y = (float)(id % 1000) * 0.5f;
+        uint64_t t = 1700000000000ull + id * 1000ull + nextRandom(seed) % 8;
+        std::memcpy(&records[i], &id, 4);
+        std::memcpy(&records[i + 4], &x, 4);
+        std::memcpy(&records[i + 8], &y, 4);
+        std::memcpy(&records[i + 12], &t, 8);
+    }
+    corpus.push_back({"struct20", records});
+
+    std::vector<unsigned char> rgb(size);
+    for (size_t i = 0; i < size; i++) rgb[i] = (unsigned char)(((i / 3) % 512) / 2 + (i % 3) * 40);
+    corpus.push_back({"rgb", rgb});
+
+    std::vector<unsigned char> sparse(size, 0);
+    for (size_t i = 0; i < size; i += 4096) sparse[i] = (unsigned char)nextRandom(seed);
+    corpus.push_back({"sparse", sparse});
+
+    // A random quarter repeated three times with small edits, like disk images sharing most blocks
+    std::vector<unsigned char> image(size);
+    size_t quarter = size / 4;
+    for (size_t i = 0; i < size; i++) image[i] = i < quarter ? (unsigned char)nextRandom(seed) : image[i - quarter];
+    for (size_t i = quarter; i < size; i += 100000) image[i] = (unsigned char)nextRandom(seed);
+    corpus.push_back({"repeats", image});
+    return corpus;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        size_t size = argc > 1 ? (size_t)std::stoul(argv[1]) : 4u << 20;
+        std::vector<std::pair<std::string, FlimageEncodeOptions>> configs;
+        for (FlimagePixelFormat format : {FlimagePixelFormat::Grey8, FlimagePixelFormat::RGB8, FlimagePixelFormat::RGBA8,
+                                          FlimagePixelFormat::RGBA16, FlimagePixelFormat::Auto}) {
+            FlimageEncodeOptions options;
+            options.format = format;
+            configs.push_back({flimagePixelFormatName(format), options});
+        }
+        FlimageEncodeOptions lz;
+        lz.codec = FlimageCodec::Lz;
+        configs.push_back({"lz", lz});
+
+        std::cout << std::left << std::setw(10) << "payload" << std::setw(8) << "format"
+                  << std::right << std::setw(12) << "bytes" << std::setw(9) << "ratio"
+                  << std::setw(12) << "enc MB/s" << std::setw(12) << "dec MB/s" << std::endl;
+
+        for (const PayloadClass& payload : makeCorpus(size)) {
+            for (const auto& config : configs) {
+                FlimageArenaScope arena;
+                lodepng::CompressContext context;
+                FlimageFile file;
+                file.name = payload.name;
+                file.data = payload.data;
+
+                auto start = std::chrono::steady_clock::now();
+                std::vector<unsigned char> png = flimageEncode(file, config.second, context);
+                double encodeSeconds = secondsSince(start);
+
+                start = std::chrono::steady_clock::now();
+                FlimageFile decoded = flimageDecode(png);
+                double decodeSeconds = secondsSince(start);
+                if (decoded.data != payload.data) throw std::runtime_error("Round trip mismatch");
+
+                double megabytes = payload.data.size() / 1e6;
+                std::cout << std::left << std::setw(10) << payload.name << std::setw(8) << config.first
+                          << std::right << std::setw(12) << png.size()
+                          << std::setw(9) << std::fixed << std::setprecision(3) << (double)png.size() / payload.data.size()
+                          << std::setw(12) << std::setprecision(1) << megabytes / encodeSeconds
+                          << std::setw(12) << megabytes / decodeSeconds << std::endl;
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "[Error] : " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,375 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+// The kernels are static functions of lodepng.cpp, so this bench is built together with it in one
+// translation unit instead of linking lodepng.cpp. Build with -DLODEPNG_NO_COMPILE_ALLOCATORS and
+// Flimage_Arena.cpp (with Flimage_Stats.cpp and Flimage_Trace.cpp), the way the programs are built.
+#include "lodepng.cpp"
+#include "Flimage_Arena.h"
+
+// Micro-benchmarks of the lodepng kernels on fixed inputs: a 1024x512 RGBA8 image with gradients, noise and
+// flat regions (also filtered as 3-byte grey8 rows), and the deflate stream lodepng makes of it. Every kernel
+// is warmed up, then timed for a number of runs; the median is reported together with the spread between the
+// quartiles. Before that, the banded encoding is checked against the whole-image one for every filter
+// strategy.
+//
+// [Usage] : Flimage_KernelBench [--runs=<n>] [--filter=<substring>] [--save=<baseline>]
+//                               [--baseline=<file>] [--threshold=<percent>]
+// With --baseline, every kernel whose median is more than --threshold percent (default 5) slower than in the
+// baseline, and by more than its own spread, is flagged, and the exit code is 1.
+
+static const unsigned kWidth = 1024;
+static const unsigned kHeight = 512;
+static const int kWarmupRuns = 3;
+static const int kDefaultRuns = 15;
+static const double kDefaultThreshold = 5.0;
+
+struct KernelResult {
+    std::string name;
+    size_t bytes = 0;
+    double medianSeconds = 0;
+    double spread = 0;  // interquartile range relative to the median
+};
+
+static uint32_t nextRandom(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static std::vector<unsigned char> makeImage() {
+    std::vector<unsigned char> image((size_t)kWidth * kHeight * 4);
+    uint32_t seed = 2463534242u;
+    for (unsigned y = 0; y < kHeight; y++) {
+        for (unsigned x = 0; x < kWidth; x++) {
+            unsigned char* pixel = &image[((size_t)y * kWidth + x) * 4];
+            bool flat = (x / 128 + y / 128) % 4 == 0;
+            uint32_t noise = flat ? 0 : nextRandom(seed) % 9;
+            pixel[0] = (unsigned char)(x / 4 + noise);
+            pixel[1] = (unsigned char)(y / 2 + noise);
+            pixel[2] = (unsigned char)((x + y) / 6);
+            pixel[3] = flat ? 255 : (unsigned char)(200 + noise);
+        }
+    }
+    return image;
+}
+
+// Median and quartile spread of the job's time after warmup.
+static KernelResult timeKernel(const std::string& name, size_t bytes, int runs, const std::function<void()>& job) {
+    for (int i = 0; i < kWarmupRuns; i++) job();
+    std::vector<double> times;
+    for (int i = 0; i < runs; i++) {
+        auto start = std::chrono::steady_clock::now();
+        job();
+        times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    KernelResult result;
+    result.name = name;
+    result.bytes = bytes;
+    result.medianSeconds = times[times.size() / 2];
+    double q1 = times[times.size() / 4], q3 = times[times.size() * 3 / 4];
+    result.spread = result.medianSeconds > 0 ? (q3 - q1) / result.medianSeconds : 0;
+    return result;
+}
+
+static void check(unsigned error) {
+    if (error) throw std::runtime_error(lodepng_error_text(error));
+}
+
+static std::vector<KernelResult> runKernels(int runs, const std::string& filter) {
+    std::vector<KernelResult> results;
+    auto bench = [&](const std::string& name, size_t bytes, const std::function<void()>& job) {
+        if (!filter.empty() && name.find(filter) == std::string::npos) return;
+        FlimageArenaScope arena;
+        results.push_back(timeKernel(name, bytes, runs, job));
+    };
+
+    const std::vector<unsigned char> image = makeImage();
+    const size_t stride = (size_t)kWidth * 4;
+    volatile unsigned sink = 0;
+
+    bench("crc32", image.size(), [&]() { sink = lodepng_crc32(image.data(), image.size()); });
+    bench("adler32", image.size(), [&]() { sink = update_adler32(1u, image.data(), (unsigned)image.size()); });
+
+    static const char* const kFilterNames[] = {"none", "sub", "up", "average", "paeth"};
+    std::vector<unsigned char> filtered(image.size());
+    std::vector<unsigned char> recon(image.size());
+    for (unsigned char type = 0; type < 5; type++) {
+        bench(std::string("filter_") + kFilterNames[type], image.size(), [&]() {
+            for (unsigned y = 0; y < kHeight; y++)
+                filterScanline(&filtered[y * stride], &image[y * stride], y ? &image[(y - 1) * stride] : nullptr,
+                               stride, 4, type);
+        });
+        for (unsigned y = 0; y < kHeight; y++)
+            filterScanline(&filtered[y * stride], &image[y * stride], y ? &image[(y - 1) * stride] : nullptr,
+                           stride, 4, type);
+        size_t before = results.size();
+        bench(std::string("unfilter_") + kFilterNames[type], image.size(), [&]() {
+            for (unsigned y = 0; y < kHeight; y++)
+                check(unfilterScanline(&recon[y * stride], &filtered[y * stride], y ? &recon[(y - 1) * stride] : nullptr,
+                                       4, type, stride));
+        });
+        if (results.size() != before && recon != image)
+            throw std::runtime_error(std::string("unfilter_") + kFilterNames[type] + " doesn't restore the image");
+    }
+
+    // The adaptive strategies, which pick one of the filters above per scanline.
+    LodePNGColorMode rgba;
+    lodepng_color_mode_init(&rgba);
+    std::vector<unsigned char> scanlines((size_t)kHeight * (stride + 1));
+    static const LodePNGFilterStrategy kStrategies[] = {LFS_MINSUM, LFS_ENTROPY, LFS_SAMPLED};
+    static const char* const kStrategyNames[] = {"minsum", "entropy", "sampled"};
+    for (int i = 0; i < 3; i++) {
+        LodePNGEncoderSettings encoder;
+        lodepng_encoder_settings_init(&encoder);
+        encoder.filter_strategy = kStrategies[i];
+        bench(std::string("filter_") + kStrategyNames[i], image.size(), [&]() {
+            check(filterRows(scanlines.data(), image.data(), kWidth, 0, kHeight, &rgba, &encoder));
+        });
+    }
+
+    // The same bytes as grey8 rows of 3, the shape the record layouts give narrow tables: sampling must not cost
+    // more there than scoring every row.
+    LodePNGColorMode grey;
+    lodepng_color_mode_init(&grey);
+    grey.colortype = LCT_GREY;
+    const unsigned narrowWidth = 3;
+    const unsigned narrowHeight = (unsigned)(image.size() / narrowWidth);
+    std::vector<unsigned char> narrowScanlines((size_t)narrowHeight * (narrowWidth + 1));
+    static const LodePNGFilterStrategy kNarrowStrategies[] = {LFS_MINSUM, LFS_SAMPLED};
+    static const char* const kNarrowNames[] = {"filter_minsum_narrow", "filter_sampled_narrow"};
+    for (int i = 0; i < 2; i++) {
+        LodePNGEncoderSettings encoder;
+        lodepng_encoder_settings_init(&encoder);
+        encoder.filter_strategy = kNarrowStrategies[i];
+        bench(kNarrowNames[i], (size_t)narrowHeight * narrowWidth, [&]() {
+            check(filterRows(narrowScanlines.data(), image.data(), narrowWidth, 0, narrowHeight, &grey, &encoder));
+        });
+    }
+
+    // The deflate kernels see what the encoder feeds them: the image with the Paeth filter.
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+
+    Hash hash;
+    hash_init(&hash);
+    check(hash_alloc(&hash, settings.windowsize));
+    uivector symbols;
+    uivector_init(&symbols);
+    bench("lz77", filtered.size(), [&]() {
+        hash_reset(&hash, settings.windowsize, settings.windowsize);
+        symbols.size = 0;
+        check(encodeLZ77(&symbols, &hash, filtered.data(), 0, filtered.size(), settings.windowsize,
+                         settings.minmatch, settings.nicematch, settings.lazymatching));
+    });
+    // Many small inputs through one context, where resetting the hash can cost more than the LZ77 itself.
+    const size_t smallInput = 1024;
+    bench("lz77_small", smallInput, [&]() {
+        hash_reset(&hash, settings.windowsize, settings.windowsize);
+        symbols.size = 0;
+        check(encodeLZ77(&symbols, &hash, filtered.data(), 0, smallInput, settings.windowsize,
+                         settings.minmatch, settings.nicematch, settings.lazymatching));
+    });
+    uivector_cleanup(&symbols);
+    hash_cleanup(&hash);
+
+    // One dynamic block over the whole input: LZ77 plus Huffman tree construction and entropy coding.
+    LodePNGCompressContext* context = lodepng_compress_context_create();
+    if (!context) throw std::runtime_error("Out of memory");
+    ucvector deflated = ucvector_init(NULL, 0);
+    auto deflate = [&]() {
+        LodePNGBitWriter writer;
+        deflated.size = 0;
+        LodePNGBitWriter_init(&writer, &deflated);
+        unsigned error = compress_context_reset(context, settings.windowsize);
+        if (!error) error = deflateDynamic(&writer, context, filtered.data(), 0, filtered.size(), &settings, 1);
+        check(error);
+    };
+    deflate();  // the stream inflate_huffman reads, also when deflate_dynamic is filtered out
+    bench("deflate_dynamic", filtered.size(), deflate);
+    lodepng_compress_context_destroy(context);
+
+    ucvector inflated = ucvector_init(NULL, 0);
+    bench("inflate_huffman", filtered.size(), [&]() {
+        LodePNGBitReader reader = {};
+        check(LodePNGBitReader_init(&reader, deflated.data, deflated.size));
+        ensureBits9(&reader, 3);
+        unsigned header = readBits(&reader, 3);
+        if (header != 5) throw std::runtime_error("Expected one final dynamic block");
+        inflated.size = 0;
+        check(inflateHuffmanBlock(&inflated, &reader, 2, 0));
+    });
+    if (inflated.size && (inflated.size != filtered.size() ||
+                          std::memcmp(inflated.data, filtered.data(), filtered.size()) != 0))
+        throw std::runtime_error("inflate_huffman doesn't restore the input");
+    lodepng_free(deflated.data);
+    lodepng_free(inflated.data);
+
+    // The whole encoder, with the filter, deflate and checksum passes over the full image, or fused per band.
+    std::vector<unsigned char> pngs[2];
+    for (unsigned banded = 0; banded < 2; banded++) {
+        bench(banded ? "encode_banded" : "encode_whole", image.size(), [&]() {
+            lodepng::State state;
+            state.encoder.auto_convert = 0;
+            state.encoder.banded = banded;
+            pngs[banded].clear();
+            check(lodepng::encode(pngs[banded], image, kWidth, kHeight, state));
+        });
+    }
+    if (!pngs[0].empty() && !pngs[1].empty() && pngs[0] != pngs[1])
+        throw std::runtime_error("encode_banded doesn't make the same PNG as encode_whole");
+
+    LodePNGColorMode rgb;
+    lodepng_color_mode_init(&rgb);
+    rgb.colortype = LCT_RGB;
+    // Opaque, so the scan can't stop early at the first translucent pixel.
+    std::vector<unsigned char> opaque(image);
+    for (size_t i = 3; i < opaque.size(); i += 4) opaque[i] = 255;
+    bench("color_stats", opaque.size(), [&]() {
+        LodePNGColorStats stats;
+        lodepng_color_stats_init(&stats);
+        check(lodepng_compute_color_stats(&stats, opaque.data(), kWidth, kHeight, &rgba));
+    });
+    std::vector<unsigned char> converted((size_t)kWidth * kHeight * 3);
+    bench("convert_rgba8_rgb8", image.size(), [&]() {
+        check(lodepng_convert(converted.data(), image.data(), &rgb, &rgba, kWidth, kHeight));
+    });
+    std::vector<unsigned char> expanded(image.size());
+    bench("convert_rgb8_rgba8", converted.size(), [&]() {
+        check(lodepng_convert(expanded.data(), converted.data(), &rgba, &rgb, kWidth, kHeight));
+    });
+    // The top bits of the image's red channel as 4-bit indices into a palette of 16 colors.
+    LodePNGColorMode palette4;
+    lodepng_color_mode_init(&palette4);
+    palette4.colortype = LCT_PALETTE;
+    palette4.bitdepth = 4;
+    for (unsigned i = 0; i < 16; i++) check(lodepng_palette_add(&palette4, i * 17, 255 - i * 16, i * 5, 255));
+    std::vector<unsigned char> indices(image.size() / 8);
+    for (size_t i = 0; i < indices.size(); i++)
+        indices[i] = (unsigned char)((image[i * 8] & 0xf0) | image[i * 8 + 4] >> 4);
+    bench("convert_palette4_rgba8", indices.size(), [&]() {
+        check(lodepng_convert(expanded.data(), indices.data(), &rgba, &palette4, kWidth, kHeight));
+    });
+    lodepng_color_mode_cleanup(&palette4);
+    (void)sink;
+    return results;
+}
+
+// The banded encoding must make the same PNG as the whole-image passes with every filter strategy, with and
+// without a compression context: filter strategies that deflate trial rows run between the bands' deflates.
+static void checkBanded() {
+    static const LodePNGFilterStrategy kStrategies[] = {LFS_ZERO, LFS_ONE, LFS_TWO, LFS_THREE, LFS_FOUR,
+                                                         LFS_MINSUM, LFS_ENTROPY, LFS_BRUTE_FORCE,
+                                                         LFS_PREDEFINED, LFS_SAMPLED};
+    static const unsigned kCheckHeight = 128;  // several deflate blocks, for brute force to finish quickly
+    std::vector<unsigned char> image = makeImage();
+    image.resize((size_t)kWidth * kCheckHeight * 4);
+    std::vector<unsigned char> predefined(kCheckHeight);
+    for (unsigned y = 0; y < kCheckHeight; y++) predefined[y] = (unsigned char)(y % 5);
+    lodepng::CompressContext context;
+    for (LodePNGFilterStrategy strategy : kStrategies) {
+        for (unsigned withContext = 0; withContext < 2; withContext++) {
+            std::vector<unsigned char> pngs[2];
+            for (unsigned banded = 0; banded < 2; banded++) {
+                lodepng::State state;
+                state.encoder.auto_convert = 0;
+                state.encoder.filter_strategy = strategy;
+                state.encoder.predefined_filters = predefined.data();
+                state.encoder.zlibsettings.context = withContext ? context.get() : nullptr;
+                state.encoder.banded = banded;
+                check(lodepng::encode(pngs[banded], image, kWidth, kCheckHeight, state));
+            }
+            if (pngs[0] != pngs[1]) {
+                throw std::runtime_error("banded encoding with filter strategy " + std::to_string(strategy) +
+                                         (withContext ? " and" : " without") + " a context differs");
+            }
+        }
+    }
+}
+
+static std::map<std::string, double> readBaseline(const std::string& path) {
+    std::ifstream ifs(path);
+    if (!ifs.is_open()) throw std::runtime_error("Failed to open " + path);
+    std::map<std::string, double> baseline;
+    std::string name;
+    double seconds;
+    while (ifs >> name >> seconds) baseline[name] = seconds;
+    return baseline;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        int runs = kDefaultRuns;
+        double threshold = kDefaultThreshold;
+        std::string filter, savePath, baselinePath;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 7, "--runs=") == 0) runs = std::max(1, std::atoi(arg.c_str() + 7));
+            else if (arg.compare(0, 9, "--filter=") == 0) filter = arg.substr(9);
+            else if (arg.compare(0, 7, "--save=") == 0) savePath = arg.substr(7);
+            else if (arg.compare(0, 11, "--baseline=") == 0) baselinePath = arg.substr(11);
+            else if (arg.compare(0, 12, "--threshold=") == 0) threshold = std::atof(arg.c_str() + 12);
+            else throw std::runtime_error("Unknown option: " + arg);
+        }
+
+        std::map<std::string, double> baseline;
+        if (!baselinePath.empty()) baseline = readBaseline(baselinePath);
+
+        checkBanded();
+        std::vector<KernelResult> results = runKernels(runs, filter);
+
+        std::cout << std::left << std::setw(20) << "kernel" << std::right << std::setw(12) << "median us"
+                  << std::setw(10) << "MB/s" << std::setw(9) << "spread";
+        if (!baseline.empty()) std::cout << std::setw(10) << "change";
+        std::cout << std::endl;
+
+        int regressions = 0;
+        for (const KernelResult& r : results) {
+            std::cout << std::left << std::setw(20) << r.name << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(12) << r.medianSeconds * 1e6 << std::setw(10) << r.bytes / 1e6 / r.medianSeconds
+                      << std::setw(8) << r.spread * 100 << "%";
+            auto it = baseline.find(r.name);
+            if (it != baseline.end() && it->second > 0) {
+                double change = (r.medianSeconds / it->second - 1) * 100;
+                std::cout << std::setw(9) << std::showpos << change << std::noshowpos << "%";
+                if (change > std::max(threshold, r.spread * 100)) {
+                    std::cout << "  [Regression]";
+                    regressions++;
+                }
+            }
+            std::cout << std::endl;
+        }
+
+        if (!savePath.empty()) {
+            std::ofstream ofs(savePath);
+            if (!ofs.is_open()) throw std::runtime_error("Failed to write " + savePath);
+            ofs << std::setprecision(9);
+            for (const KernelResult& r : results) ofs << r.name << " " << r.medianSeconds << "\n";
+        }
+
+        if (regressions) {
+            std::cerr << "[Error] : " << regressions << " kernel(s) more than " << threshold
+                      << "% slower than the baseline" << std::endl;
+            return 1;
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "[Error] : " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -1,2 +1,2 @@
-g++ ./src/Flimage_Encode.cpp ./src/lodepng.cpp -o ./bin/Flimage_Encoder
-g++ ./src/Flimage_Decode.cpp ./src/lodepng.cpp -o ./bin/Flimage_Decoder
\ No newline at end of file
+g++ -O2 -DLODEPNG_NO_COMPILE_ALLOCATORS -DLODEPNG_COMPILE_PHASE_HOOKS -pthread ./src/Flimage_Encode.cpp ./src/Flimage_Container.cpp ./src/Flimage_Cache.cpp ./src/Flimage_Header.cpp ./src/Flimage_Layout.cpp ./src/Flimage_Transform.cpp ./src/Flimage_Dedup.cpp ./src/Flimage_Codec.cpp ./src/Flimage_Sparse.cpp ./src/Flimage_Crypto.cpp ./src/Flimage_Hash.cpp ./src/Flimage_Delta.cpp ./src/Flimage_Shard.cpp ./src/Flimage_Parallel.cpp ./src/Flimage_Race.cpp ./src/Flimage_Pace.cpp ./src/Flimage_Stats.cpp ./src/Flimage_Trace.cpp ./src/Flimage_Arena.cpp ./src/lodepng.cpp -o ./bin/Flimage_Encoder
+g++ -O2 -DLODEPNG_NO_COMPILE_ALLOCATORS -DLODEPNG_COMPILE_PHASE_HOOKS -pthread ./src/Flimage_Decode.cpp ./src/Flimage_Container.cpp ./src/Flimage_Header.cpp ./src/Flimage_Layout.cpp ./src/Flimage_Transform.cpp ./src/Flimage_Dedup.cpp ./src/Flimage_Codec.cpp ./src/Flimage_Sparse.cpp ./src/Flimage_Crypto.cpp ./src/Flimage_Hash.cpp ./src/Flimage_Delta.cpp ./src/Flimage_Shard.cpp ./src/Flimage_Parallel.cpp ./src/Flimage_Race.cpp ./src/Flimage_Pace.cpp ./src/Flimage_Stats.cpp ./src/Flimage_Trace.cpp ./src/Flimage_Arena.cpp ./src/lodepng.cpp -o ./bin/Flimage_Decoder
\ No newline at end of file
@@ -0,0 +1,200 @@
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "Flimage_Arena.h"
+#include "Flimage_Stats.h"
+
+static const size_t kMinClassShift = 5;  // 32 bytes
+static const size_t kMaxClassShift = 18; // 256 KiB
+static const size_t kNumClasses = kMaxClassShift - kMinClassShift + 1;
+static const size_t kMaxClassSize = size_t(1) << kMaxClassShift;
+static const size_t kChunkSize = size_t(1) << 20;
+static const uint32_t kLargeClass = 0xFFFFFFFFu;
+
+struct BlockHeader {
+    size_t size;
+    uint32_t sizeClass;
+    uint32_t site;  // memory accounting site of Flimage_Stats.h
+};
+static_assert(sizeof(BlockHeader) == 16, "block header must keep 16-byte alignment");
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+static size_t classSize(uint32_t sizeClass) {
+    return size_t(1) << (sizeClass + kMinClassShift);
+}
+
+static uint32_t classFor(size_t size) {
+    uint32_t sizeClass = 0;
+    while (classSize(sizeClass) < size) sizeClass++;
+    return sizeClass;
+}
+
+static BlockHeader* headerOf(void* ptr) {
+    return reinterpret_cast<BlockHeader*>(ptr) - 1;
+}
+
+class Arena {
+public:
+    Arena() {
+        std::memset(freeLists, 0, sizeof(freeLists));
+    }
+
+    ~Arena() {
+        for (char* chunk : chunks) std::free(chunk);
+    }
+
+    void* allocate(size_t size) {
+        BlockHeader* header = allocateBlock(size);
+        if (!header) return nullptr;
+        header->site = flimageMemoryAllocated(size);
+        return header + 1;
+    }
+
+    void* reallocate(void* ptr, size_t size) {
+        if (!ptr) return allocate(size);
+        BlockHeader* header = headerOf(ptr);
+        size_t oldSize = header->size;
+
+        if (header->sizeClass != kLargeClass && size <= classSize(header->sizeClass)) {
+            stats.liveBytes -= header->size;
+            header->size = size;
+            addLive(size);
+            header->site = flimageMemoryReallocated(header->site, oldSize, size);
+            return ptr;
+        }
+        if (header->sizeClass == kLargeClass && size > kMaxClassSize) {
+            BlockHeader* grown = static_cast<BlockHeader*>(std::realloc(header, sizeof(BlockHeader) + size));
+            if (!grown) return nullptr;
+            grown->size = size;
+            stats.liveBytes -= oldSize;
+            stats.allocations++;
+            stats.systemAllocations++;
+            addLive(size);
+            grown->site = flimageMemoryReallocated(grown->site, oldSize, size);
+            return grown + 1;
+        }
+
+        BlockHeader* moved = allocateBlock(size);
+        if (!moved) return nullptr;
+        std::memcpy(moved + 1, ptr, oldSize < size ? oldSize : size);
+        moved->site = flimageMemoryReallocated(header->site, oldSize, size);
+        header->site = 0;
+        release(ptr);
+        return moved + 1;
+    }
+
+    void release(void* ptr) {
+        if (!ptr) return;
+        BlockHeader* header = headerOf(ptr);
+        flimageMemoryFreed(header->site, header->size);
+        stats.liveBytes -= header->size;
+        liveBlocks--;
+        if (header->sizeClass == kLargeClass) {
+            std::free(header);
+            return;
+        }
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(header);
+        block->next = freeLists[header->sizeClass];
+        freeLists[header->sizeClass] = block;
+    }
+
+    bool reset() {
+        if (liveBlocks != 0) return false;
+        nextChunk = 0;
+        cursor = limit = nullptr;
+        std::memset(freeLists, 0, sizeof(freeLists));
+        return true;
+    }
+
+    FlimageArenaStats stats;
+
+private:
+    BlockHeader* allocateBlock(size_t size) {
+        BlockHeader* header;
+        if (size > kMaxClassSize) {
+            header = static_cast<BlockHeader*>(std::malloc(sizeof(BlockHeader) + size));
+            if (!header) return nullptr;
+            header->sizeClass = kLargeClass;
+            stats.systemAllocations++;
+        } else {
+            uint32_t sizeClass = classFor(size);
+            if (freeLists[sizeClass]) {
+                header = reinterpret_cast<BlockHeader*>(freeLists[sizeClass]);
+                freeLists[sizeClass] = freeLists[sizeClass]->next;
+            } else {
+                header = static_cast<BlockHeader*>(carve(sizeof(BlockHeader) + classSize(sizeClass)));
+                if (!header) return nullptr;
+            }
+            header->sizeClass = sizeClass;
+        }
+        header->size = size;
+        stats.allocations++;
+        liveBlocks++;
+        addLive(size);
+        return header;
+    }
+
+    void* carve(size_t bytes) {
+        if (static_cast<size_t>(limit - cursor) < bytes) {
+            if (nextChunk == chunks.size()) {
+                char* chunk = static_cast<char*>(std::malloc(kChunkSize));
+                if (!chunk) return nullptr;
+                chunks.push_back(chunk);
+                stats.systemAllocations++;
+            }
+            cursor = chunks[nextChunk++];
+            limit = cursor + kChunkSize;
+        }
+        void* block = cursor;
+        cursor += bytes;
+        return block;
+    }
+
+    void addLive(size_t size) {
+        stats.liveBytes += size;
+        if (stats.liveBytes > stats.peakBytes) stats.peakBytes = stats.liveBytes;
+    }
+
+    std::vector<char*> chunks;
+    size_t nextChunk = 0;
+    char* cursor = nullptr;
+    char* limit = nullptr;
+    FreeBlock* freeLists[kNumClasses];
+    size_t liveBlocks = 0;
+};
+
+static Arena& threadArena() {
+    static thread_local Arena arena;
+    return arena;
+}
+
+bool flimageArenaReset() {
+    return threadArena().reset();
+}
+
+FlimageArenaStats flimageArenaStats() {
+    return threadArena().stats;
+}
+
+void flimageArenaClearStats() {
+    FlimageArenaStats& stats = threadArena().stats;
+    size_t live = stats.liveBytes;
+    stats = FlimageArenaStats();
+    stats.liveBytes = stats.peakBytes = live;
+}
+
+void* lodepng_malloc(size_t size) {
+    return threadArena().allocate(size);
+}
+
+void* lodepng_realloc(void* ptr, size_t new_size) {
+    return threadArena().reallocate(ptr, new_size);
+}
+
+void lodepng_free(void* ptr) {
+    threadArena().release(ptr);
+}
@@ -0,0 +1,39 @@
+#ifndef FLIMAGE_ARENA_H
+#define FLIMAGE_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Per-thread arena behind lodepng_malloc/lodepng_realloc/lodepng_free.
+// Build lodepng.cpp with -DLODEPNG_NO_COMPILE_ALLOCATORS to route lodepng through it.
+//
+// Small and medium blocks (Huffman trees, BPM node pools, scanline buffers, ...) come from
+// power-of-two size classes carved out of bump-allocated chunks and are recycled through
+// per-class free lists. Blocks above the largest class go straight to malloc.
+// Every block must be freed on the thread that allocated it. Blocks are also accounted to the phase that
+// allocated them (Flimage_Stats.h), so the arena needs Flimage_Stats.cpp linked in.
+
+struct FlimageArenaStats {
+    uint64_t allocations = 0;       // lodepng_malloc calls and reallocs that had to move
+    uint64_t systemAllocations = 0; // calls that reached malloc/realloc (chunks and large blocks)
+    size_t liveBytes = 0;           // bytes currently handed out
+    size_t peakBytes = 0;           // highest liveBytes since the stats were last cleared
+};
+
+// Releases all arena memory of this thread in O(1), keeping the chunks for the next job.
+// Only rewinds when no block is live anymore; returns false (and does nothing) otherwise.
+bool flimageArenaReset();
+
+FlimageArenaStats flimageArenaStats();
+void flimageArenaClearStats();
+
+// Resets the arena of this thread when the job it guards is done.
+class FlimageArenaScope {
+public:
+    FlimageArenaScope() = default;
+    ~FlimageArenaScope() { flimageArenaReset(); }
+    FlimageArenaScope(const FlimageArenaScope&) = delete;
+    FlimageArenaScope& operator=(const FlimageArenaScope&) = delete;
+};
+
+#endif
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+
+#include "Flimage_Cache.h"
+#include "Flimage_Hash.h"
+#include "Flimage_Sparse.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// Bump whenever the encoder's output for the same input and settings changes.
+static const uint8_t kCacheVersion = 2;
+static const char kEntrySuffix[] = ".png";
+static const auto kStaleTempAge = std::chrono::hours(1);  // leftovers of workers that died mid-write
+
+static void putInt(std::vector<unsigned char>& out, uint64_t val, unsigned bytes) {
+    for (unsigned i = 0; i < bytes; i++) out.push_back((unsigned char)(val >> (8 * i)));
+}
+
+static void putString(std::vector<unsigned char>& out, const std::string& str) {
+    putInt(out, str.size(), 4);
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+static std::string toHex(const unsigned char* data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < size; i++) {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 15];
+    }
+    return hex;
+}
+
+static bool reflinkFile(const std::string& from, const std::string& to) {
+#if defined(__linux__) && defined(FICLONE)
+    int src = open(from.c_str(), O_RDONLY);
+    if (src < 0) return false;
+    int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    bool cloned = dst >= 0 && ioctl(dst, FICLONE, src) == 0;
+    if (dst >= 0) close(dst);
+    close(src);
+    if (!cloned && dst >= 0) unlink(to.c_str());
+    return cloned;
+#else
+    (void)from;
+    (void)to;
+    return false;
+#endif
+}
+
+FlimageEncodeCache::FlimageEncodeCache(const std::string& dir, uint64_t maxBytes) : dir_(dir), maxBytes_(maxBytes) {
+    std::error_code ec;
+    fs::create_directories(dir_, ec);
+}
+
+std::string FlimageEncodeCache::key(const FlimageFile& file, const FlimageEncodeOptions& options) const {
+    if (!options.password.empty()) return std::string();
+
+    std::vector<unsigned char> record;
+    record.push_back(kCacheVersion);
+    putInt(record, (uint64_t)options.format, 1);
+    putInt(record, (uint64_t)options.transform.kind, 1);
+    putInt(record, options.transform.param, 4);
+    putInt(record, options.dedup, 1);
+    putInt(record, (uint64_t)options.codec, 1);
+    putString(record, file.name);
+    putString(record, file.ext);
+    putInt(record, file.sparse, 1);
+    putInt(record, file.size, 8);
+    putInt(record, file.extents.size(), 8);
+    for (const FlimageExtent& extent : file.extents) {
+        putInt(record, extent.offset, 8);
+        putInt(record, extent.length, 8);
+    }
+    FlimageHash128 dataHash = flimageHash128(file.data.data(), file.data.size());
+    putInt(record, dataHash.low, 8);
+    putInt(record, dataHash.high, 8);
+    putInt(record, options.deltaBase != nullptr, 1);
+    if (options.deltaBase) {
+        FlimageHash128 baseHash = flimageHash128(options.deltaBase->data(), options.deltaBase->size());
+        putInt(record, baseHash.low, 8);
+        putInt(record, baseHash.high, 8);
+    }
+    putInt(record, options.race.enabled, 1);
+    // A paced encode compresses less the tighter its target, so an entry is only reused for the same one.
+    putInt(record, (uint64_t)(options.pace.megabytesPerSecond * 1000), 8);
+    putInt(record, (uint64_t)(options.pace.seconds * 1000), 8);
+
+    FlimageHash128 hash = flimageHash128(record.data(), record.size());
+    unsigned char bytes[16];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (unsigned char)(hash.high >> (56 - 8 * i));
+        bytes[8 + i] = (unsigned char)(hash.low >> (56 - 8 * i));
+    }
+    return toHex(bytes, sizeof(bytes));
+}
+
+bool FlimageEncodeCache::fetch(const std::string& key, const std::string& outPath) const {
+    if (key.empty()) return false;
+    std::string entry = (fs::path(dir_) / (key + kEntrySuffix)).string();
+    std::string temp = flimageTempPath(outPath);
+
+    std::error_code ec;
+    bool placed = reflinkFile(entry, temp);
+    if (!placed) {
+        fs::create_hard_link(entry, temp, ec);
+        placed = !ec;
+    }
+    if (!placed) placed = fs::copy_file(entry, temp, ec) && !ec;
+    if (placed) {
+        fs::rename(temp, outPath, ec);
+        placed = !ec;
+    }
+    if (!placed) {
+        fs::remove(temp, ec);
+        return false;
+    }
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+void FlimageEncodeCache::store(const std::string& key, const std::vector<unsigned char>& png) const {
+    if (key.empty() || png.size() > maxBytes_) return;
+    std::string entry = (fs::path(dir_) / (key + kEntrySuffix)).string();
+    std::string temp = flimageTempPath(entry);
+
+    std::ofstream ofs(temp, std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(png.data()), (std::streamsize)png.size());
+    ofs.close();
+    std::error_code ec;
+    if (!ofs) {
+        fs::remove(temp, ec);
+        return;
+    }
+    fs::rename(temp, entry, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return;
+    }
+    evict();
+}
+
+// Workers may evict at the same time; an entry another worker removed first is simply gone.
+void FlimageEncodeCache::evict() const {
+    struct Entry {
+        fs::path path;
+        fs::file_time_type time;
+        uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    auto now = fs::file_time_type::clock::now();
+
+    std::error_code ec;
+    for (fs::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec)) {
+        std::error_code entryError;
+        std::string name = it->path().filename().string();
+        fs::file_time_type time = it->last_write_time(entryError);
+        if (entryError) continue;
+        if (name.find(kFlimageTempMarker) != std::string::npos) {
+            if (now - time > kStaleTempAge) fs::remove(it->path(), entryError);
+            continue;
+        }
+        if (name.size() <= sizeof(kEntrySuffix) - 1 ||
+            name.compare(name.size() - (sizeof(kEntrySuffix) - 1), std::string::npos, kEntrySuffix) != 0)
+            continue;
+        uint64_t size = it->file_size(entryError);
+        if (entryError) continue;
+        entries.push_back({it->path(), time, size});
+        total += size;
+    }
+    if (total <= maxBytes_) return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+    for (const Entry& entry : entries) {
+        if (total <= maxBytes_) break;
+        fs::remove(entry.path, ec);
+        total -= entry.size;
+    }
+}
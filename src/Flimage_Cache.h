@@ -0,0 +1,39 @@
+#ifndef FLIMAGE_CACHE_H
+#define FLIMAGE_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Flimage_Container.h"
+
+// On-disk cache of encoded PNGs, keyed by the XXH3-128 hash of the input (data, extents, name) and every
+// encoder setting that changes the output. A hit places the cached PNG at the output path with a reflink
+// where the file system supports it, a hard link on the same file system, or a copy otherwise.
+//
+// Entries are flat files <key>.png in the cache directory. They are written to a temporary name and renamed
+// into place, so concurrent workers only ever see complete entries. A hit refreshes the entry's modification
+// time; after each store the oldest entries are evicted until the directory fits its size limit. Encrypted
+// files are never cached: their output is randomized and a plaintext key would leak what they hold.
+
+class FlimageEncodeCache {
+public:
+    FlimageEncodeCache(const std::string& dir, uint64_t maxBytes);
+
+    // Empty when the file can't be cached.
+    std::string key(const FlimageFile& file, const FlimageEncodeOptions& options) const;
+
+    // Places the cached PNG at outPath. Returns false on a miss, including entries evicted meanwhile.
+    bool fetch(const std::string& key, const std::string& outPath) const;
+
+    // Best effort: a cache that can't be written only costs the next encode.
+    void store(const std::string& key, const std::vector<unsigned char>& png) const;
+
+private:
+    void evict() const;
+
+    std::string dir_;
+    uint64_t maxBytes_;
+};
+
+#endif
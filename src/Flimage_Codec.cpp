@@ -0,0 +1,197 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "Flimage_Codec.h"
+
+static const size_t kMinMatch = 4;
+static const size_t kLastLiterals = 5;
+static const size_t kMatchStartLimit = 12;  // no match starts within this many bytes of the end
+static const size_t kMaxDistance = 65535;
+static const unsigned kHashBits = 16;
+static const unsigned kSkipTrigger = 6;     // after 2^6 misses the search step grows by one
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t val;
+    std::memcpy(&val, p, 4);
+    return val;
+}
+
+static uint64_t read64(const unsigned char* p) {
+    uint64_t val;
+    std::memcpy(&val, p, 8);
+    return val;
+}
+
+static uint32_t hashPosition(const unsigned char* p) {
+    return (read32(p) * 2654435761u) >> (32 - kHashBits);
+}
+
+static unsigned trailingZeroBytes(uint64_t val) {
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(val) / 8;
+#else
+    unsigned bytes = 0;
+    while (!(val & 0xFF)) {
+        val >>= 8;
+        bytes++;
+    }
+    return bytes;
+#endif
+}
+
+// Length of the common prefix of a and b, reading no further than limit on the a side (b lies before a).
+static size_t matchLength(const unsigned char* a, const unsigned char* b, const unsigned char* limit) {
+    const unsigned char* start = a;
+    while (a + 8 <= limit) {
+        uint64_t diff = read64(a) ^ read64(b);
+        if (diff) return (size_t)(a - start) + trailingZeroBytes(diff);
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return (size_t)(a - start);
+}
+
+static void putLength(std::vector<unsigned char>& out, size_t len) {
+    for (; len >= 255; len -= 255) out.push_back(255);
+    out.push_back((unsigned char)len);
+}
+
+static void putSequence(std::vector<unsigned char>& out, const unsigned char* literals, size_t literalLength,
+                        size_t distance, size_t matchLength) {
+    size_t matchCode = matchLength - kMinMatch;
+    unsigned char token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4);
+    if (matchLength) token |= (unsigned char)(matchCode < 15 ? matchCode : 15);
+    out.push_back(token);
+    if (literalLength >= 15) putLength(out, literalLength - 15);
+    out.insert(out.end(), literals, literals + literalLength);
+    if (!matchLength) return;
+    out.push_back((unsigned char)(distance & 0xFF));
+    out.push_back((unsigned char)(distance >> 8));
+    if (matchCode >= 15) putLength(out, matchCode - 15);
+}
+
+std::vector<unsigned char> flimageLzCompress(const unsigned char* data, size_t size) {
+    std::vector<unsigned char> out;
+    out.reserve(size + size / 255 + 16);
+    size_t anchor = 0;
+
+    if (size > kMatchStartLimit) {
+        // Positions are kept modulo 2^32; the distance check sorts out stale and empty entries.
+        std::vector<uint32_t> table((size_t)1 << kHashBits, 0);
+        const unsigned char* matchLimit = data + size - kLastLiterals;
+        size_t searchEnd = size - kMatchStartLimit;
+        size_t pos = 1;
+        table[hashPosition(data)] = 0;
+
+        while (pos < searchEnd) {
+            size_t distance = 0;
+            unsigned misses = 1u << kSkipTrigger;
+            for (;;) {
+                uint32_t& entry = table[hashPosition(data + pos)];
+                distance = (uint32_t)pos - entry;
+                entry = (uint32_t)pos;
+                if (distance - 1 < kMaxDistance && read32(data + pos - distance) == read32(data + pos)) break;
+                pos += misses++ >> kSkipTrigger;
+                if (pos >= searchEnd) break;
+            }
+            if (pos >= searchEnd) break;
+
+            size_t match = pos - distance;
+            while (pos > anchor && match > 0 && data[pos - 1] == data[match - 1]) {
+                pos--;
+                match--;
+            }
+            size_t length = kMinMatch + matchLength(data + pos + kMinMatch, data + match + kMinMatch, matchLimit);
+            putSequence(out, data + anchor, pos - anchor, distance, length);
+            pos += length;
+            anchor = pos;
+            if (pos < searchEnd) table[hashPosition(data + pos - 2)] = (uint32_t)(pos - 2);
+        }
+    }
+    putSequence(out, data + anchor, size - anchor, 0, 0);
+    return out;
+}
+
+static size_t getLength(const unsigned char*& in, const unsigned char* end, size_t len) {
+    unsigned char byte;
+    do {
+        if (in == end) throw std::runtime_error("Truncated LZ stream");
+        byte = *in++;
+        len += byte;
+    } while (byte == 255);
+    return len;
+}
+
+std::vector<unsigned char> flimageLzDecompress(const unsigned char* data, size_t size, uint64_t outputSize) {
+    // A byte of input expands to at most 255 bytes of output, which bounds what a header can claim.
+    if (outputSize > (uint64_t)size * 255) throw std::runtime_error("Invalid LZ output size");
+
+    std::vector<unsigned char> output((size_t)outputSize);
+    unsigned char* const outStart = output.data();
+    unsigned char* const outEnd = outStart + output.size();
+    unsigned char* out = outStart;
+    const unsigned char* in = data;
+    const unsigned char* const inEnd = data + size;
+
+    for (;;) {
+        if (in == inEnd) throw std::runtime_error("Truncated LZ stream");
+        unsigned token = *in++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15) literalLength = getLength(in, inEnd, literalLength);
+        if (literalLength > (size_t)(inEnd - in) || literalLength > (size_t)(outEnd - out))
+            throw std::runtime_error("LZ literals out of range");
+        if (literalLength <= 16 && inEnd - in >= 16 && outEnd - out >= 16) std::memcpy(out, in, 16);
+        else if (literalLength) std::memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+        if (out == outEnd) break;
+
+        if (inEnd - in < 2) throw std::runtime_error("Truncated LZ stream");
+        size_t distance = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15) length = getLength(in, inEnd, length);
+        length += kMinMatch;
+        if (distance == 0 || distance > (size_t)(out - outStart) || length > (size_t)(outEnd - out))
+            throw std::runtime_error("LZ match out of range");
+
+        // Block copies may run up to 15 bytes past the match; those bytes are rewritten later.
+        const unsigned char* match = out - distance;
+        if (distance >= 16 && (size_t)(outEnd - out) >= length + 16) {
+            unsigned char* end = out + length;
+            for (; out < end; out += 16, match += 16) std::memcpy(out, match, 16);
+            out = end;
+        } else if (distance >= 8 && (size_t)(outEnd - out) >= length + 8) {
+            unsigned char* end = out + length;
+            for (; out < end; out += 8, match += 8) std::memcpy(out, match, 8);
+            out = end;
+        } else {
+            for (size_t i = 0; i < length; i++) out[i] = match[i];
+            out += length;
+        }
+    }
+    if (in != inEnd) throw std::runtime_error("Trailing data after LZ stream");
+    return output;
+}
+
+const char* flimageCodecName(FlimageCodec codec) {
+    switch (codec) {
+    case FlimageCodec::Deflate: return "deflate";
+    case FlimageCodec::Lz: return "lz";
+    case FlimageCodec::Zlib: return "zlib";
+    }
+    return "unknown";
+}
+
+bool flimageParseCodec(const std::string& name, FlimageCodec& codec) {
+    if (name == "deflate") codec = FlimageCodec::Deflate;
+    else if (name == "lz") codec = FlimageCodec::Lz;
+    else if (name == "zlib") codec = FlimageCodec::Zlib;
+    else return false;
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef FLIMAGE_CODEC_H
+#define FLIMAGE_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Payload codecs. Deflate means no codec of our own: the PNG's zlib stream does the compression. The others
+// pack the payload before it becomes pixels, and the PNG only wraps it in stored deflate blocks. Lz is a
+// byte-aligned LZ77 without entropy coding, built for speed. Zlib is lodepng's deflate applied to the payload
+// itself, for payloads that must be packed before they become pixels (encryption).
+//
+// Lz stream: sequences of
+//   [token: literal length << 4 | (match length - 4)] [literal length extension] [literals]
+//   [u16 LE distance] [match length extension]
+// where a nibble of 15 continues in extension bytes of 255 until a smaller one. The last sequence holds only
+// literals and ends at the end of the output; the last 5 bytes are always literals.
+
+enum class FlimageCodec : uint8_t {
+    Deflate = 0,
+    Lz = 1,
+    Zlib = 2,
+};
+
+std::vector<unsigned char> flimageLzCompress(const unsigned char* data, size_t size);
+
+// Throws std::runtime_error if the stream is malformed or doesn't decode to exactly `outputSize` bytes.
+std::vector<unsigned char> flimageLzDecompress(const unsigned char* data, size_t size, uint64_t outputSize);
+
+const char* flimageCodecName(FlimageCodec codec);
+bool flimageParseCodec(const std::string& name, FlimageCodec& codec);
+
+#endif
@@ -0,0 +1,638 @@
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <utility>
+#include <stdexcept>
+
+#include "Flimage_Container.h"
+#include "Flimage_Arena.h"
+#include "Flimage_Header.h"
+#include "Flimage_Stats.h"
+
+static void check(unsigned error, const char* what) {
+    if (error) throw std::runtime_error(std::string(what) + ": " + lodepng_error_text(error));
+}
+
+static uint32_t bytesToInt(const std::vector<unsigned char>& data, size_t offset) {
+    if (offset + 4 > data.size()) throw std::runtime_error("Out of range");
+    uint32_t val = 0;
+
+    val |= (static_cast<uint32_t>(data[offset + 0]) <<  0);
+    val |= (static_cast<uint32_t>(data[offset + 1]) <<  8);
+    val |= (static_cast<uint32_t>(data[offset + 2]) << 16);
+    val |= (static_cast<uint32_t>(data[offset + 3]) << 24);
+    return val;
+}
+
+static std::string bytesToString(const std::vector<unsigned char>& v, size_t start, size_t len) {
+    if (start + len > v.size()) throw std::runtime_error("Out of range");
+    return std::string(v.begin() + start, v.begin() + start + len);
+}
+
+static const size_t kTrialBlockSize = 32 * 1024;
+static const size_t kTrialBlockCount = 4;
+static const double kPreferDefaultMargin = 0.99;
+// Peak memory of a raced encode per image byte: the pixels, a palette conversion, the filtered scanlines, and the
+// PNG in lodepng's buffer and in the vector; plus the LZ77 tables of a 32 KiB window.
+static const uint64_t kRaceMemoryPerByte = 5;
+static const uint64_t kRaceMemoryFixed = 2 << 20;
+
+using EncoderTuning = std::function<void(LodePNGEncoderSettings&)>;
+
+// Stored images skip filtering, color analysis and compression: the payload is already packed. The tuning
+// changes the encoder settings of other images.
+static std::vector<unsigned char> encodeImage(const unsigned char* data, size_t size, const FlimageLayout& layout,
+                                              const std::vector<unsigned char>& headerBytes,
+                                              lodepng::CompressContext& context, bool stored = false,
+                                              const EncoderTuning& tuning = nullptr) {
+    size_t imageBufferSize = (size_t)layout.width * layout.height * flimageBytesPerPixel(layout.format);
+    std::vector<unsigned char> rawPixels(imageBufferSize, 0);
+    if (size) std::memcpy(rawPixels.data(), data, size);
+
+    lodepng::State state;
+    state.info_raw.colortype = flimageColorType(layout.format);
+    state.info_raw.bitdepth = flimageBitDepth(layout.format);
+    state.encoder.zlibsettings.context = context.get();
+    if (stored) {
+        state.encoder.auto_convert = 0;
+        state.encoder.filter_strategy = LFS_ZERO;
+        state.encoder.zlibsettings.btype = 0;
+        check(lodepng_color_mode_copy(&state.info_png.color, &state.info_raw), "PNG encode error");
+    } else if (tuning) {
+        tuning(state.encoder);
+    }
+    if (!headerBytes.empty()) {
+        check(lodepng_chunk_create(&state.info_png.unknown_chunks_data[0], &state.info_png.unknown_chunks_size[0],
+                                   (unsigned)headerBytes.size(), kFlimageChunkType, headerBytes.data()),
+              "PNG encode error");
+    }
+
+    FlimagePhase phase("png");
+    std::vector<unsigned char> pngData;
+    check(lodepng::encode(pngData, rawPixels, layout.width, layout.height, state), "PNG encode error");
+    phase.setBytes(rawPixels.size(), pngData.size());
+    return pngData;
+}
+
+struct LayoutChoice {
+    FlimageLayout layout;
+    size_t recordStride = 0;
+};
+
+static FlimageLayout planLayout(size_t payloadSize, const LayoutChoice& choice) {
+    if (!choice.recordStride) return flimagePlanLayout(payloadSize, choice.layout.format);
+    return flimagePlanStrideLayout(payloadSize, choice.layout.format, choice.recordStride);
+}
+
+// Blocks from across the payload, starting at multiples of the alignment so every candidate sees the payload's
+// own pixel and record phase.
+static std::vector<unsigned char> takeSample(const std::vector<unsigned char>& payload, size_t alignment) {
+    if (payload.size() <= kTrialBlockSize * kTrialBlockCount) return payload;
+
+    std::vector<unsigned char> sample;
+    size_t blockSize = kTrialBlockSize - kTrialBlockSize % alignment;
+    size_t span = payload.size() - blockSize;
+    for (size_t block = 0; block < kTrialBlockCount; block++) {
+        size_t start = span * block / (kTrialBlockCount - 1);
+        start -= start % alignment;
+        sample.insert(sample.end(), payload.begin() + start, payload.begin() + start + blockSize);
+    }
+    return sample;
+}
+
+// Size of the sample encoded with the layout the whole payload would get. The trial image keeps the row width
+// of the final image, so Up/Avg/Paeth see the same neighbours.
+static size_t trialSize(const std::vector<unsigned char>& sample, size_t payloadSize, const LayoutChoice& choice,
+                        lodepng::CompressContext& context) {
+    FlimageLayout layout = planLayout(payloadSize, choice);
+    size_t rowBytes = (size_t)layout.width * flimageBytesPerPixel(layout.format);
+    layout.height = (unsigned)((sample.size() + rowBytes - 1) / rowBytes);
+    return encodeImage(sample.data(), sample.size(), layout, {}, context).size();
+}
+
+// Index of the smallest size, where the first entry is the default and wins unless another is clearly smaller.
+static size_t pickSmallest(const std::vector<size_t>& sizes) {
+    size_t best = 0;
+    for (size_t i = 1; i < sizes.size(); i++) {
+        if (sizes[i] < sizes[best] && sizes[i] < sizes[0] * kPreferDefaultMargin) best = i;
+    }
+    return best;
+}
+
+// Tries every transform on a sample, each judged by the better of the two layouts that differ most (RGBA8 with
+// filters, grey8 as an unfiltered palette image), since a transform and the PNG filters can do the same work.
+static FlimageTransform chooseTransform(const std::vector<unsigned char>& payload, lodepng::CompressContext& context) {
+    std::vector<FlimageTransform> candidates = flimageTransformCandidates();
+    std::vector<unsigned char> sample = takeSample(payload, 24);
+    LayoutChoice layouts[2];
+    layouts[1].layout.format = FlimagePixelFormat::Grey8;
+
+    std::vector<size_t> sizes;
+    for (const FlimageTransform& transform : candidates) {
+        std::vector<unsigned char> transformed = sample;
+        flimageApplyTransform(transformed, transform);
+        size_t size = trialSize(transformed, payload.size(), layouts[0], context);
+        size_t greySize = trialSize(transformed, payload.size(), layouts[1], context);
+        sizes.push_back(size < greySize ? size : greySize);
+    }
+    return candidates[pickSmallest(sizes)];
+}
+
+// Encodes a sample of the payload with every candidate layout and keeps the smallest. The format decides more
+// than the filter distance: lodepng stores grey8 payloads as unfiltered palette images, which suits text and
+// code, so a trial run predicts the outcome far better than byte statistics do. When the payload has a record
+// structure, layouts with one record per row compete too. The second smallest goes to runnerUp, which keeps
+// width 0 when there is none.
+static LayoutChoice chooseLayout(const std::vector<unsigned char>& payload, FlimagePixelFormat format,
+                                 lodepng::CompressContext& context, LayoutChoice* runnerUp = nullptr) {
+    static const FlimagePixelFormat allFormats[] = {
+        FlimagePixelFormat::RGBA8, FlimagePixelFormat::Grey8, FlimagePixelFormat::RGB8, FlimagePixelFormat::RGBA16,
+    };
+
+    size_t recordStride = flimageDetectRecordStride(payload);
+    std::vector<LayoutChoice> candidates;
+    for (FlimagePixelFormat candidate : allFormats) {
+        if (format != FlimagePixelFormat::Auto && candidate != format) continue;
+        LayoutChoice choice;
+        choice.layout.format = candidate;
+        candidates.push_back(choice);
+        choice.recordStride = recordStride;
+        if (recordStride && flimagePlanStrideLayout(payload.size(), candidate, recordStride).width)
+            candidates.push_back(choice);
+    }
+
+    size_t best = 0;
+    if (candidates.size() > 1) {
+        std::vector<unsigned char> sample = takeSample(payload, 24 * (recordStride ? recordStride : 1));
+        std::vector<size_t> sizes;
+        for (const LayoutChoice& candidate : candidates) sizes.push_back(trialSize(sample, payload.size(), candidate, context));
+        best = pickSmallest(sizes);
+        size_t second = best ? 0 : 1;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            if (i != best && sizes[i] < sizes[second]) second = i;
+        }
+        if (runnerUp) {
+            *runnerUp = candidates[second];
+            runnerUp->layout = planLayout(payload.size(), candidates[second]);
+        }
+    }
+    candidates[best].layout = planLayout(payload.size(), candidates[best]);
+    return candidates[best];
+}
+
+struct RaceCandidate {
+    LayoutChoice choice;
+    EncoderTuning tuning;
+    std::string name;
+};
+
+static void entropyFilters(LodePNGEncoderSettings& settings) {
+    settings.filter_strategy = LFS_ENTROPY;
+    settings.filter_palette_zero = 0;
+}
+
+static void zeroFilters(LodePNGEncoderSettings& settings) {
+    settings.filter_strategy = LFS_ZERO;
+}
+
+static void widerWindow(LodePNGEncoderSettings& settings) {
+    settings.zlibsettings.windowsize = 32768;
+    settings.zlibsettings.nicematch = 258;
+}
+
+static void entropyWiderWindow(LodePNGEncoderSettings& settings) {
+    entropyFilters(settings);
+    widerWindow(settings);
+}
+
+// The default encode first, then other filter strategies and a wider LZ77 search on the chosen layout, and the
+// runner-up of the layout trials.
+static std::vector<RaceCandidate> raceCandidates(const LayoutChoice& choice, const LayoutChoice& runnerUp) {
+    std::vector<RaceCandidate> candidates;
+    auto add = [&](const LayoutChoice& layout, const EncoderTuning& tuning, const char* name) {
+        std::string layoutName = flimagePixelFormatName(layout.layout.format);
+        if (layout.recordStride) layoutName += "/stride" + std::to_string(layout.recordStride);
+        candidates.push_back({layout, tuning, layoutName + " " + name});
+    };
+    add(choice, nullptr, "default");
+    add(choice, entropyFilters, "entropy");
+    add(choice, zeroFilters, "zero");
+    add(choice, widerWindow, "window32k");
+    add(choice, entropyWiderWindow, "entropy+window32k");
+    if (runnerUp.layout.width) {
+        add(runnerUp, nullptr, "default");
+        add(runnerUp, widerWindow, "window32k");
+    }
+    return candidates;
+}
+
+// The header of every candidate has its own layout; the rest of it is the same.
+static std::vector<unsigned char> raceEncode(const std::vector<unsigned char>& payload, FlimageHeader header,
+                                             const LayoutChoice& choice, const LayoutChoice& runnerUp,
+                                             const FlimageRaceOptions& options, FlimageRaceStats* stats) {
+    std::vector<RaceCandidate> candidates = raceCandidates(choice, runnerUp);
+    std::vector<std::string> names;
+    std::vector<std::vector<unsigned char>> headers;
+    uint64_t imageBytes = 0;
+    for (const RaceCandidate& candidate : candidates) {
+        const FlimageLayout& layout = candidate.choice.layout;
+        names.push_back(candidate.name);
+        header.pixelFormat = layout.format;
+        header.recordStride = (uint32_t)candidate.choice.recordStride;
+        headers.push_back(flimageWriteHeader(header));
+        uint64_t bytes = (uint64_t)layout.width * layout.height * flimageBytesPerPixel(layout.format);
+        if (bytes > imageBytes) imageBytes = bytes;
+    }
+
+    return flimageRace(names, imageBytes * kRaceMemoryPerByte + kRaceMemoryFixed, options,
+                       [&](size_t index, const FlimageRaceWatch& watch) {
+        FlimageArenaScope arena;
+        lodepng::CompressContext context;
+        const RaceCandidate& candidate = candidates[index];
+        return encodeImage(payload.data(), payload.size(), candidate.choice.layout, headers[index], context, false,
+                           [&](LodePNGEncoderSettings& settings) {
+            if (candidate.tuning) candidate.tuning(settings);
+            watch.watch(settings.zlibsettings);
+        });
+    }, stats);
+}
+
+static std::vector<unsigned char> packPayload(const std::vector<unsigned char>& payload, FlimageCodec codec,
+                                              lodepng::CompressContext& context) {
+    if (codec == FlimageCodec::Lz) return flimageLzCompress(payload.data(), payload.size());
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    settings.context = context.get();
+    std::vector<unsigned char> packed;
+    check(lodepng::compress(packed, payload.data(), payload.size(), settings), "Zlib encode error");
+    return packed;
+}
+
+static std::vector<unsigned char> unpackPayload(const std::vector<unsigned char>& payload, const FlimageHeader& header,
+                                                bool covered) {
+    if (header.codec == FlimageCodec::Lz) return flimageLzDecompress(payload.data(), payload.size(), header.unpackedSize);
+    LodePNGDecompressSettings settings;
+    lodepng_decompress_settings_init(&settings);
+    settings.max_output_size = (size_t)header.unpackedSize;
+    settings.ignore_adler32 = covered;
+    std::vector<unsigned char> unpacked;
+    check(lodepng::decompress(unpacked, payload.data(), payload.size(), settings), "Zlib decode error");
+    if (unpacked.size() != header.unpackedSize) throw std::runtime_error("Zlib payload size mismatch");
+    return unpacked;
+}
+
+static void putSealedString(std::vector<unsigned char>& out, const std::string& str) {
+    for (unsigned i = 0; i < 4; i++) out.push_back((unsigned char)(str.size() >> (8 * i)));
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+static std::string getSealedString(const std::vector<unsigned char>& data, size_t& offset) {
+    uint32_t len = bytesToInt(data, offset);
+    offset += 4;
+    std::string str = bytesToString(data, offset, len);
+    offset += len;
+    return str;
+}
+
+// Encrypted files keep their name inside the ciphertext, in front of the packed payload: [u32 len][name]
+// [u32 len][ext]. The tag goes at the end; the header chunk data is the associated data.
+static void sealPayload(std::vector<unsigned char>& sealed, const std::string& password, const FlimageHeader& header,
+                        const std::vector<unsigned char>& headerBytes) {
+    unsigned char key[kFlimageKeySize];
+    flimageDeriveKey(password, header.salt, kFlimageSaltSize, header.kdfIterations, key);
+    size_t size = sealed.size() - kFlimageTagSize;
+    flimageSeal(sealed.data(), size, headerBytes.data(), headerBytes.size(), key, header.nonce, sealed.data() + size);
+    std::memset(key, 0, sizeof(key));
+}
+
+static void openPayload(std::vector<unsigned char>& payload, const std::string& password, const FlimageHeader& header,
+                        const unsigned char* headerBytes, size_t headerSize, FlimageFile& file) {
+    if (payload.size() < kFlimageTagSize) throw std::runtime_error("Encrypted payload too short");
+    unsigned char key[kFlimageKeySize];
+    flimageDeriveKey(password, header.salt, kFlimageSaltSize, header.kdfIterations, key);
+    size_t size = payload.size() - kFlimageTagSize;
+    bool valid = flimageOpen(payload.data(), size, headerBytes, headerSize, key, header.nonce, payload.data() + size);
+    std::memset(key, 0, sizeof(key));
+    if (!valid) throw std::runtime_error("Wrong password or corrupted file");
+    payload.resize(size);
+
+    size_t offset = 0;
+    file.name = getSealedString(payload, offset);
+    file.ext = getSealedString(payload, offset);
+    payload.erase(payload.begin(), payload.begin() + offset);
+}
+
+std::vector<unsigned char> flimageEncode(const FlimageFile& file, const FlimageEncodeOptions& options,
+                                         lodepng::CompressContext& context, FlimageEncodeReport* report) {
+    return flimageEncode(file, file.data.data(), file.data.size(), options, context, report);
+}
+
+std::vector<unsigned char> flimageEncode(const FlimageFile& file, const unsigned char* data, size_t size,
+                                         const FlimageEncodeOptions& options, lodepng::CompressContext& context,
+                                         FlimageEncodeReport* report) {
+    if (!context.get()) check(83, "PNG encode error");
+    uint64_t dataSize = file.sharded ? file.shard.dataSize : size;
+    if (file.sparse && !flimageValidExtents(file.extents, file.size, dataSize))
+        throw std::runtime_error("Invalid file extents");
+
+    // A patch replaces the file data. Deduplication runs next: the transforms and filters then only see the
+    // bytes that are left.
+    std::vector<unsigned char> patch;
+    FlimageDeltaStats deltaStats;
+    if (options.deltaBase) {
+        FlimagePhase phase("delta");
+        patch = flimageDeltaEncode(*options.deltaBase, data, size, &deltaStats);
+        phase.setBytes(size, patch.size());
+    }
+    const unsigned char* input = options.deltaBase ? patch.data() : data;
+    size_t inputSize = options.deltaBase ? patch.size() : size;
+
+    std::vector<unsigned char> payload;
+    FlimageDedupStats dedupStats;
+    bool dedup = false;
+    if (options.dedup) {
+        FlimagePhase phase("dedup");
+        dedup = flimageDedup(input, inputSize, payload, &dedupStats);
+        phase.setBytes(inputSize, dedup ? payload.size() : inputSize);
+    }
+    if (!dedup) payload.assign(input, input + inputSize);
+    if (report) {
+        report->dedup = dedup;
+        report->dedupStats = dedupStats;
+        report->deltaStats = deltaStats;
+    }
+
+    // Ciphertext doesn't compress, so an encrypted payload is packed before it is sealed.
+    bool encrypted = !options.password.empty();
+    FlimageCodec codec = options.codec;
+    if (encrypted && codec == FlimageCodec::Deflate) codec = FlimageCodec::Zlib;
+    bool packed = codec != FlimageCodec::Deflate;
+
+    FlimageTransform transform = options.transform;
+    if (transform.kind == FlimageTransformKind::Auto) {
+        FlimagePhase phase("transform_trials");
+        transform = codec == FlimageCodec::Lz ? FlimageTransform() : chooseTransform(payload, context);
+    }
+    {
+        FlimagePhase phase("transform");
+        flimageApplyTransform(payload, transform);
+        phase.setBytes(payload.size(), payload.size());
+    }
+
+    FlimageHeader header;
+    LayoutChoice choice, runnerUp;
+    if (packed) {
+        FlimagePhase phase("pack");
+        header.codec = codec;
+        header.unpackedSize = payload.size();
+        payload = packPayload(payload, codec, context);
+        phase.setBytes(header.unpackedSize, payload.size());
+    } else {
+        FlimagePhase phase("layout_trials");
+        choice = chooseLayout(payload, options.format, context, &runnerUp);
+    }
+
+    if (encrypted) {
+        std::vector<unsigned char> sealed;
+        putSealedString(sealed, file.name);
+        putSealedString(sealed, file.ext);
+        sealed.insert(sealed.end(), payload.begin(), payload.end());
+        sealed.resize(sealed.size() + kFlimageTagSize);
+        payload.swap(sealed);
+        header.encrypted = true;
+        header.kdfIterations = kFlimageKdfIterations;
+        flimageRandomBytes(header.salt, kFlimageSaltSize);
+        flimageRandomBytes(header.nonce, kFlimageNonceSize);
+    } else {
+        header.name = file.name;
+        header.ext = file.ext;
+    }
+    if (packed) {
+        FlimagePixelFormat format = options.format == FlimagePixelFormat::Auto ? FlimagePixelFormat::Grey8 : options.format;
+        choice.layout = flimagePlanLayout(payload.size(), format);
+    }
+
+    header.payloadSize = payload.size();
+    header.pixelFormat = choice.layout.format;
+    header.recordStride = (uint32_t)choice.recordStride;
+    header.transform = transform;
+    header.dedup = dedup;
+    header.fileSize = inputSize;
+    header.sparse = file.sparse;
+    header.sparseSize = file.size;
+    header.extents = file.extents;
+    // A plaintext hash in the clear would let anyone confirm a guessed file; the encryption tag covers those.
+    if (!encrypted) {
+        FlimagePhase phase("hash");
+        header.hasHash = true;
+        header.contentHash = flimageHash128(data, size);
+        phase.setBytes(size, 0);
+    }
+    header.sharded = file.sharded;
+    header.shard = file.shard;
+    if (options.deltaBase) {
+        header.delta = true;
+        header.deltaSize = size;
+        header.baseSize = options.deltaBase->size();
+        header.baseHash = flimageHash128(options.deltaBase->data(), options.deltaBase->size());
+    }
+
+    // Only images that compress race; an encrypted payload is always packed.
+    if (options.race.enabled && !packed) {
+        FlimagePhase phase("race");
+        FlimageRaceStats raceStats;
+        std::vector<unsigned char> png = raceEncode(payload, header, choice, runnerUp, options.race, &raceStats);
+        phase.setBytes(payload.size(), png.size());
+        if (report) {
+            report->raced = true;
+            report->raceStats = raceStats;
+        }
+        return png;
+    }
+
+    std::vector<unsigned char> headerBytes = flimageWriteHeader(header);
+    if (encrypted) {
+        FlimagePhase phase("seal");
+        sealPayload(payload, options.password, header, headerBytes);
+        phase.setBytes(payload.size(), payload.size());
+    }
+    // The budget starts here: the pace only controls the image encode, and the trials before it take about as
+    // long whatever the deadline.
+    if (options.pace.enabled() && !packed) {
+        double seconds = options.pace.seconds > 0 ? options.pace.seconds
+                                                  : size / 1e6 / options.pace.megabytesPerSecond;
+        FlimagePace pace(std::chrono::steady_clock::now() +
+                         std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double>(seconds)));
+        std::vector<unsigned char> png = encodeImage(payload.data(), payload.size(), choice.layout, headerBytes,
+                                                     context, false, [&](LodePNGEncoderSettings& settings) {
+            pace.install(settings);
+        });
+        if (report) {
+            report->paced = true;
+            report->paceStats = pace.stats();
+        }
+        return png;
+    }
+    return encodeImage(payload.data(), payload.size(), choice.layout, headerBytes, context, packed);
+}
+
+static const unsigned char* findHeaderChunk(const std::vector<unsigned char>& png) {
+    if (png.size() < 8) return nullptr;
+    const unsigned char* end = png.data() + png.size();
+    const unsigned char* chunk = lodepng_chunk_find_const(png.data() + 8, end, kFlimageChunkType);
+    if (!chunk) return nullptr;
+    if ((size_t)(end - chunk) < 12 || lodepng_chunk_length(chunk) > (size_t)(end - chunk) - 12)
+        throw std::runtime_error("Truncated Flimage header");
+    if (lodepng_chunk_check_crc(chunk)) throw std::runtime_error("Flimage header CRC mismatch");
+    return chunk;
+}
+
+static FlimageFile decodeLegacy(const std::vector<unsigned char>& png) {
+    // lodepng skips the CRC of chunks it doesn't know, and a Flimage header with a damaged type is one of them:
+    // without this check the damaged file would decode as a legacy one, with nothing to notice.
+    if (png.size() >= 8) {
+        const unsigned char* end = png.data() + png.size();
+        for (const unsigned char* chunk = png.data() + 8; (size_t)(end - chunk) >= 12;
+             chunk = lodepng_chunk_next_const(chunk, end)) {
+            if (lodepng_chunk_length(chunk) > (size_t)(end - chunk) - 12) break;  // lodepng reports it
+            if (lodepng_chunk_check_crc(chunk)) throw std::runtime_error("PNG chunk CRC mismatch");
+            if (lodepng_chunk_type_equals(chunk, "IEND")) break;
+        }
+    }
+
+    std::vector<unsigned char> decodedRGBA;
+    unsigned width = 0, height = 0;
+    check(lodepng::decode(decodedRGBA, width, height, png), "PNG decode error");
+
+    if (decodedRGBA.size() < 4) {
+        throw std::runtime_error("Insufficient RGBA data to extract fileSize");
+    }
+
+    uint32_t orgFileSize = bytesToInt(decodedRGBA, 0);
+    size_t offset = 4;
+
+    if (offset >= decodedRGBA.size()) {
+        throw std::runtime_error("Invalid extension length offset");
+    }
+    uint8_t extLen = decodedRGBA[offset++];
+    if (offset + extLen > decodedRGBA.size()) {
+        throw std::runtime_error("Extension out of range");
+    }
+
+    FlimageFile file;
+    file.ext = bytesToString(decodedRGBA, offset, extLen);
+    offset += extLen;
+
+    if (offset >= decodedRGBA.size()) {
+        throw std::runtime_error("Invalid filename length offset");
+    }
+    uint8_t nameLen = decodedRGBA[offset++];
+    if (offset + nameLen > decodedRGBA.size()) {
+        throw std::runtime_error("Name out of range");
+    }
+    file.name = bytesToString(decodedRGBA, offset, nameLen);
+    offset += nameLen;
+
+    if (offset + orgFileSize > decodedRGBA.size()) {
+        throw std::runtime_error("File content out of range");
+    }
+    file.data.assign(decodedRGBA.begin() + offset, decodedRGBA.begin() + offset + orgFileSize);
+    return file;
+}
+
+FlimageFile flimageDecode(const std::vector<unsigned char>& png, const std::string& password,
+                          const std::vector<unsigned char>* deltaBase) {
+    const unsigned char* chunk = findHeaderChunk(png);
+    if (!chunk) return decodeLegacy(png);
+
+    FlimageHeader header = flimageReadHeader(lodepng_chunk_data_const(chunk), lodepng_chunk_length(chunk));
+    if (header.encrypted && password.empty()) throw std::runtime_error("File is encrypted, a password is required");
+    if (header.delta) {
+        if (!deltaBase) throw std::runtime_error("File is a delta patch, its base is required");
+        if (deltaBase->size() != header.baseSize ||
+            flimageHash128(deltaBase->data(), deltaBase->size()) != header.baseHash)
+            throw std::runtime_error("Delta base doesn't match the patch");
+    }
+
+    // When the hash or the tag checks the result end to end, the PNG's own checksums are redundant. IHDR keeps
+    // its CRC check: a corrupted size would otherwise be trusted before anything else is read.
+    bool covered = header.hasHash || header.encrypted;
+    if (covered) {
+        const unsigned char* ihdr = png.data() + 8;
+        if (png.size() < 8 + 12 || lodepng_chunk_length(ihdr) > png.size() - 8 - 12 || lodepng_chunk_check_crc(ihdr))
+            throw std::runtime_error("PNG header CRC mismatch");
+    }
+
+    lodepng::State state;
+    state.info_raw.colortype = flimageColorType(header.pixelFormat);
+    state.info_raw.bitdepth = flimageBitDepth(header.pixelFormat);
+    state.decoder.ignore_crc = covered;
+    state.decoder.zlibsettings.ignore_adler32 = covered;
+
+    std::vector<unsigned char> pixels;
+    {
+        FlimagePhase phase("png");
+        unsigned width = 0, height = 0;
+        check(lodepng::decode(pixels, width, height, state, png), "PNG decode error");
+        phase.setBytes(png.size(), pixels.size());
+    }
+    if (header.payloadSize > pixels.size()) throw std::runtime_error("File content out of range");
+
+    FlimageFile file;
+    file.name = header.name;
+    file.ext = header.ext;
+    pixels.resize((size_t)header.payloadSize);
+    if (header.encrypted) {
+        FlimagePhase phase("open");
+        phase.setBytes(pixels.size(), pixels.size());
+        openPayload(pixels, password, header, lodepng_chunk_data_const(chunk), lodepng_chunk_length(chunk), file);
+    }
+    if (header.codec != FlimageCodec::Deflate) {
+        FlimagePhase phase("unpack");
+        size_t packedSize = pixels.size();
+        pixels = unpackPayload(pixels, header, covered);
+        phase.setBytes(packedSize, pixels.size());
+    }
+    {
+        FlimagePhase phase("transform");
+        flimageRevertTransform(pixels, header.transform);
+        phase.setBytes(pixels.size(), pixels.size());
+    }
+    if (header.dedup) {
+        FlimagePhase phase("dedup");
+        file.data = flimageResolveDedup(pixels.data(), pixels.size(), header.fileSize);
+        phase.setBytes(pixels.size(), file.data.size());
+    } else {
+        file.data = std::move(pixels);
+    }
+    if (header.delta) {
+        FlimagePhase phase("delta");
+        size_t patchSize = file.data.size();
+        file.data = flimageDeltaApply(*deltaBase, file.data.data(), file.data.size(), header.deltaSize);
+        phase.setBytes(patchSize, file.data.size());
+    }
+    if (header.hasHash) {
+        FlimagePhase phase("hash");
+        phase.setBytes(file.data.size(), 0);
+        if (flimageHash128(file.data.data(), file.data.size()) != header.contentHash)
+            throw std::runtime_error("Content hash mismatch");
+    }
+    file.verified = covered;
+
+    uint64_t dataSize = file.data.size();
+    if (header.sharded) {
+        if (dataSize > header.shard.dataSize - header.shard.offset) throw std::runtime_error("Shard out of range");
+        file.sharded = true;
+        file.shard = header.shard;
+        dataSize = header.shard.dataSize;
+    }
+    if (header.sparse) {
+        if (!flimageValidExtents(header.extents, header.sparseSize, dataSize))
+            throw std::runtime_error("Invalid file extents");
+        file.sparse = true;
+        file.size = header.sparseSize;
+        file.extents = std::move(header.extents);
+    }
+    return file;
+}
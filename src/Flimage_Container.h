@@ -0,0 +1,85 @@
+#ifndef FLIMAGE_CONTAINER_H
+#define FLIMAGE_CONTAINER_H
+
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+#include "Flimage_Layout.h"
+#include "Flimage_Transform.h"
+#include "Flimage_Dedup.h"
+#include "Flimage_Codec.h"
+#include "Flimage_Sparse.h"
+#include "Flimage_Delta.h"
+#include "Flimage_Shard.h"
+#include "Flimage_Race.h"
+#include "Flimage_Pace.h"
+
+// Packs a file into a PNG and back. The file's bytes are laid out as pixels, the name and the layout go
+// into the "flIm" header chunk (see Flimage_Header.h). PNGs without that chunk are read with the original
+// layout: an RGBA8 image starting with [u32 size][u8 extlen][ext][u8 namelen][name].
+
+struct FlimageFile {
+    std::string name;
+    std::string ext;
+    std::vector<unsigned char> data;
+    // Sparse files: data holds only these extents of a file of `size` bytes, the rest is zero.
+    bool sparse = false;
+    uint64_t size = 0;
+    std::vector<FlimageExtent> extents;
+    // Set by the decoder when the data matched the content hash or the encryption tag.
+    bool verified = false;
+    // Shards: data is the slice of the file data the shard describes, the extents are the whole file's.
+    bool sharded = false;
+    FlimageShard shard;
+};
+
+struct FlimageEncodeOptions {
+    FlimagePixelFormat format = FlimagePixelFormat::Auto;
+    FlimageTransform transform = {FlimageTransformKind::Auto, 0};
+    bool dedup = true;  // only used when it makes the payload smaller
+    // With Lz the payload is packed by the built-in codec and the PNG stores it uncompressed. Unless set
+    // explicitly, the transform is then none and the format grey8, skipping the trial encodes.
+    FlimageCodec codec = FlimageCodec::Deflate;
+    // Encrypts the payload and the file name when set. The payload is then packed with Zlib unless another
+    // codec is chosen, since ciphertext doesn't compress.
+    std::string password;
+    // Stores the file as a patch against this data, an earlier version of it (see flimageReadDeltaBase).
+    const std::vector<unsigned char>* deltaBase = nullptr;
+    // Races PNG encodings of the image with other filter strategies, LZ77 windows and the runner-up layout,
+    // and keeps the smallest. Packed payloads are stored without compression and don't race.
+    FlimageRaceOptions race;
+    // Finishes every encode by a deadline, trading compression for speed per deflate block of the PNG as needed;
+    // the clock starts when flimageEncode is called, so the trial encodes use part of the time. A race takes its
+    // own time and isn't paced.
+    FlimagePaceOptions pace;
+};
+
+// What the encoder did, for reporting.
+struct FlimageEncodeReport {
+    bool dedup = false;
+    FlimageDedupStats dedupStats;
+    FlimageDeltaStats deltaStats;
+    bool raced = false;
+    FlimageRaceStats raceStats;
+    bool paced = false;
+    FlimagePaceStats paceStats;
+};
+
+// Throws std::runtime_error on failure. The context is reused across calls to save allocations.
+std::vector<unsigned char> flimageEncode(const FlimageFile& file, const FlimageEncodeOptions& options,
+                                         lodepng::CompressContext& context, FlimageEncodeReport* report = nullptr);
+
+// Encodes [data, data + size) as the file data and ignores file.data: a shard encodes its slice of the file
+// data where it lies.
+std::vector<unsigned char> flimageEncode(const FlimageFile& file, const unsigned char* data, size_t size,
+                                         const FlimageEncodeOptions& options, lodepng::CompressContext& context,
+                                         FlimageEncodeReport* report = nullptr);
+
+// The password is only needed for encrypted files, the delta base only for patches. Throws std::runtime_error
+// when the decoded data doesn't match the content hash. PNG chunk CRCs and Adler-32 are skipped when the hash or
+// the encryption tag covers the data.
+FlimageFile flimageDecode(const std::vector<unsigned char>& png, const std::string& password = std::string(),
+                          const std::vector<unsigned char>* deltaBase = nullptr);
+
+#endif
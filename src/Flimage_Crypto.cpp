@@ -0,0 +1,536 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "Flimage_Crypto.h"
+
+#if defined(_WIN32) && !defined(__unix__) && !defined(__APPLE__)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <ntsecapi.h>  // RtlGenRandom, which is SystemFunction036 of advapi32
+#ifdef _MSC_VER
+#pragma comment(lib, "advapi32.lib")
+#endif
+#endif
+
+#if !defined(FLIMAGE_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64))
+#define FLIMAGE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(FLIMAGE_NO_AVX2)
+#define FLIMAGE_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+#endif
+
+static const size_t kChaChaBlock = 64;
+static const size_t kSealPiece = 4096;  // multiple of 8 ChaCha20 blocks
+
+static uint32_t load32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void store64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t rotl32(uint32_t v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// ChaCha20
+
+static void quarterRound(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) {
+    a += b; d = rotl32(d ^ a, 16);
+    c += d; b = rotl32(b ^ c, 12);
+    a += b; d = rotl32(d ^ a, 8);
+    c += d; b = rotl32(b ^ c, 7);
+}
+
+static void chachaInit(uint32_t state[16], const unsigned char key[kFlimageKeySize], uint32_t counter,
+                       const unsigned char nonce[kFlimageNonceSize]) {
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) state[4 + i] = load32(key + 4 * i);
+    state[12] = counter;
+    for (int i = 0; i < 3; i++) state[13 + i] = load32(nonce + 4 * i);
+}
+
+static void chachaBlock(const uint32_t state[16], unsigned char out[kChaChaBlock]) {
+    uint32_t x[16];
+    std::memcpy(x, state, sizeof(x));
+    for (int round = 0; round < 10; round++) {
+        quarterRound(x[0], x[4], x[8], x[12]);
+        quarterRound(x[1], x[5], x[9], x[13]);
+        quarterRound(x[2], x[6], x[10], x[14]);
+        quarterRound(x[3], x[7], x[11], x[15]);
+        quarterRound(x[0], x[5], x[10], x[15]);
+        quarterRound(x[1], x[6], x[11], x[12]);
+        quarterRound(x[2], x[7], x[8], x[13]);
+        quarterRound(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) store32(out + 4 * i, x[i] + state[i]);
+}
+
+#ifdef FLIMAGE_SSE2
+// Four blocks at once, one per 32-bit lane: x[i] holds word i of all four blocks.
+#define FLIMAGE_ROTL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define FLIMAGE_QR_SSE2(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = FLIMAGE_ROTL_SSE2(d, 16); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = FLIMAGE_ROTL_SSE2(b, 12); \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = FLIMAGE_ROTL_SSE2(d, 8);  \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = FLIMAGE_ROTL_SSE2(b, 7);
+
+static void chachaXor4(uint32_t state[16], unsigned char* data) {
+    __m128i x[16], orig[16];
+    for (int i = 0; i < 16; i++) orig[i] = _mm_set1_epi32((int)state[i]);
+    orig[12] = _mm_add_epi32(orig[12], _mm_set_epi32(3, 2, 1, 0));
+    for (int i = 0; i < 16; i++) x[i] = orig[i];
+    for (int round = 0; round < 10; round++) {
+        FLIMAGE_QR_SSE2(x[0], x[4], x[8], x[12]) FLIMAGE_QR_SSE2(x[1], x[5], x[9], x[13])
+        FLIMAGE_QR_SSE2(x[2], x[6], x[10], x[14]) FLIMAGE_QR_SSE2(x[3], x[7], x[11], x[15])
+        FLIMAGE_QR_SSE2(x[0], x[5], x[10], x[15]) FLIMAGE_QR_SSE2(x[1], x[6], x[11], x[12])
+        FLIMAGE_QR_SSE2(x[2], x[7], x[8], x[13]) FLIMAGE_QR_SSE2(x[3], x[4], x[9], x[14])
+    }
+    for (int i = 0; i < 16; i++) x[i] = _mm_add_epi32(x[i], orig[i]);
+
+    // Transpose each group of four words so every register holds 16 consecutive bytes of one block.
+    for (int g = 0; g < 4; g++) {
+        __m128i a0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+        __m128i a1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m128i a2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+        __m128i a3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m128i blocks[4] = {
+            _mm_unpacklo_epi64(a0, a1), _mm_unpackhi_epi64(a0, a1),
+            _mm_unpacklo_epi64(a2, a3), _mm_unpackhi_epi64(a2, a3),
+        };
+        for (int b = 0; b < 4; b++) {
+            __m128i* p = (__m128i*)(data + b * kChaChaBlock + 16 * g);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), blocks[b]));
+        }
+    }
+    state[12] += 4;
+}
+#endif
+
+#ifdef FLIMAGE_AVX2_DISPATCH
+#define FLIMAGE_ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define FLIMAGE_QR_AVX2(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = FLIMAGE_ROTL_AVX2(b, 12);      \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot8);  \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = FLIMAGE_ROTL_AVX2(b, 7);
+
+// Eight blocks at once. The unpacks work within 128-bit lanes, so after the transpose the low lane holds a
+// piece of blocks 0-3 and the high lane the same piece of blocks 4-7.
+__attribute__((target("avx2"))) static void chachaXor8(uint32_t state[16], unsigned char* data) {
+    const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                          13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                         14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    __m256i x[16], orig[16];
+    for (int i = 0; i < 16; i++) orig[i] = _mm256_set1_epi32((int)state[i]);
+    orig[12] = _mm256_add_epi32(orig[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    for (int i = 0; i < 16; i++) x[i] = orig[i];
+    for (int round = 0; round < 10; round++) {
+        FLIMAGE_QR_AVX2(x[0], x[4], x[8], x[12]) FLIMAGE_QR_AVX2(x[1], x[5], x[9], x[13])
+        FLIMAGE_QR_AVX2(x[2], x[6], x[10], x[14]) FLIMAGE_QR_AVX2(x[3], x[7], x[11], x[15])
+        FLIMAGE_QR_AVX2(x[0], x[5], x[10], x[15]) FLIMAGE_QR_AVX2(x[1], x[6], x[11], x[12])
+        FLIMAGE_QR_AVX2(x[2], x[7], x[8], x[13]) FLIMAGE_QR_AVX2(x[3], x[4], x[9], x[14])
+    }
+    for (int i = 0; i < 16; i++) x[i] = _mm256_add_epi32(x[i], orig[i]);
+
+    __m256i pieces[4][4];  // [group][block within lane]
+    for (int g = 0; g < 4; g++) {
+        __m256i a0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+        __m256i a1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m256i a2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+        __m256i a3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+        pieces[g][0] = _mm256_unpacklo_epi64(a0, a1);
+        pieces[g][1] = _mm256_unpackhi_epi64(a0, a1);
+        pieces[g][2] = _mm256_unpacklo_epi64(a2, a3);
+        pieces[g][3] = _mm256_unpackhi_epi64(a2, a3);
+    }
+    for (int b = 0; b < 4; b++) {
+        for (int half = 0; half < 2; half++) {
+            __m256i lo = _mm256_permute2x128_si256(pieces[2 * half][b], pieces[2 * half + 1][b], 0x20);
+            __m256i hi = _mm256_permute2x128_si256(pieces[2 * half][b], pieces[2 * half + 1][b], 0x31);
+            __m256i* p = (__m256i*)(data + b * kChaChaBlock + 32 * half);
+            __m256i* q = (__m256i*)(data + (b + 4) * kChaChaBlock + 32 * half);
+            _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), lo));
+            _mm256_storeu_si256(q, _mm256_xor_si256(_mm256_loadu_si256(q), hi));
+        }
+    }
+    state[12] += 8;
+}
+
+static bool hasAvx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+#endif
+
+// XORs the key stream into data, advancing the block counter in state.
+static void chachaXor(uint32_t state[16], unsigned char* data, size_t size) {
+    size_t offset = 0;
+#ifdef FLIMAGE_AVX2_DISPATCH
+    if (hasAvx2()) {
+        for (; offset + 8 * kChaChaBlock <= size; offset += 8 * kChaChaBlock) chachaXor8(state, data + offset);
+    }
+#endif
+#ifdef FLIMAGE_SSE2
+    for (; offset + 4 * kChaChaBlock <= size; offset += 4 * kChaChaBlock) chachaXor4(state, data + offset);
+#endif
+    unsigned char stream[kChaChaBlock];
+    for (; offset < size; offset += kChaChaBlock) {
+        chachaBlock(state, stream);
+        state[12]++;
+        size_t count = size - offset < kChaChaBlock ? size - offset : kChaChaBlock;
+        for (size_t i = 0; i < count; i++) data[offset + i] ^= stream[i];
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// Poly1305, with 26-bit limbs
+
+class Poly1305 {
+public:
+    explicit Poly1305(const unsigned char key[32]) {
+        r_[0] = (load32(key + 0)) & 0x3ffffff;
+        r_[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+        r_[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+        r_[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+        r_[4] = (load32(key + 12) >> 8) & 0x00fffff;
+        for (int i = 0; i < 4; i++) pad_[i] = load32(key + 16 + 4 * i);
+    }
+
+    void update(const unsigned char* data, size_t size) {
+        if (leftover_) {
+            size_t take = 16 - leftover_ < size ? 16 - leftover_ : size;
+            std::memcpy(buffer_ + leftover_, data, take);
+            leftover_ += take;
+            data += take;
+            size -= take;
+            if (leftover_ < 16) return;
+            blocks(buffer_, 16, 1u << 24);
+            leftover_ = 0;
+        }
+        size_t whole = size & ~(size_t)15;
+        blocks(data, whole, 1u << 24);
+        std::memcpy(buffer_, data + whole, size - whole);
+        leftover_ = size - whole;
+    }
+
+    // Zero padding up to the next 16 byte boundary, as the AEAD construction asks for.
+    void padToBlock() {
+        if (!leftover_) return;
+        std::memset(buffer_ + leftover_, 0, 16 - leftover_);
+        blocks(buffer_, 16, 1u << 24);
+        leftover_ = 0;
+    }
+
+    void finish(unsigned char tag[16]) {
+        if (leftover_) {
+            buffer_[leftover_] = 1;
+            std::memset(buffer_ + leftover_ + 1, 0, 15 - leftover_);
+            blocks(buffer_, 16, 0);
+        }
+        uint32_t h0 = h_[0], h1 = h_[1], h2 = h_[2], h3 = h_[3], h4 = h_[4];
+        uint32_t c = h1 >> 26; h1 &= 0x3ffffff;
+        h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+        h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+        h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        // h - p, selected in constant time if h >= p
+        uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+        uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+        uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+        uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+        uint32_t g4 = h4 + c - (1u << 26);
+        uint32_t mask = (g4 >> 31) - 1;
+        h0 = (h0 & ~mask) | (g0 & mask);
+        h1 = (h1 & ~mask) | (g1 & mask);
+        h2 = (h2 & ~mask) | (g2 & mask);
+        h3 = (h3 & ~mask) | (g3 & mask);
+        h4 = (h4 & ~mask) | (g4 & mask);
+
+        uint64_t f;
+        f = (uint64_t)(h0 | (h1 << 26)) + pad_[0];                  store32(tag + 0, (uint32_t)f);
+        f = (uint64_t)((h1 >> 6) | (h2 << 20)) + pad_[1] + (f >> 32); store32(tag + 4, (uint32_t)f);
+        f = (uint64_t)((h2 >> 12) | (h3 << 14)) + pad_[2] + (f >> 32); store32(tag + 8, (uint32_t)f);
+        f = (uint64_t)((h3 >> 18) | (h4 << 8)) + pad_[3] + (f >> 32); store32(tag + 12, (uint32_t)f);
+    }
+
+private:
+    void blocks(const unsigned char* m, size_t size, uint32_t hibit) {
+        const uint32_t r0 = r_[0], r1 = r_[1], r2 = r_[2], r3 = r_[3], r4 = r_[4];
+        const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+        uint32_t h0 = h_[0], h1 = h_[1], h2 = h_[2], h3 = h_[3], h4 = h_[4];
+        for (; size >= 16; m += 16, size -= 16) {
+            h0 += (load32(m + 0)) & 0x3ffffff;
+            h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+            h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+            h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+            h4 += (load32(m + 12) >> 8) | hibit;
+
+            uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+            uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+            uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+            uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+            uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+            uint32_t c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+            d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+            d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+            d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+            d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+            h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+            h1 += c;
+        }
+        h_[0] = h0; h_[1] = h1; h_[2] = h2; h_[3] = h3; h_[4] = h4;
+    }
+
+    uint32_t r_[5];
+    uint32_t h_[5] = {0, 0, 0, 0, 0};
+    uint32_t pad_[4];
+    unsigned char buffer_[16];
+    size_t leftover_ = 0;
+};
+
+// ---------------------------------------------------------------------------------------------------------------
+// ChaCha20-Poly1305 AEAD
+
+static Poly1305 startMac(uint32_t state[16], const unsigned char key[kFlimageKeySize],
+                         const unsigned char nonce[kFlimageNonceSize], const unsigned char* aad, size_t aadSize) {
+    chachaInit(state, key, 0, nonce);
+    unsigned char block[kChaChaBlock];
+    chachaBlock(state, block);
+    state[12] = 1;
+    Poly1305 mac(block);
+    std::memset(block, 0, sizeof(block));
+    mac.update(aad, aadSize);
+    mac.padToBlock();
+    return mac;
+}
+
+static void finishMac(Poly1305& mac, size_t aadSize, size_t size, unsigned char tag[kFlimageTagSize]) {
+    unsigned char lengths[16];
+    mac.padToBlock();
+    store64(lengths, aadSize);
+    store64(lengths + 8, size);
+    mac.update(lengths, sizeof(lengths));
+    mac.finish(tag);
+}
+
+void flimageSeal(unsigned char* data, size_t size, const unsigned char* aad, size_t aadSize,
+                 const unsigned char key[kFlimageKeySize], const unsigned char nonce[kFlimageNonceSize],
+                 unsigned char tag[kFlimageTagSize]) {
+    uint32_t state[16];
+    Poly1305 mac = startMac(state, key, nonce, aad, aadSize);
+    for (size_t offset = 0; offset < size; offset += kSealPiece) {
+        size_t piece = size - offset < kSealPiece ? size - offset : kSealPiece;
+        chachaXor(state, data + offset, piece);
+        mac.update(data + offset, piece);
+    }
+    finishMac(mac, aadSize, size, tag);
+    std::memset(state, 0, sizeof(state));
+}
+
+bool flimageOpen(unsigned char* data, size_t size, const unsigned char* aad, size_t aadSize,
+                 const unsigned char key[kFlimageKeySize], const unsigned char nonce[kFlimageNonceSize],
+                 const unsigned char tag[kFlimageTagSize]) {
+    uint32_t state[16];
+    Poly1305 mac = startMac(state, key, nonce, aad, aadSize);
+    for (size_t offset = 0; offset < size; offset += kSealPiece) {
+        size_t piece = size - offset < kSealPiece ? size - offset : kSealPiece;
+        mac.update(data + offset, piece);
+        chachaXor(state, data + offset, piece);
+    }
+    unsigned char expected[kFlimageTagSize];
+    finishMac(mac, aadSize, size, expected);
+    std::memset(state, 0, sizeof(state));
+
+    unsigned char diff = 0;
+    for (size_t i = 0; i < kFlimageTagSize; i++) diff |= expected[i] ^ tag[i];
+    return diff == 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// SHA-256 and PBKDF2
+
+static const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr32(uint32_t v, int n) {
+    return (v >> n) | (v << (32 - n));
+}
+
+static void sha256Compress(uint32_t h[8], const unsigned char block[64]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) | ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+class Sha256 {
+public:
+    Sha256() {
+        static const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+        std::memcpy(h_, init, sizeof(h_));
+    }
+
+    void update(const unsigned char* data, size_t size) {
+        total_ += size;
+        while (size) {
+            size_t take = 64 - used_ < size ? 64 - used_ : size;
+            std::memcpy(buffer_ + used_, data, take);
+            used_ += take;
+            data += take;
+            size -= take;
+            if (used_ == 64) {
+                sha256Compress(h_, buffer_);
+                used_ = 0;
+            }
+        }
+    }
+
+    void finish(unsigned char digest[32]) {
+        uint64_t bits = total_ * 8;
+        buffer_[used_++] = 0x80;
+        if (used_ > 56) {
+            std::memset(buffer_ + used_, 0, 64 - used_);
+            sha256Compress(h_, buffer_);
+            used_ = 0;
+        }
+        std::memset(buffer_ + used_, 0, 56 - used_);
+        for (int i = 0; i < 8; i++) buffer_[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+        sha256Compress(h_, buffer_);
+        for (int i = 0; i < 8; i++) {
+            for (int j = 0; j < 4; j++) digest[4 * i + j] = (unsigned char)(h_[i] >> (24 - 8 * j));
+        }
+    }
+
+private:
+    uint32_t h_[8];
+    unsigned char buffer_[64];
+    size_t used_ = 0;
+    uint64_t total_ = 0;
+};
+
+// HMAC-SHA256 with the keyed inner and outer states computed once, so every PBKDF2 iteration costs
+// two compressions.
+class HmacSha256 {
+public:
+    explicit HmacSha256(const std::string& password) {
+        unsigned char key[64] = {0};
+        if (password.size() > 64) {
+            Sha256 hash;
+            hash.update(reinterpret_cast<const unsigned char*>(password.data()), password.size());
+            hash.finish(key);
+        } else {
+            std::memcpy(key, password.data(), password.size());
+        }
+        unsigned char pad[64];
+        for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x36;
+        inner_.update(pad, 64);
+        for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x5c;
+        outer_.update(pad, 64);
+        std::memset(key, 0, sizeof(key));
+        std::memset(pad, 0, sizeof(pad));
+    }
+
+    void compute(const unsigned char* data, size_t size, unsigned char mac[32]) const {
+        Sha256 inner = inner_, outer = outer_;
+        inner.update(data, size);
+        inner.finish(mac);
+        outer.update(mac, 32);
+        outer.finish(mac);
+    }
+
+private:
+    Sha256 inner_;
+    Sha256 outer_;
+};
+
+void flimageDeriveKey(const std::string& password, const unsigned char* salt, size_t saltSize, uint32_t iterations,
+                      unsigned char key[kFlimageKeySize]) {
+    HmacSha256 hmac(password);
+    std::string first(reinterpret_cast<const char*>(salt), saltSize);
+    first.append("\0\0\0\1", 4);  // block index 1: a 32 byte key is a single SHA-256 block
+
+    unsigned char u[32];
+    hmac.compute(reinterpret_cast<const unsigned char*>(first.data()), first.size(), u);
+    std::memcpy(key, u, 32);
+    for (uint32_t i = 1; i < iterations; i++) {
+        hmac.compute(u, 32, u);
+        for (int j = 0; j < 32; j++) key[j] ^= u[j];
+    }
+    std::memset(u, 0, sizeof(u));
+}
+
+void flimageRandomBytes(unsigned char* out, size_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+    std::ifstream urandom("/dev/urandom", std::ios::binary);
+    if (!urandom.read(reinterpret_cast<char*>(out), (std::streamsize)size))
+        throw std::runtime_error("Failed to read /dev/urandom");
+#elif defined(_WIN32)
+    // The same source rand_s reads; unlike BCryptGenRandom it needs no extra library with MinGW.
+    while (size) {
+        ULONG chunk = size > 0x40000000 ? 0x40000000 : (ULONG)size;
+        if (!RtlGenRandom(out, chunk)) throw std::runtime_error("RtlGenRandom failed");
+        out += chunk;
+        size -= chunk;
+    }
+#else
+    (void)out;
+    (void)size;
+    throw std::runtime_error("No secure random source");
+#endif
+}
+
+std::string flimageReadPassword(const std::string& path) {
+    if (path.empty()) {
+        const char* env = std::getenv("FLIMAGE_PASSWORD");
+        return env ? env : "";
+    }
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open()) throw std::runtime_error("Failed to open password file");
+    std::string password;
+    std::getline(ifs, password);
+    if (!password.empty() && password.back() == '\r') password.pop_back();
+    if (password.empty()) throw std::runtime_error("Empty password file");
+    return password;
+}
@@ -0,0 +1,42 @@
+#ifndef FLIMAGE_CRYPTO_H
+#define FLIMAGE_CRYPTO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Payload encryption: ChaCha20-Poly1305 (RFC 8439) with the key derived from a password by
+// PBKDF2-HMAC-SHA256. ChaCha20 runs 8 blocks at a time with AVX2 when the CPU has it (picked at run time),
+// 4 at a time with SSE2 otherwise, and falls back to plain C++ without SSE2. Encryption and authentication
+// share one pass: every 4 KiB piece is encrypted and then fed to Poly1305 while it is still in cache.
+
+static const size_t kFlimageKeySize = 32;
+static const size_t kFlimageNonceSize = 12;
+static const size_t kFlimageTagSize = 16;
+static const size_t kFlimageSaltSize = 16;
+
+static const uint32_t kFlimageKdfIterations = 600000;
+static const uint32_t kFlimageMaxKdfIterations = 20000000;  // decoders refuse more, a file can't make them hang
+
+void flimageDeriveKey(const std::string& password, const unsigned char* salt, size_t saltSize, uint32_t iterations,
+                      unsigned char key[kFlimageKeySize]);
+
+// Fills out with bytes from the system's secure random source. Throws std::runtime_error if there is none.
+void flimageRandomBytes(unsigned char* out, size_t size);
+
+// The password of the programs: the first line of the file at path, or without a path the FLIMAGE_PASSWORD
+// environment variable, empty when that isn't set. Throws std::runtime_error if the file can't be read or
+// its first line is empty.
+std::string flimageReadPassword(const std::string& path);
+
+// Encrypts data in place and authenticates it together with aad.
+void flimageSeal(unsigned char* data, size_t size, const unsigned char* aad, size_t aadSize,
+                 const unsigned char key[kFlimageKeySize], const unsigned char nonce[kFlimageNonceSize],
+                 unsigned char tag[kFlimageTagSize]);
+
+// Decrypts data in place. Returns false if the tag doesn't match; data is then garbage and must be dropped.
+bool flimageOpen(unsigned char* data, size_t size, const unsigned char* aad, size_t aadSize,
+                 const unsigned char key[kFlimageKeySize], const unsigned char nonce[kFlimageNonceSize],
+                 const unsigned char tag[kFlimageTagSize]);
+
+#endif
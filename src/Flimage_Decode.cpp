@@ -1,13 +1,21 @@
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <stdexcept>
 #include <string>
-#include <cstdint>
 
 #include "lodepng.h"
+#include "Flimage_Arena.h"
+#include "Flimage_Container.h"
+#include "Flimage_Crypto.h"
+#include "Flimage_Parallel.h"
+#include "Flimage_Stats.h"
+#include "Flimage_Trace.h"
 
 static std::vector<unsigned char> readFileAll(const std::string& path) {
+    FlimagePhase phase("read");
     std::ifstream ifs(path, std::ios::binary | std::ios::ate);
     if (!ifs.is_open()) throw std::runtime_error("Failed to open file");
     std::streampos fileSize = ifs.tellg();
@@ -15,90 +23,150 @@ static std::vector<unsigned char> readFileAll(const std::string& path) {
     std::vector<unsigned char> buffer(fileSize);
     if (!ifs.read(reinterpret_cast<char*>(buffer.data()), fileSize)) 
         throw std::runtime_error("Failed to read file");
+    phase.setBytes(buffer.size(), buffer.size());
     return buffer;
 }
 
 static void writeFileAll(const std::string& path, const std::vector<unsigned char>& data) {
-    std::ofstream ofs(path, std::ios::binary);
-    if (!ofs.is_open()) throw std::runtime_error("Failed to write file");
-    ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
-    ofs.close();
+    FlimagePhase phase("write");
+    phase.setBytes(data.size(), data.size());
+    flimageWriteFile(path, data.data(), data.size());
 }
 
-static std::string bytesToString(const std::vector<unsigned char>& v, size_t start, size_t len) {
-    if (start + len > v.size()) throw std::runtime_error("Out of range");
-    return std::string(v.begin() + start, v.begin() + start + len);
+// Estimated peak memory of decoding the PNG, from its size and header: the PNG, the inflated scanlines, the
+// pixels and the file data. A file that isn't a readable PNG counts with its size; its decode fails soon anyway.
+static uint64_t decodeMemory(const std::string& pngPath) {
+    std::ifstream ifs(pngPath, std::ios::binary | std::ios::ate);
+    if (!ifs.is_open()) return 0;
+    uint64_t pngSize = (uint64_t)ifs.tellg();
+    unsigned char header[33] = {};
+    ifs.seekg(0, std::ios::beg);
+    ifs.read(reinterpret_cast<char*>(header), sizeof(header));
+    lodepng::State state;
+    unsigned w = 0, h = 0;
+    if (lodepng_inspect(&w, &h, &state, header, (size_t)ifs.gcount())) return pngSize;
+    return pngSize + 3 * (uint64_t)lodepng_get_raw_size(w, h, &state.info_png.color);
 }
 
-static uint32_t bytesToInt(const std::vector<unsigned char>& data, size_t offset) {
-    if (offset + 4 > data.size()) throw std::runtime_error("Out of range");
-    uint32_t val = 0;
-
-    val |= (static_cast<uint32_t>(data[offset + 0]) <<  0);
-    val |= (static_cast<uint32_t>(data[offset + 1]) <<  8);
-    val |= (static_cast<uint32_t>(data[offset + 2]) << 16);
-    val |= (static_cast<uint32_t>(data[offset + 3]) << 24);
-    return val;
-}
+// Shards go to the assembler, which writes each into the shared output as soon as it is decoded.
+static void decodeFile(const std::string& pngPath, const std::string& password,
+                       const std::vector<unsigned char>* deltaBase, FlimageShardAssembler& assembler,
+                       FlimageMemoryBudget& memory) {
+    FlimagePhase filePhase("file", pngPath.c_str());
+    FlimageMemoryReservation reservation(memory, decodeMemory(pngPath));
+    FlimageArenaScope arena;
+    std::vector<unsigned char> pngData = readFileAll(pngPath);
 
-int main(int argc, char* argv[]) {
-    try {
-        if (argc < 2) {
-            std::cerr << "[Usage] : " << argv[0] << " <png_file>" << std::endl;
-            return 0;
-        }
+    FlimageFile file;
+    {
+        FlimagePhase phase("decode");
+        file = flimageDecode(pngData, password, deltaBase);
+        phase.setBytes(pngData.size(), file.data.size());
+    }
 
-        std::string pngPath = argv[1];
-        std::vector<unsigned char> pngData = readFileAll(pngPath);
+    std::string outName = file.name;
+    if (!file.ext.empty()) {
+        outName += "." + file.ext;
+    }
+    if (file.sharded) {
+        FlimagePhase phase("write");
+        phase.setBytes(file.data.size(), file.data.size());
+        assembler.add(file, outName);
+    } else if (file.sparse) {
+        FlimagePhase phase("write");
+        phase.setBytes(file.data.size(), file.data.size());
+        flimageWriteSparseFile(outName, file.size, file.extents, file.data);
+    } else {
+        writeFileAll(outName, file.data);
+    }
+}
 
-        std::vector<unsigned char> decodedRGBA;
-        unsigned width = 0, height = 0;
-        unsigned error = lodepng::decode(decodedRGBA, width, height, pngData);
-        if (error) {
-            throw std::runtime_error("PNG decode error: " + std::string(lodepng_error_text(error)));
+// Decodes every file in memory without writing anything; the decoder checks the content hash.
+static bool verifyFiles(const std::vector<std::string>& pngPaths, const std::string& password,
+                        const std::vector<unsigned char>* deltaBase, FlimageMemoryBudget& memory) {
+    std::vector<std::string> results(pngPaths.size());
+    std::vector<char> failed(pngPaths.size(), 0);
+    flimageParallelFor(pngPaths.size(), [&](size_t i) {
+        try {
+            FlimagePhase filePhase("file", pngPaths[i].c_str());
+            FlimageMemoryReservation reservation(memory, decodeMemory(pngPaths[i]));
+            FlimageArenaScope arena;
+            std::vector<unsigned char> pngData = readFileAll(pngPaths[i]);
+            FlimagePhase phase("decode");
+            FlimageFile file = flimageDecode(pngData, password, deltaBase);
+            phase.setBytes(pngData.size(), file.data.size());
+            results[i] = file.verified ? "OK" : "OK (no content hash, PNG checksums only)";
         }
-
-        if (decodedRGBA.size() < 4) {
-            throw std::runtime_error("Insufficient RGBA data to extract fileSize");
+        catch (const std::exception& e) {
+            results[i] = std::string("FAILED : ") + e.what();
+            failed[i] = 1;
         }
+    });
 
-        uint32_t orgFileSize = bytesToInt(decodedRGBA, 0);
-        size_t offset = 4;
+    bool allGood = true;
+    for (size_t i = 0; i < pngPaths.size(); i++) {
+        std::cout << "[Verify] : " << pngPaths[i] << " : " << results[i] << std::endl;
+        if (failed[i]) allGood = false;
+    }
+    return allGood;
+}
 
-        if (offset >= decodedRGBA.size()) {
-            throw std::runtime_error("Invalid extension length offset");
+int main(int argc, char* argv[]) {
+    auto start = std::chrono::steady_clock::now();
+    try {
+        std::vector<std::string> pngPaths;
+        std::string passwordFile, deltaBasePath, statsPath, tracePath;
+        bool verify = false, printStats = false;
+        uint64_t memoryBudget = kFlimageDefaultShardMemory;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 16, "--password-file=") == 0) passwordFile = arg.substr(16);
+            else if (arg.compare(0, 13, "--delta-base=") == 0) deltaBasePath = arg.substr(13);
+            else if (arg.compare(0, 9, "--memory=") == 0)
+                memoryBudget = std::strtoull(arg.c_str() + 9, nullptr, 10) << 20;
+            else if (arg == "--verify") verify = true;
+            else if (arg == "--stats" || arg.compare(0, 8, "--stats=") == 0) {
+                printStats = true;
+                if (arg.size() > 8) statsPath = arg.substr(8);
+            } else if (arg.compare(0, 8, "--trace=") == 0) tracePath = arg.substr(8);
+            else pngPaths.push_back(arg);
         }
-        uint8_t extLen = decodedRGBA[offset++];
-        if (offset + extLen > decodedRGBA.size()) {
-            throw std::runtime_error("Extension out of range");
+        if (pngPaths.empty()) {
+            std::cerr << "[Usage] : " << argv[0] << " [--verify] [--password-file=<path>] [--delta-base=<old png or file>]"
+                      << " [--memory=<MiB>] [--stats[=<json file>]] [--trace=<json file>] <png_file>..." << std::endl;
+            return 0;
         }
-        std::string ext = bytesToString(decodedRGBA, offset, extLen);
-        offset += extLen;
 
-        if (offset >= decodedRGBA.size()) {
-            throw std::runtime_error("Invalid filename length offset");
-        }
-        uint8_t nameLen = decodedRGBA[offset++];
-        if (offset + nameLen > decodedRGBA.size()) {
-            throw std::runtime_error("Name out of range");
-        }
-        std::string name = bytesToString(decodedRGBA, offset, nameLen);
-        offset += nameLen;
+        if (printStats) flimageStatsEnable();
+        if (!tracePath.empty()) flimageTraceEnable();
+        auto reportStats = [&]() {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (printStats) flimageStatsWrite(statsPath, "Flimage_Decoder", seconds);
+            if (!tracePath.empty()) flimageTraceWrite(tracePath, "Flimage_Decoder");
+        };
 
-        if (offset + orgFileSize > decodedRGBA.size()) {
-            throw std::runtime_error("File content out of range");
+        std::string password = flimageReadPassword(passwordFile);
+        std::vector<unsigned char> deltaBase;
+        if (!deltaBasePath.empty()) {
+            FlimagePhase phase("read_base");
+            deltaBase = flimageReadDeltaBase(deltaBasePath, password);
+            phase.setBytes(deltaBase.size(), deltaBase.size());
         }
-        std::vector<unsigned char> fileContent(
-            decodedRGBA.begin() + offset,
-            decodedRGBA.begin() + offset + orgFileSize
-        );
-        offset += orgFileSize;
+        const std::vector<unsigned char>* base = deltaBasePath.empty() ? nullptr : &deltaBase;
 
-        std::string outName = name;
-        if (!ext.empty()) {
-            outName += "." + ext;
+        // Files decode one per core, but big ones, such as the shards of a large file, only as many as fit.
+        FlimageMemoryBudget memory(memoryBudget);
+        if (verify) {
+            bool allGood = verifyFiles(pngPaths, password, base, memory);
+            reportStats();
+            return allGood ? 0 : -1;
         }
-        writeFileAll(outName, fileContent);
+        FlimageShardAssembler assembler;
+        flimageParallelFor(pngPaths.size(), [&](size_t i) {
+            decodeFile(pngPaths[i], password, base, assembler, memory);
+        });
+        assembler.finish();
+        reportStats();
     }
     catch (const std::exception& e) {
         std::cerr << "[Error] : " << e.what() << std::endl;
@@ -0,0 +1,188 @@
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "Flimage_Dedup.h"
+
+static const size_t kMinChunk = 2 * 1024;
+static const size_t kAverageChunk = 8 * 1024;
+static const size_t kMaxChunk = 64 * 1024;
+
+// Normalized chunking: a stricter mask below the average size and a looser one above it pulls chunk sizes
+// towards the average. The gear hash shifts left, so its top bits depend on the most recent 64 bytes.
+static const uint64_t kMaskStrict = ~0ull << (64 - 15);
+static const uint64_t kMaskLoose = ~0ull << (64 - 11);
+
+struct GearTable {
+    uint64_t values[256];
+    GearTable() {
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        for (uint64_t& value : values) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            value = z ^ (z >> 31);
+        }
+    }
+};
+
+static const GearTable kGear;
+
+static size_t nextBoundary(const unsigned char* data, size_t size) {
+    if (size <= kMinChunk) return size;
+    size_t normal = size < kAverageChunk ? size : kAverageChunk;
+    size_t limit = size < kMaxChunk ? size : kMaxChunk;
+    uint64_t hash = 0;
+    size_t i = kMinChunk;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + kGear.values[data[i]];
+        if (!(hash & kMaskStrict)) return i + 1;
+    }
+    for (; i < limit; i++) {
+        hash = (hash << 1) + kGear.values[data[i]];
+        if (!(hash & kMaskLoose)) return i + 1;
+    }
+    return limit;
+}
+
+static uint64_t chunkHash(const unsigned char* data, size_t size) {
+    uint64_t hash = size * 0x9E3779B97F4A7C15ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) hash = (hash ^ data[i]) * 0x94D049BB133111EBull;
+    return hash ^ (hash >> 32);
+}
+
+struct Reference {
+    size_t position;  // in the output
+    size_t source;    // earlier position in the output with the same bytes
+    size_t length;
+};
+
+struct ChunkEntry {
+    size_t offset;
+    size_t length;
+};
+
+static void putVarint(std::vector<unsigned char>& out, uint64_t val) {
+    while (val >= 0x80) {
+        out.push_back((unsigned char)(val | 0x80));
+        val >>= 7;
+    }
+    out.push_back((unsigned char)val);
+}
+
+static uint64_t getVarint(const unsigned char* data, size_t size, size_t& offset) {
+    uint64_t val = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (offset >= size) throw std::runtime_error("Truncated dedup table");
+        unsigned char byte = data[offset++];
+        val |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return val;
+    }
+    throw std::runtime_error("Invalid dedup table");
+}
+
+bool flimageDedup(const unsigned char* data, size_t size, std::vector<unsigned char>& stream,
+                  FlimageDedupStats* stats) {
+    auto start = std::chrono::steady_clock::now();
+    FlimageDedupStats result;
+    stream.clear();
+
+    std::unordered_map<uint64_t, ChunkEntry> seen;
+    seen.reserve(size / kAverageChunk + 1);
+    std::vector<Reference> references;
+    std::vector<unsigned char> literals;
+    literals.reserve(size);
+
+    size_t offset = 0;
+    while (offset < size) {
+        size_t length = nextBoundary(data + offset, size - offset);
+        const unsigned char* chunk = data + offset;
+        result.chunks++;
+
+        auto inserted = seen.emplace(chunkHash(chunk, length), ChunkEntry{offset, length});
+        const ChunkEntry& first = inserted.first->second;
+        if (!inserted.second && first.length == length && std::memcmp(data + first.offset, chunk, length) == 0) {
+            result.duplicateChunks++;
+            Reference* last = references.empty() ? nullptr : &references.back();
+            if (last && last->position + last->length == offset && last->source + last->length == first.offset) {
+                last->length += length;
+            } else {
+                references.push_back({offset, first.offset, length});
+            }
+        } else {
+            literals.insert(literals.end(), chunk, chunk + length);
+        }
+        offset += length;
+    }
+
+    putVarint(stream, references.size());
+    size_t end = 0;
+    for (const Reference& reference : references) {
+        putVarint(stream, reference.position - end);
+        putVarint(stream, reference.position - reference.source);
+        putVarint(stream, reference.length);
+        end = reference.position + reference.length;
+    }
+    size_t tableSize = stream.size();
+    result.references = references.size();
+    result.bytesSaved = size - literals.size() > tableSize ? size - literals.size() - tableSize : 0;
+
+    bool useful = result.bytesSaved > 0;
+    if (useful) stream.insert(stream.end(), literals.begin(), literals.end());
+    else stream.clear();
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (stats) *stats = result;
+    return useful;
+}
+
+std::vector<unsigned char> flimageResolveDedup(const unsigned char* stream, size_t size, uint64_t fileSize) {
+    size_t offset = 0;
+    uint64_t count = getVarint(stream, size, offset);
+    if (count > size) throw std::runtime_error("Invalid dedup table");
+
+    // Validate the whole table before allocating anything the header claims.
+    std::vector<Reference> references((size_t)count);
+    uint64_t position = 0, literalBytes = 0;
+    for (Reference& reference : references) {
+        uint64_t gap = getVarint(stream, size, offset);
+        uint64_t distance = getVarint(stream, size, offset);
+        uint64_t length = getVarint(stream, size, offset);
+        if (gap > fileSize - position) throw std::runtime_error("Dedup reference out of range");
+        position += gap;
+        literalBytes += gap;
+        if (distance == 0 || distance > position || length > fileSize - position)
+            throw std::runtime_error("Dedup reference out of range");
+        reference.position = (size_t)position;
+        reference.source = (size_t)(position - distance);
+        reference.length = (size_t)length;
+        position += length;
+    }
+    if (literalBytes + (fileSize - position) != size - offset) throw std::runtime_error("Dedup stream size mismatch");
+
+    std::vector<unsigned char> out((size_t)fileSize);
+    const unsigned char* literal = stream + offset;
+    size_t end = 0;
+    for (const Reference& reference : references) {
+        std::memcpy(out.data() + end, literal, reference.position - end);
+        literal += reference.position - end;
+        unsigned char* dst = out.data() + reference.position;
+        const unsigned char* src = out.data() + reference.source;
+        if (reference.position - reference.source >= reference.length) {
+            std::memcpy(dst, src, reference.length);
+        } else {
+            for (size_t i = 0; i < reference.length; i++) dst[i] = src[i];
+        }
+        end = reference.position + reference.length;
+    }
+    std::memcpy(out.data() + end, literal, out.size() - end);
+    return out;
+}
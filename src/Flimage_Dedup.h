@@ -0,0 +1,33 @@
+#ifndef FLIMAGE_DEDUP_H
+#define FLIMAGE_DEDUP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Long-range deduplication. Deflate only sees 32 KiB back, so a region that repeats megabytes later is
+// compressed again from scratch. The payload is cut into content-defined chunks (gear rolling hash, 2..64 KiB,
+// about 8 KiB on average), so boundaries survive insertions and shifted copies line up again. Every chunk
+// seen before becomes a reference to its first occurrence.
+//
+// Stream layout, integers as LEB128 varints:
+//   [count] count * [gap][distance][length] [literal bytes]
+// The decoder copies `gap` literal bytes, then `length` bytes from `distance` bytes back in the output,
+// and appends the remaining literals after the last reference.
+
+struct FlimageDedupStats {
+    size_t chunks = 0;
+    size_t duplicateChunks = 0;
+    size_t references = 0;   // after merging references that continue each other
+    size_t bytesSaved = 0;   // payload bytes replaced by references, minus the reference table
+    double seconds = 0;      // time spent chunking, hashing and building the stream
+};
+
+// Returns false and leaves `stream` empty when deduplication doesn't make the payload smaller.
+bool flimageDedup(const unsigned char* data, size_t size, std::vector<unsigned char>& stream,
+                  FlimageDedupStats* stats = nullptr);
+
+// Resolves the references while writing the file out. Throws std::runtime_error on a malformed stream.
+std::vector<unsigned char> flimageResolveDedup(const unsigned char* stream, size_t size, uint64_t fileSize);
+
+#endif
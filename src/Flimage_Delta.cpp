@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include "Flimage_Delta.h"
+#include "Flimage_Container.h"
+#include "Flimage_Header.h"
+#include "Flimage_Sparse.h"
+
+static const size_t kMinBlock = 32;
+static const size_t kMaxBlocks = (size_t)1 << 22;  // larger bases get larger blocks, the index stays small
+static const uint64_t kRollPrime = 0x100000001B3ull;
+
+struct DeltaOp {
+    size_t insertLength;
+    size_t copyOffset;
+    size_t copyLength;
+};
+
+static void putVarint(std::vector<unsigned char>& out, uint64_t val) {
+    while (val >= 0x80) {
+        out.push_back((unsigned char)(val | 0x80));
+        val >>= 7;
+    }
+    out.push_back((unsigned char)val);
+}
+
+static uint64_t getVarint(const unsigned char* data, size_t size, size_t& offset) {
+    uint64_t val = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (offset >= size) throw std::runtime_error("Truncated delta patch");
+        unsigned char byte = data[offset++];
+        val |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return val;
+    }
+    throw std::runtime_error("Invalid delta patch");
+}
+
+static uint64_t blockHash(const unsigned char* data, size_t size) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < size; i++) hash = hash * kRollPrime + data[i];
+    return hash;
+}
+
+// Base blocks by hash, open addressing without probing: a slot keeps the first block that lands in it, and
+// a lost block only means a match is found one block later.
+class BlockIndex {
+public:
+    BlockIndex(const std::vector<unsigned char>& base, size_t block) {
+        size_t blocks = base.size() / block;
+        bits_ = 10;
+        while (((size_t)1 << bits_) < 2 * blocks) bits_++;
+        slots_.assign((size_t)1 << bits_, 0);
+        for (size_t i = 0; i < blocks; i++) {
+            uint32_t& slot = slots_[slotOf(blockHash(base.data() + i * block, block))];
+            if (!slot) slot = (uint32_t)(i + 1);
+        }
+    }
+
+    // Block number plus one, 0 when the slot is empty.
+    uint32_t find(uint64_t hash) const { return slots_[slotOf(hash)]; }
+
+private:
+    size_t slotOf(uint64_t hash) const { return (size_t)((hash * 0x9E3779B97F4A7C15ull) >> (64 - bits_)); }
+
+    std::vector<uint32_t> slots_;
+    unsigned bits_;
+};
+
+static size_t matchForward(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t length = 0;
+    while (length + 8 <= limit) {
+        uint64_t x, y;
+        std::memcpy(&x, a + length, 8);
+        std::memcpy(&y, b + length, 8);
+        if (x != y) break;
+        length += 8;
+    }
+    while (length < limit && a[length] == b[length]) length++;
+    return length;
+}
+
+std::vector<unsigned char> flimageDeltaEncode(const std::vector<unsigned char>& base, const unsigned char* data,
+                                              size_t size, FlimageDeltaStats* stats) {
+    auto start = std::chrono::steady_clock::now();
+    FlimageDeltaStats result;
+    std::vector<DeltaOp> ops;
+
+    size_t block = kMinBlock;
+    while (base.size() / block > kMaxBlocks) block *= 2;
+    if (base.size() >= block && size >= block) {
+        BlockIndex index(base, block);
+        uint64_t outFactor = 1;
+        for (size_t i = 1; i < block; i++) outFactor *= kRollPrime;
+
+        size_t literalStart = 0, pos = 0;
+        uint64_t hash = blockHash(data, block);
+        while (true) {
+            uint32_t candidate = index.find(hash);
+            size_t baseStart = candidate ? (size_t)(candidate - 1) * block : 0;
+            if (candidate && std::memcmp(base.data() + baseStart, data + pos, block) == 0) {
+                size_t back = 0;
+                while (back < pos - literalStart && back < baseStart &&
+                       base[baseStart - back - 1] == data[pos - back - 1])
+                    back++;
+                size_t limit = std::min(base.size() - baseStart, size - pos);
+                size_t length = block + matchForward(base.data() + baseStart + block, data + pos + block,
+                                                     limit - block);
+                ops.push_back({pos - back - literalStart, baseStart - back, length + back});
+                result.copiedBytes += length + back;
+                pos += length;
+                literalStart = pos;
+                if (pos + block > size) break;
+                hash = blockHash(data + pos, block);
+                continue;
+            }
+            if (pos + block >= size) break;
+            hash = (hash - data[pos] * outFactor) * kRollPrime + data[pos + block];
+            pos++;
+        }
+    }
+
+    std::vector<unsigned char> patch;
+    putVarint(patch, ops.size());
+    size_t copyEnd = 0;
+    for (const DeltaOp& op : ops) {
+        int64_t move = (int64_t)op.copyOffset - (int64_t)copyEnd;
+        putVarint(patch, op.insertLength);
+        putVarint(patch, op.copyLength);
+        putVarint(patch, ((uint64_t)move << 1) ^ (uint64_t)(move >> 63));
+        copyEnd = op.copyOffset + op.copyLength;
+    }
+    size_t position = 0;
+    for (const DeltaOp& op : ops) {
+        patch.insert(patch.end(), data + position, data + position + op.insertLength);
+        position += op.insertLength + op.copyLength;
+    }
+    patch.insert(patch.end(), data + position, data + size);
+
+    result.copies = ops.size();
+    result.insertedBytes = size - result.copiedBytes;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (stats) *stats = result;
+    return patch;
+}
+
+std::vector<unsigned char> flimageDeltaApply(const std::vector<unsigned char>& base, const unsigned char* patch,
+                                             size_t patchSize, uint64_t size) {
+    size_t offset = 0;
+    uint64_t count = getVarint(patch, patchSize, offset);
+    if (count > patchSize) throw std::runtime_error("Invalid delta patch");
+
+    // Validate every op before allocating the size the header claims.
+    std::vector<DeltaOp> ops((size_t)count);
+    uint64_t position = 0, literalBytes = 0, copyEnd = 0;
+    for (DeltaOp& op : ops) {
+        uint64_t insert = getVarint(patch, patchSize, offset);
+        uint64_t length = getVarint(patch, patchSize, offset);
+        uint64_t zigzag = getVarint(patch, patchSize, offset);
+        uint64_t copyOffset = copyEnd + (uint64_t)((zigzag >> 1) ^ (0 - (zigzag & 1)));
+        if (insert > size - position) throw std::runtime_error("Delta op out of range");
+        position += insert;
+        literalBytes += insert;
+        if (length > size - position || copyOffset > base.size() || length > base.size() - copyOffset)
+            throw std::runtime_error("Delta op out of range");
+        op.insertLength = (size_t)insert;
+        op.copyOffset = (size_t)copyOffset;
+        op.copyLength = (size_t)length;
+        position += length;
+        copyEnd = copyOffset + length;
+    }
+    if (literalBytes + (size - position) != patchSize - offset) throw std::runtime_error("Delta patch size mismatch");
+
+    std::vector<unsigned char> out((size_t)size);
+    const unsigned char* literal = patch + offset;
+    unsigned char* dst = out.data();
+    for (const DeltaOp& op : ops) {
+        if (op.insertLength) std::memcpy(dst, literal, op.insertLength);
+        literal += op.insertLength;
+        dst += op.insertLength;
+        if (op.copyLength) std::memcpy(dst, base.data() + op.copyOffset, op.copyLength);
+        dst += op.copyLength;
+    }
+    size_t rest = (size_t)(out.data() + out.size() - dst);
+    if (rest) std::memcpy(dst, literal, rest);
+    return out;
+}
+
+std::vector<unsigned char> flimageReadDeltaBase(const std::string& path, const std::string& password) {
+    static const unsigned char kPngSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open()) throw std::runtime_error("Failed to open delta base");
+    unsigned char head[8] = {};
+    ifs.read(reinterpret_cast<char*>(head), sizeof(head));
+    if (ifs.gcount() == 8 && std::memcmp(head, kPngSignature, 8) == 0) {
+        ifs.seekg(0);
+        std::vector<unsigned char> png((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        if (lodepng_chunk_find_const(png.data() + 8, png.data() + png.size(), kFlimageChunkType))
+            return flimageDecode(png, password).data;
+    }
+    return flimageReadSparseFile(path).data;
+}
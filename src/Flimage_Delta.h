@@ -0,0 +1,37 @@
+#ifndef FLIMAGE_DELTA_H
+#define FLIMAGE_DELTA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Delta updates. A changed file is stored as a patch against the data of an earlier version, the base: copy
+// ops for the regions the base already holds and inserts for the rest. The base is indexed in fixed blocks
+// by a polynomial rolling hash; the new file is scanned position by position, and every block hit is
+// confirmed and then extended in both directions as far as the bytes agree.
+//
+// Patch layout, integers as LEB128 varints:
+//   [count] count * [insert length][copy length][copy offset] [literal bytes]
+// The decoder appends `insert length` literal bytes, then `copy length` bytes from the base. Copy offsets are
+// zigzag coded relative to the end of the previous copy. Literals left after the last op end the file.
+
+struct FlimageDeltaStats {
+    size_t copies = 0;
+    size_t copiedBytes = 0;
+    size_t insertedBytes = 0;
+    double seconds = 0;
+};
+
+std::vector<unsigned char> flimageDeltaEncode(const std::vector<unsigned char>& base, const unsigned char* data,
+                                              size_t size, FlimageDeltaStats* stats = nullptr);
+
+// Throws std::runtime_error on a malformed patch or one that doesn't produce exactly `size` bytes.
+std::vector<unsigned char> flimageDeltaApply(const std::vector<unsigned char>& base, const unsigned char* patch,
+                                             size_t patchSize, uint64_t size);
+
+// The data a patch refers to: decoded from a Flimage PNG (with the password if it is encrypted), or the
+// extents of a plain file as the encoder reads them. Throws std::runtime_error if it can't be read.
+std::vector<unsigned char> flimageReadDeltaBase(const std::string& path, const std::string& password);
+
+#endif
@@ -1,33 +1,44 @@
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <vector>
-#include <cmath>
 #include <stdexcept>
 #include <string>
-#include <cstdint>
+#include <utility>
 
 #include "lodepng.h"
-
-static std::vector<unsigned char> readFileAll(const std::string& path) {
-    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
-    if (!ifs.is_open()) throw std::runtime_error("Failed to open file");
-    std::streampos fileSize = ifs.tellg();
-    ifs.seekg(0, std::ios::beg);
-    std::vector<unsigned char> buffer(fileSize);
-    if (!ifs.read(reinterpret_cast<char*>(buffer.data()), fileSize))
-        throw std::runtime_error("Failed to read file");
-    return buffer;
+#include "Flimage_Arena.h"
+#include "Flimage_Container.h"
+#include "Flimage_Cache.h"
+#include "Flimage_Crypto.h"
+#include "Flimage_Stats.h"
+#include "Flimage_Trace.h"
+
+static const uint64_t kDefaultCacheMegabytes = 1024;
+
+// Reads only the data extents. Files that turn out to be a single extent are stored as plain files.
+static void readInputFile(const std::string& path, FlimageFile& file) {
+    FlimagePhase phase("read");
+    FlimageSparseData sparse = flimageReadSparseFile(path);
+    phase.setBytes(sparse.data.size(), sparse.data.size());
+    file.data = std::move(sparse.data);
+    bool dense = sparse.size == 0 || (sparse.extents.size() == 1 && sparse.extents[0].length == sparse.size);
+    if (!dense) {
+        file.sparse = true;
+        file.size = sparse.size;
+        file.extents = std::move(sparse.extents);
+    }
 }
 
+// Written next to the target and renamed over it: an output hard linked to a cache entry is replaced, never
+// overwritten in place.
 static void writeFileAll(const std::string& path, const std::vector<unsigned char>& data) {
-    std::ofstream ofs(path, std::ios::binary);
-    if (!ofs.is_open()) throw std::runtime_error("Failed to write file");
-    ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
-    ofs.close();
-}
-
-static std::vector<unsigned char> stringToBytes(const std::string& str) {
-    return std::vector<unsigned char>(str.begin(), str.end());
+    FlimagePhase phase("write");
+    phase.setBytes(data.size(), data.size());
+    flimageWriteFile(path, data.data(), data.size());
 }
 
 static std::string getBaseName(const std::string& path) {
@@ -47,72 +58,179 @@ static std::string getExtension(const std::string& path) {
     return path.substr(dotPos + 1);
 }
 
-static void intToBytes(uint32_t val, std::vector<unsigned char>& out) {
-    out.push_back((unsigned char)((val >>  0) & 0xFF));
-    out.push_back((unsigned char)((val >>  8) & 0xFF));
-    out.push_back((unsigned char)((val >> 16) & 0xFF));
-    out.push_back((unsigned char)((val >> 24) & 0xFF));
+static void printUsage(const char* program) {
+    std::cerr << "[Usage] : " << program << " [--format=auto|grey8|rgb8|rgba8|rgba16]"
+              << " [--transform=auto|none|shuffleN|deltaN|x86] [--dedup=on|off]"
+              << " [--codec=deflate|lz|zlib] [--password-file=<path>] [--cache=<dir>] [--cache-size=<MiB>]"
+              << " [--delta-from=<old png or file>] [--shard-size=<MiB>] [--shard-memory=<MiB>]"
+              << " [--race[=<threads>]] [--race-memory=<MiB>] [--target-speed=<MB/s>] [--time-budget=<seconds>]"
+              << " [--stats[=<json file>]] [--trace=<json file>] <file>" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
+    auto start = std::chrono::steady_clock::now();
     try {
-        if (argc < 2) return 0;
-        std::string inputFilePath = argv[1];
-
-        std::vector<unsigned char> fileData = readFileAll(inputFilePath);
-
-        std::string name = getBaseName(inputFilePath);
-        std::string ext = getExtension(inputFilePath);
-        uint32_t fileSize = (uint32_t)fileData.size();
+        FlimageEncodeOptions options;
+        std::string inputFilePath, passwordFile, cacheDir, deltaFrom, statsPath, tracePath;
+        bool printStats = false;
+        uint64_t cacheMegabytes = kDefaultCacheMegabytes;
+        uint64_t shardSize = kFlimageDefaultShardSize;
+        uint64_t shardMemory = kFlimageDefaultShardMemory;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 9, "--format=") == 0) {
+                if (!flimageParsePixelFormat(arg.substr(9), options.format))
+                    throw std::runtime_error("Unknown pixel format: " + arg.substr(9));
+            } else if (arg.compare(0, 12, "--transform=") == 0) {
+                if (!flimageParseTransform(arg.substr(12), options.transform))
+                    throw std::runtime_error("Unknown transform: " + arg.substr(12));
+            } else if (arg.compare(0, 8, "--codec=") == 0) {
+                if (!flimageParseCodec(arg.substr(8), options.codec))
+                    throw std::runtime_error("Unknown codec: " + arg.substr(8));
+            } else if (arg.compare(0, 16, "--password-file=") == 0) {
+                passwordFile = arg.substr(16);
+            } else if (arg.compare(0, 13, "--delta-from=") == 0) {
+                deltaFrom = arg.substr(13);
+            } else if (arg.compare(0, 8, "--cache=") == 0) {
+                cacheDir = arg.substr(8);
+            } else if (arg.compare(0, 13, "--cache-size=") == 0) {
+                cacheMegabytes = std::strtoull(arg.c_str() + 13, nullptr, 10);
+            } else if (arg.compare(0, 13, "--shard-size=") == 0) {
+                shardSize = std::strtoull(arg.c_str() + 13, nullptr, 10) << 20;
+            } else if (arg.compare(0, 15, "--shard-memory=") == 0) {
+                shardMemory = std::strtoull(arg.c_str() + 15, nullptr, 10) << 20;
+            } else if (arg == "--dedup=on" || arg == "--dedup=off") {
+                options.dedup = arg == "--dedup=on";
+            } else if (arg == "--race" || arg.compare(0, 7, "--race=") == 0) {
+                options.race.enabled = true;
+                if (arg.size() > 7) options.race.threads = std::strtoull(arg.c_str() + 7, nullptr, 10);
+            } else if (arg.compare(0, 14, "--race-memory=") == 0) {
+                options.race.memoryBudget = std::strtoull(arg.c_str() + 14, nullptr, 10) << 20;
+            } else if (arg.compare(0, 15, "--target-speed=") == 0) {
+                options.pace.megabytesPerSecond = std::strtod(arg.c_str() + 15, nullptr);
+            } else if (arg.compare(0, 14, "--time-budget=") == 0) {
+                options.pace.seconds = std::strtod(arg.c_str() + 14, nullptr);
+            } else if (arg == "--stats" || arg.compare(0, 8, "--stats=") == 0) {
+                printStats = true;
+                if (arg.size() > 8) statsPath = arg.substr(8);
+            } else if (arg.compare(0, 8, "--trace=") == 0) {
+                tracePath = arg.substr(8);
+            } else if (arg.compare(0, 2, "--") == 0) {
+                printUsage(argv[0]);
+                throw std::runtime_error("Unknown option: " + arg);
+            } else {
+                inputFilePath = arg;
+            }
+        }
+        if (inputFilePath.empty()) return 0;
+        options.password = flimageReadPassword(passwordFile);
+        if (printStats) flimageStatsEnable();
+        if (!tracePath.empty()) flimageTraceEnable();
+        auto reportStats = [&]() {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (printStats) flimageStatsWrite(statsPath, "Flimage_Encoder", seconds);
+            if (!tracePath.empty()) flimageTraceWrite(tracePath, "Flimage_Encoder");
+        };
+
+        FlimageArenaScope arena;
+        lodepng::CompressContext context;
+
+        std::vector<unsigned char> deltaBase;
+        if (!deltaFrom.empty()) {
+            FlimagePhase phase("read_base");
+            deltaBase = flimageReadDeltaBase(deltaFrom, options.password);
+            phase.setBytes(deltaBase.size(), deltaBase.size());
+            options.deltaBase = &deltaBase;
+        }
 
-        std::vector<unsigned char> combinedData;
+        FlimageFile file;
+        readInputFile(inputFilePath, file);
+        file.name = getBaseName(inputFilePath);
+        file.ext = getExtension(inputFilePath);
+        std::string outPng = getBaseName(inputFilePath) + ".png";
 
-        intToBytes(fileSize, combinedData);
+        // Shards are written as <name>.<index>.png; the cache only holds single PNGs.
+        if (flimageShardCount(file.data.size(), shardSize) > 1) {
+            std::mutex printMutex;
+            {
+                FlimagePhase phase("encode");
+                phase.setBytes(file.data.size(), 0);
+                flimageEncodeShards(file, options, shardSize,
+                                    [&](const FlimageShard& shard, const std::vector<unsigned char>& png) {
+                    std::string shardPng = getBaseName(inputFilePath) + "." + std::to_string(shard.index) + ".png";
+                    writeFileAll(shardPng, png);
+                    std::lock_guard<std::mutex> lock(printMutex);
+                    std::cout << "[Shard] : " << shard.index + 1 << " of " << shard.count << " -> " << shardPng
+                              << " (" << png.size() << " bytes)" << std::endl;
+                }, shardMemory);
+            }
+            reportStats();
+            return 0;
+        }
 
-        combinedData.push_back((unsigned char)ext.size());
-        {
-            auto extBytes = stringToBytes(ext);
-            combinedData.insert(combinedData.end(), extBytes.begin(), extBytes.end());
+        std::unique_ptr<FlimageEncodeCache> cache;
+        std::string cacheKey;
+        if (!cacheDir.empty()) {
+            bool hit;
+            {
+                FlimagePhase phase("cache_fetch");
+                cache.reset(new FlimageEncodeCache(cacheDir, cacheMegabytes << 20));
+                cacheKey = cache->key(file, options);
+                hit = cache->fetch(cacheKey, outPng);
+            }
+            if (hit) {
+                std::cout << "[Cache] : hit " << cacheKey << std::endl;
+                reportStats();
+                return 0;
+            }
         }
 
-        combinedData.push_back((unsigned char)name.size());
+        FlimageEncodeReport report;
+        std::vector<unsigned char> pngData;
         {
-            auto nameBytes = stringToBytes(name);
-            combinedData.insert(combinedData.end(), nameBytes.begin(), nameBytes.end());
+            FlimagePhase phase("encode");
+            pngData = flimageEncode(file, options, context, &report);
+            phase.setBytes(file.data.size(), pngData.size());
+        }
+        if (report.dedup) {
+            const FlimageDedupStats& stats = report.dedupStats;
+            double megabytesPerSecond = stats.seconds > 0 ? file.data.size() / 1e6 / stats.seconds : 0;
+            std::cout << "[Dedup] : " << stats.duplicateChunks << " of " << stats.chunks << " chunks repeated, "
+                      << stats.bytesSaved << " bytes saved, chunker " << (long)megabytesPerSecond << " MB/s" << std::endl;
         }
 
-        combinedData.insert(combinedData.end(), fileData.begin(), fileData.end());
-
-        size_t totalSize = combinedData.size();
-        size_t pixelCount = (totalSize + 3) / 4;
-
-        size_t width = (size_t)std::ceil(std::sqrt((double)pixelCount));
-        size_t height = (pixelCount + width - 1) / width;
-        
-        size_t imageBufferSize = width * height * 4;
-        std::vector<unsigned char> rawPixels(imageBufferSize, 0);
+        if (report.raced) {
+            const FlimageRaceStats& stats = report.raceStats;
+            std::cout << "[Race] : " << stats.candidates << " candidates, " << stats.threads << " at once, "
+                      << stats.cancelled << " cancelled, " << stats.winner << " won with " << stats.size << " bytes";
+            if (stats.defaultSize) std::cout << " (default " << stats.defaultSize << ")";
+            std::cout << ", " << (long)(stats.seconds * 1000) << " ms" << std::endl;
+        }
 
-        {
-            size_t dataIndex = 0;
-            for (size_t i = 0; i < imageBufferSize; i++) {
-                unsigned char value = 0;
-                if (dataIndex < totalSize) {
-                    value = combinedData[dataIndex++];
-                }
-                rawPixels[i] = value;
+        if (report.paced) {
+            const FlimagePaceStats& stats = report.paceStats;
+            std::cout << "[Pace] : " << stats.blocks << " blocks";
+            for (size_t i = 0; i < kFlimagePaceLevels; i++) {
+                if (stats.levelBlocks[i]) std::cout << ", " << stats.levelBlocks[i] << " " << kFlimagePaceLevel[i].name;
             }
+            long margin = (long)(stats.secondsToDeadline * 1000);
+            std::cout << ", " << (margin >= 0 ? margin : -margin) << " ms " << (margin >= 0 ? "early" : "late")
+                      << std::endl;
         }
 
-        std::vector<unsigned char> pngData;
-        unsigned error = lodepng::encode(pngData, rawPixels, (unsigned)width, (unsigned)height);
-        if (error) {
-            throw std::runtime_error(
-                "PNG encode error: " + std::string(lodepng_error_text(error))
-            );
+        if (options.deltaBase) {
+            const FlimageDeltaStats& stats = report.deltaStats;
+            double megabytesPerSecond = stats.seconds > 0 ? file.data.size() / 1e6 / stats.seconds : 0;
+            std::cout << "[Delta] : " << stats.copies << " copies, " << stats.copiedBytes << " bytes from the base, "
+                      << stats.insertedBytes << " bytes new, " << (long)megabytesPerSecond << " MB/s" << std::endl;
         }
 
-        std::string outPng = getBaseName(inputFilePath) + ".png";
         writeFileAll(outPng, pngData);
+        if (cache) {
+            FlimagePhase phase("cache_store");
+            cache->store(cacheKey, pngData);
+        }
+        reportStats();
     }
     catch (const std::exception& e) {
         std::cerr << "[Error] : " << e.what() << std::endl;
@@ -0,0 +1,279 @@
+#include "Flimage_Hash.h"
+
+#if !defined(FLIMAGE_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64))
+#define FLIMAGE_SSE2
+#include <emmintrin.h>
+#endif
+
+static const uint32_t kPrime32_1 = 0x9E3779B1U;
+static const uint32_t kPrime32_2 = 0x85EBCA77U;
+static const uint32_t kPrime32_3 = 0xC2B2AE3DU;
+static const uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+static const uint64_t kPrimeMx1 = 0x165667919E3779F9ULL;
+static const uint64_t kPrimeMx2 = 0x9FB21C651E98DF25ULL;
+
+static const size_t kSecretSize = 192;
+static const size_t kStripeSize = 64;
+static const size_t kSecretConsumeRate = 8;
+static const size_t kStripesPerBlock = (kSecretSize - kStripeSize) / kSecretConsumeRate;
+static const size_t kBlockSize = kStripeSize * kStripesPerBlock;
+static const size_t kMidSizeMax = 240;
+
+alignas(16) static const unsigned char kSecret[kSecretSize] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static uint32_t read32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read64(const unsigned char* p) {
+    return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static uint32_t swap32(uint32_t v) {
+    return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+}
+
+static uint64_t swap64(uint64_t v) {
+    return ((uint64_t)swap32((uint32_t)v) << 32) | swap32((uint32_t)(v >> 32));
+}
+
+static uint32_t rotl32(uint32_t v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+static FlimageHash128 multiply128(uint64_t a, uint64_t b) {
+    FlimageHash128 product;
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 full = (unsigned __int128)a * b;
+    product.low = (uint64_t)full;
+    product.high = (uint64_t)(full >> 64);
+#else
+    uint64_t loLo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hiLo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t loHi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hiHi = (a >> 32) * (b >> 32);
+    uint64_t cross = (loLo >> 32) + (hiLo & 0xFFFFFFFF) + loHi;
+    product.low = (cross << 32) | (loLo & 0xFFFFFFFF);
+    product.high = (hiLo >> 32) + (cross >> 32) + hiHi;
+#endif
+    return product;
+}
+
+static uint64_t multiplyFold(uint64_t a, uint64_t b) {
+    FlimageHash128 product = multiply128(a, b);
+    return product.low ^ product.high;
+}
+
+static uint64_t xorShift(uint64_t v, int shift) {
+    return v ^ (v >> shift);
+}
+
+static uint64_t xxh64Avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= kPrime64_2;
+    h ^= h >> 29;
+    h *= kPrime64_3;
+    return h ^ (h >> 32);
+}
+
+static uint64_t avalanche(uint64_t h) {
+    h = xorShift(h, 37);
+    h *= kPrimeMx1;
+    return xorShift(h, 32);
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// Short inputs
+
+static FlimageHash128 hash1To3(const unsigned char* data, size_t size) {
+    uint32_t combinedLow = ((uint32_t)data[0] << 16) | ((uint32_t)data[size >> 1] << 24) |
+                           (uint32_t)data[size - 1] | ((uint32_t)size << 8);
+    uint32_t combinedHigh = rotl32(swap32(combinedLow), 13);
+    uint64_t flipLow = read32(kSecret) ^ read32(kSecret + 4);
+    uint64_t flipHigh = read32(kSecret + 8) ^ read32(kSecret + 12);
+    FlimageHash128 hash;
+    hash.low = xxh64Avalanche(combinedLow ^ flipLow);
+    hash.high = xxh64Avalanche(combinedHigh ^ flipHigh);
+    return hash;
+}
+
+static FlimageHash128 hash4To8(const unsigned char* data, size_t size) {
+    uint64_t input = read32(data) + ((uint64_t)read32(data + size - 4) << 32);
+    uint64_t flip = read64(kSecret + 16) ^ read64(kSecret + 24);
+    FlimageHash128 m = multiply128(input ^ flip, kPrime64_1 + ((uint64_t)size << 2));
+    m.high += m.low << 1;
+    m.low ^= m.high >> 3;
+    m.low = xorShift(m.low, 35);
+    m.low *= kPrimeMx2;
+    m.low = xorShift(m.low, 28);
+    m.high = avalanche(m.high);
+    return m;
+}
+
+static FlimageHash128 hash9To16(const unsigned char* data, size_t size) {
+    uint64_t flipLow = read64(kSecret + 32) ^ read64(kSecret + 40);
+    uint64_t flipHigh = read64(kSecret + 48) ^ read64(kSecret + 56);
+    uint64_t inputLow = read64(data);
+    uint64_t inputHigh = read64(data + size - 8);
+    FlimageHash128 m = multiply128(inputLow ^ inputHigh ^ flipLow, kPrime64_1);
+    m.low += (uint64_t)(size - 1) << 54;
+    inputHigh ^= flipHigh;
+    m.high += inputHigh + (uint64_t)(uint32_t)inputHigh * (kPrime32_2 - 1);
+    m.low ^= swap64(m.high);
+    FlimageHash128 hash = multiply128(m.low, kPrime64_2);
+    hash.high += m.high * kPrime64_2;
+    hash.low = avalanche(hash.low);
+    hash.high = avalanche(hash.high);
+    return hash;
+}
+
+static uint64_t mix16(const unsigned char* data, const unsigned char* secret) {
+    return multiplyFold(read64(data) ^ read64(secret), read64(data + 8) ^ read64(secret + 8));
+}
+
+static void mix32(FlimageHash128& acc, const unsigned char* first, const unsigned char* second,
+                  const unsigned char* secret) {
+    acc.low += mix16(first, secret);
+    acc.low ^= read64(second) + read64(second + 8);
+    acc.high += mix16(second, secret + 16);
+    acc.high ^= read64(first) + read64(first + 8);
+}
+
+static FlimageHash128 finishMid(const FlimageHash128& acc, size_t size) {
+    FlimageHash128 hash;
+    hash.low = avalanche(acc.low + acc.high);
+    hash.high = 0 - avalanche(acc.low * kPrime64_1 + acc.high * kPrime64_4 + (uint64_t)size * kPrime64_2);
+    return hash;
+}
+
+static FlimageHash128 hash17To128(const unsigned char* data, size_t size) {
+    FlimageHash128 acc;
+    acc.low = (uint64_t)size * kPrime64_1;
+    if (size > 32) {
+        if (size > 64) {
+            if (size > 96) mix32(acc, data + 48, data + size - 64, kSecret + 96);
+            mix32(acc, data + 32, data + size - 48, kSecret + 64);
+        }
+        mix32(acc, data + 16, data + size - 32, kSecret + 32);
+    }
+    mix32(acc, data, data + size - 16, kSecret);
+    return finishMid(acc, size);
+}
+
+static FlimageHash128 hash129To240(const unsigned char* data, size_t size) {
+    FlimageHash128 acc;
+    acc.low = (uint64_t)size * kPrime64_1;
+    size_t rounds = size / 32;
+    for (size_t i = 0; i < 4; i++) mix32(acc, data + 32 * i, data + 32 * i + 16, kSecret + 32 * i);
+    acc.low = avalanche(acc.low);
+    acc.high = avalanche(acc.high);
+    for (size_t i = 4; i < rounds; i++) mix32(acc, data + 32 * i, data + 32 * i + 16, kSecret + 3 + 32 * (i - 4));
+    mix32(acc, data + size - 16, data + size - 32, kSecret + 136 - 17 - 16);
+    return finishMid(acc, size);
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// Long inputs: eight 64-bit lanes over 64-byte stripes, scrambled after every block of 16 stripes
+
+#ifdef FLIMAGE_SSE2
+static void accumulateStripe(uint64_t acc[8], const unsigned char* data, const unsigned char* secret) {
+    __m128i* lanes = reinterpret_cast<__m128i*>(acc);
+    for (int i = 0; i < 4; i++) {
+        __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + i);
+        __m128i key = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+        __m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+        lanes[i] = _mm_add_epi64(product, _mm_add_epi64(lanes[i], swapped));
+    }
+}
+
+static void scramble(uint64_t acc[8], const unsigned char* secret) {
+    __m128i* lanes = reinterpret_cast<__m128i*>(acc);
+    const __m128i prime = _mm_set1_epi32((int)kPrime32_1);
+    for (int i = 0; i < 4; i++) {
+        __m128i lane = lanes[i];
+        lane = _mm_xor_si128(lane, _mm_srli_epi64(lane, 47));
+        lane = _mm_xor_si128(lane, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+        __m128i productLow = _mm_mul_epu32(lane, prime);
+        __m128i productHigh = _mm_mul_epu32(_mm_shuffle_epi32(lane, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        lanes[i] = _mm_add_epi64(productLow, _mm_slli_epi64(productHigh, 32));
+    }
+}
+#else
+static void accumulateStripe(uint64_t acc[8], const unsigned char* data, const unsigned char* secret) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t value = read64(data + 8 * i);
+        uint64_t key = value ^ read64(secret + 8 * i);
+        acc[i ^ 1] += value;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static void scramble(uint64_t acc[8], const unsigned char* secret) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t lane = xorShift(acc[i], 47) ^ read64(secret + 8 * i);
+        acc[i] = lane * kPrime32_1;
+    }
+}
+#endif
+
+static void accumulate(uint64_t acc[8], const unsigned char* data, size_t stripes) {
+    for (size_t n = 0; n < stripes; n++) accumulateStripe(acc, data + n * kStripeSize, kSecret + n * kSecretConsumeRate);
+}
+
+static uint64_t mergeLanes(const uint64_t acc[8], const unsigned char* secret, uint64_t start) {
+    uint64_t result = start;
+    for (int i = 0; i < 4; i++)
+        result += multiplyFold(acc[2 * i] ^ read64(secret + 16 * i), acc[2 * i + 1] ^ read64(secret + 16 * i + 8));
+    return avalanche(result);
+}
+
+static FlimageHash128 hashLong(const unsigned char* data, size_t size) {
+    alignas(16) uint64_t acc[8] = {
+        kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3, kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1,
+    };
+    size_t blocks = (size - 1) / kBlockSize;
+    for (size_t n = 0; n < blocks; n++) {
+        accumulate(acc, data + n * kBlockSize, kStripesPerBlock);
+        scramble(acc, kSecret + kSecretSize - kStripeSize);
+    }
+    accumulate(acc, data + blocks * kBlockSize, (size - 1 - blocks * kBlockSize) / kStripeSize);
+    accumulateStripe(acc, data + size - kStripeSize, kSecret + kSecretSize - kStripeSize - 7);
+
+    FlimageHash128 hash;
+    hash.low = mergeLanes(acc, kSecret + 11, (uint64_t)size * kPrime64_1);
+    hash.high = mergeLanes(acc, kSecret + kSecretSize - sizeof(acc) - 11, ~((uint64_t)size * kPrime64_2));
+    return hash;
+}
+
+FlimageHash128 flimageHash128(const unsigned char* data, size_t size) {
+    if (size == 0) {
+        FlimageHash128 hash;
+        hash.low = xxh64Avalanche(read64(kSecret + 64) ^ read64(kSecret + 72));
+        hash.high = xxh64Avalanche(read64(kSecret + 80) ^ read64(kSecret + 88));
+        return hash;
+    }
+    if (size <= 3) return hash1To3(data, size);
+    if (size <= 8) return hash4To8(data, size);
+    if (size <= 16) return hash9To16(data, size);
+    if (size <= 128) return hash17To128(data, size);
+    if (size <= kMidSizeMax) return hash129To240(data, size);
+    return hashLong(data, size);
+}
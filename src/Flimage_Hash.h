@@ -0,0 +1,21 @@
+#ifndef FLIMAGE_HASH_H
+#define FLIMAGE_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+// XXH3-128 (xxHash 0.8, seed 0, default secret), bit-exact with the reference implementation. It checks that a
+// decoded file is the file that was encoded; it is not a cryptographic hash. Long inputs run the SSE2 stripe
+// loop when available.
+
+struct FlimageHash128 {
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    bool operator==(const FlimageHash128& other) const { return low == other.low && high == other.high; }
+    bool operator!=(const FlimageHash128& other) const { return !(*this == other); }
+};
+
+FlimageHash128 flimageHash128(const unsigned char* data, size_t size);
+
+#endif
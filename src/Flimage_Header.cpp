@@ -0,0 +1,231 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "Flimage_Header.h"
+
+const char kFlimageChunkType[5] = "flIm";
+
+static const uint8_t kHeaderVersion = 1;
+
+static const uint8_t kCipherChaCha20Poly1305 = 1;
+static const uint8_t kKdfPbkdf2Sha256 = 1;
+static const size_t kEncryptionFieldSize = 2 + 4 + kFlimageSaltSize + kFlimageNonceSize;
+
+enum HeaderTag : uint8_t {
+    kTagName = 1,
+    kTagExtension = 2,
+    kTagPayloadSize = 3,
+    kTagPixelFormat = 4,
+    kTagRecordStride = 5,
+    kTagTransform = 6,
+    kTagDedup = 7,
+    kTagCodec = 8,
+    kTagExtents = 9,
+    kTagEncryption = 10,
+    kTagContentHash = 11,
+    kTagDelta = 12,
+    kTagShard = 13,
+};
+
+static void putInt(std::vector<unsigned char>& out, uint64_t val, unsigned bytes) {
+    for (unsigned i = 0; i < bytes; i++) out.push_back((unsigned char)((val >> (8 * i)) & 0xFF));
+}
+
+static uint64_t getInt(const unsigned char* data, unsigned bytes) {
+    uint64_t val = 0;
+    for (unsigned i = 0; i < bytes; i++) val |= (uint64_t)data[i] << (8 * i);
+    return val;
+}
+
+static void putRecord(std::vector<unsigned char>& out, uint8_t tag, const unsigned char* data, size_t size) {
+    out.push_back(tag);
+    putInt(out, size, 4);
+    out.insert(out.end(), data, data + size);
+}
+
+static void putString(std::vector<unsigned char>& out, uint8_t tag, const std::string& str) {
+    putRecord(out, tag, reinterpret_cast<const unsigned char*>(str.data()), str.size());
+}
+
+static void putNumber(std::vector<unsigned char>& out, uint8_t tag, uint64_t val, unsigned bytes) {
+    std::vector<unsigned char> buffer;
+    putInt(buffer, val, bytes);
+    putRecord(out, tag, buffer.data(), buffer.size());
+}
+
+static uint64_t getNumber(const unsigned char* data, size_t size, size_t expected) {
+    if (size != expected) throw std::runtime_error("Invalid header field size");
+    return getInt(data, (unsigned)size);
+}
+
+std::vector<unsigned char> flimageWriteHeader(const FlimageHeader& header) {
+    std::vector<unsigned char> out;
+    out.push_back(kHeaderVersion);
+    putString(out, kTagName, header.name);
+    putString(out, kTagExtension, header.ext);
+    putNumber(out, kTagPayloadSize, header.payloadSize, 8);
+    putNumber(out, kTagPixelFormat, (uint64_t)header.pixelFormat, 1);
+    if (header.recordStride) putNumber(out, kTagRecordStride, header.recordStride, 4);
+    if (header.transform.kind != FlimageTransformKind::None) {
+        std::vector<unsigned char> transform;
+        putInt(transform, (uint64_t)header.transform.kind, 1);
+        putInt(transform, header.transform.param, 4);
+        putRecord(out, kTagTransform, transform.data(), transform.size());
+    }
+    if (header.dedup) putNumber(out, kTagDedup, header.fileSize, 8);
+    if (header.codec != FlimageCodec::Deflate) {
+        std::vector<unsigned char> codec;
+        putInt(codec, (uint64_t)header.codec, 1);
+        putInt(codec, header.unpackedSize, 8);
+        putRecord(out, kTagCodec, codec.data(), codec.size());
+    }
+    if (header.sparse) {
+        std::vector<unsigned char> extents;
+        putInt(extents, header.sparseSize, 8);
+        for (const FlimageExtent& extent : header.extents) {
+            putInt(extents, extent.offset, 8);
+            putInt(extents, extent.length, 8);
+        }
+        putRecord(out, kTagExtents, extents.data(), extents.size());
+    }
+    if (header.encrypted) {
+        std::vector<unsigned char> encryption;
+        encryption.push_back(kCipherChaCha20Poly1305);
+        encryption.push_back(kKdfPbkdf2Sha256);
+        putInt(encryption, header.kdfIterations, 4);
+        encryption.insert(encryption.end(), header.salt, header.salt + kFlimageSaltSize);
+        encryption.insert(encryption.end(), header.nonce, header.nonce + kFlimageNonceSize);
+        putRecord(out, kTagEncryption, encryption.data(), encryption.size());
+    }
+    if (header.hasHash) {
+        std::vector<unsigned char> hash;
+        putInt(hash, header.contentHash.low, 8);
+        putInt(hash, header.contentHash.high, 8);
+        putRecord(out, kTagContentHash, hash.data(), hash.size());
+    }
+    if (header.delta) {
+        std::vector<unsigned char> delta;
+        putInt(delta, header.deltaSize, 8);
+        putInt(delta, header.baseSize, 8);
+        putInt(delta, header.baseHash.low, 8);
+        putInt(delta, header.baseHash.high, 8);
+        putRecord(out, kTagDelta, delta.data(), delta.size());
+    }
+    if (header.sharded) {
+        std::vector<unsigned char> shard(header.shard.fileId, header.shard.fileId + sizeof(header.shard.fileId));
+        putInt(shard, header.shard.index, 4);
+        putInt(shard, header.shard.count, 4);
+        putInt(shard, header.shard.offset, 8);
+        putInt(shard, header.shard.dataSize, 8);
+        putRecord(out, kTagShard, shard.data(), shard.size());
+    }
+    return out;
+}
+
+FlimageHeader flimageReadHeader(const unsigned char* data, size_t size) {
+    if (size < 1) throw std::runtime_error("Empty Flimage header");
+    if (data[0] != kHeaderVersion) throw std::runtime_error("Unsupported Flimage header version");
+
+    FlimageHeader header;
+    bool hasPayloadSize = false;
+    size_t offset = 1;
+    while (offset < size) {
+        if (size - offset < 5) throw std::runtime_error("Truncated header field");
+        uint8_t tag = data[offset];
+        size_t len = (size_t)getInt(data + offset + 1, 4);
+        offset += 5;
+        if (len > size - offset) throw std::runtime_error("Header field out of range");
+        const unsigned char* field = data + offset;
+        offset += len;
+
+        switch (tag) {
+        case kTagName:
+            header.name.assign(reinterpret_cast<const char*>(field), len);
+            break;
+        case kTagExtension:
+            header.ext.assign(reinterpret_cast<const char*>(field), len);
+            break;
+        case kTagPayloadSize:
+            header.payloadSize = getNumber(field, len, 8);
+            hasPayloadSize = true;
+            break;
+        case kTagPixelFormat: {
+            uint64_t format = getNumber(field, len, 1);
+            if (format < (uint64_t)FlimagePixelFormat::Grey8 || format > (uint64_t)FlimagePixelFormat::RGBA16)
+                throw std::runtime_error("Invalid pixel format");
+            header.pixelFormat = (FlimagePixelFormat)format;
+            break;
+        }
+        case kTagRecordStride:
+            header.recordStride = (uint32_t)getNumber(field, len, 4);
+            break;
+        case kTagTransform:
+            if (len != 5) throw std::runtime_error("Invalid header field size");
+            header.transform.kind = (FlimageTransformKind)field[0];
+            header.transform.param = (uint32_t)getInt(field + 1, 4);
+            flimageValidateTransform(header.transform);
+            break;
+        case kTagDedup:
+            header.fileSize = getNumber(field, len, 8);
+            header.dedup = true;
+            break;
+        case kTagCodec:
+            if (len != 9) throw std::runtime_error("Invalid header field size");
+            if (field[0] != (uint8_t)FlimageCodec::Lz && field[0] != (uint8_t)FlimageCodec::Zlib)
+                throw std::runtime_error("Unknown payload codec");
+            header.codec = (FlimageCodec)field[0];
+            header.unpackedSize = getInt(field + 1, 8);
+            break;
+        case kTagExtents:
+            if (len < 8 || (len - 8) % 16) throw std::runtime_error("Invalid header field size");
+            header.sparse = true;
+            header.sparseSize = getInt(field, 8);
+            header.extents.resize((len - 8) / 16);
+            for (size_t i = 0; i < header.extents.size(); i++) {
+                header.extents[i].offset = getInt(field + 8 + i * 16, 8);
+                header.extents[i].length = getInt(field + 16 + i * 16, 8);
+            }
+            break;
+        case kTagEncryption:
+            if (len != kEncryptionFieldSize) throw std::runtime_error("Invalid header field size");
+            if (field[0] != kCipherChaCha20Poly1305 || field[1] != kKdfPbkdf2Sha256)
+                throw std::runtime_error("Unsupported encryption");
+            header.encrypted = true;
+            header.kdfIterations = (uint32_t)getInt(field + 2, 4);
+            if (header.kdfIterations == 0 || header.kdfIterations > kFlimageMaxKdfIterations)
+                throw std::runtime_error("Invalid key derivation parameters");
+            std::memcpy(header.salt, field + 6, kFlimageSaltSize);
+            std::memcpy(header.nonce, field + 6 + kFlimageSaltSize, kFlimageNonceSize);
+            break;
+        case kTagContentHash:
+            if (len != 16) throw std::runtime_error("Invalid header field size");
+            header.hasHash = true;
+            header.contentHash.low = getInt(field, 8);
+            header.contentHash.high = getInt(field + 8, 8);
+            break;
+        case kTagDelta:
+            if (len != 32) throw std::runtime_error("Invalid header field size");
+            header.delta = true;
+            header.deltaSize = getInt(field, 8);
+            header.baseSize = getInt(field + 8, 8);
+            header.baseHash.low = getInt(field + 16, 8);
+            header.baseHash.high = getInt(field + 24, 8);
+            break;
+        case kTagShard:
+            if (len != 40) throw std::runtime_error("Invalid header field size");
+            header.sharded = true;
+            std::memcpy(header.shard.fileId, field, 16);
+            header.shard.index = (uint32_t)getInt(field + 16, 4);
+            header.shard.count = (uint32_t)getInt(field + 20, 4);
+            header.shard.offset = getInt(field + 24, 8);
+            header.shard.dataSize = getInt(field + 32, 8);
+            if (header.shard.index >= header.shard.count || header.shard.offset > header.shard.dataSize)
+                throw std::runtime_error("Invalid shard field");
+            break;
+        default:
+            throw std::runtime_error("Unknown header field");
+        }
+    }
+    if (!hasPayloadSize) throw std::runtime_error("Header without payload size");
+    return header;
+}
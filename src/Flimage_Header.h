@@ -0,0 +1,56 @@
+#ifndef FLIMAGE_HEADER_H
+#define FLIMAGE_HEADER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Flimage_Layout.h"
+#include "Flimage_Transform.h"
+#include "Flimage_Codec.h"
+#include "Flimage_Sparse.h"
+#include "Flimage_Crypto.h"
+#include "Flimage_Hash.h"
+#include "Flimage_Shard.h"
+
+// Container metadata, stored in a private ancillary "flIm" chunk in front of the image data.
+// The chunk holds a version byte followed by [u8 tag][u32 length][bytes] records, integers little endian.
+// Readers reject unknown tags: every field changes how the pixels turn back into the file.
+// Encrypted payloads are authenticated together with the complete header chunk data.
+// The content hash covers the decoded file data (for sparse files the extents' bytes, back to back).
+
+extern const char kFlimageChunkType[5];
+
+struct FlimageHeader {
+    std::string name;
+    std::string ext;
+    uint64_t payloadSize = 0;
+    FlimagePixelFormat pixelFormat = FlimagePixelFormat::RGBA8;
+    uint32_t recordStride = 0;  // record size the rows are aligned to, 0 for the square layout
+    FlimageTransform transform;  // applied to the payload before it became pixels
+    bool dedup = false;          // payload is a deduplicated stream (see Flimage_Dedup.h)
+    uint64_t fileSize = 0;       // file size before deduplication, only stored with dedup
+    FlimageCodec codec = FlimageCodec::Deflate;
+    uint64_t unpackedSize = 0;   // payload size before the codec packed it, only stored with a codec
+    bool sparse = false;         // the file holds only these extents of a sparseSize byte file
+    uint64_t sparseSize = 0;
+    std::vector<FlimageExtent> extents;
+    bool encrypted = false;      // ChaCha20-Poly1305, the tag follows the ciphertext in the payload
+    uint32_t kdfIterations = 0;  // PBKDF2-HMAC-SHA256
+    unsigned char salt[kFlimageSaltSize] = {};
+    unsigned char nonce[kFlimageNonceSize] = {};
+    bool hasHash = false;        // files written before the hash existed have none
+    FlimageHash128 contentHash;
+    bool delta = false;          // payload is a patch against a base (see Flimage_Delta.h)
+    uint64_t deltaSize = 0;      // size of the data the patch produces
+    uint64_t baseSize = 0;
+    FlimageHash128 baseHash;     // XXH3-128 of the base data, to refuse the wrong base
+    bool sharded = false;        // the payload is one slice of the file data
+    FlimageShard shard;
+};
+
+std::vector<unsigned char> flimageWriteHeader(const FlimageHeader& header);
+FlimageHeader flimageReadHeader(const unsigned char* data, size_t size);
+
+#endif
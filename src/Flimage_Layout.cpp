@@ -0,0 +1,125 @@
+#include <cmath>
+#include <stdexcept>
+
+#include "Flimage_Layout.h"
+
+static const size_t kStrideSampleSize = 32 * 1024;
+static const size_t kMaxRecordStride = 512;
+static const size_t kMaxRowBytes = 1 << 16;
+static const double kStrideSignificance = 1.25;
+static const double kFundamentalShare = 0.9;
+
+unsigned flimageBytesPerPixel(FlimagePixelFormat format) {
+    switch (format) {
+    case FlimagePixelFormat::Grey8: return 1;
+    case FlimagePixelFormat::RGB8: return 3;
+    case FlimagePixelFormat::RGBA8: return 4;
+    case FlimagePixelFormat::RGBA16: return 8;
+    default: throw std::runtime_error("Invalid pixel format");
+    }
+}
+
+LodePNGColorType flimageColorType(FlimagePixelFormat format) {
+    switch (format) {
+    case FlimagePixelFormat::Grey8: return LCT_GREY;
+    case FlimagePixelFormat::RGB8: return LCT_RGB;
+    case FlimagePixelFormat::RGBA8: return LCT_RGBA;
+    case FlimagePixelFormat::RGBA16: return LCT_RGBA;
+    default: throw std::runtime_error("Invalid pixel format");
+    }
+}
+
+unsigned flimageBitDepth(FlimagePixelFormat format) {
+    return format == FlimagePixelFormat::RGBA16 ? 16 : 8;
+}
+
+const char* flimagePixelFormatName(FlimagePixelFormat format) {
+    switch (format) {
+    case FlimagePixelFormat::Auto: return "auto";
+    case FlimagePixelFormat::Grey8: return "grey8";
+    case FlimagePixelFormat::RGB8: return "rgb8";
+    case FlimagePixelFormat::RGBA8: return "rgba8";
+    case FlimagePixelFormat::RGBA16: return "rgba16";
+    }
+    return "unknown";
+}
+
+bool flimageParsePixelFormat(const std::string& name, FlimagePixelFormat& format) {
+    static const FlimagePixelFormat all[] = {
+        FlimagePixelFormat::Auto, FlimagePixelFormat::Grey8, FlimagePixelFormat::RGB8,
+        FlimagePixelFormat::RGBA8, FlimagePixelFormat::RGBA16,
+    };
+    for (FlimagePixelFormat candidate : all) {
+        if (name == flimagePixelFormatName(candidate)) {
+            format = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+FlimageLayout flimagePlanLayout(size_t payloadSize, FlimagePixelFormat format) {
+    FlimageLayout layout;
+    layout.format = format;
+
+    size_t bytesPerPixel = flimageBytesPerPixel(format);
+    size_t pixelCount = (payloadSize + bytesPerPixel - 1) / bytesPerPixel;
+    if (pixelCount == 0) pixelCount = 1;
+
+    size_t width = (size_t)std::ceil(std::sqrt((double)pixelCount));
+    size_t height = (pixelCount + width - 1) / width;
+    if (width > 0x7FFFFFFFu || height > 0x7FFFFFFFu) throw std::runtime_error("Payload too large for one image");
+
+    layout.width = (unsigned)width;
+    layout.height = (unsigned)height;
+    return layout;
+}
+
+size_t flimageDetectRecordStride(const std::vector<unsigned char>& payload) {
+    if (payload.size() < kMaxRecordStride * 4) return 0;
+
+    size_t sampleSize = payload.size() < kStrideSampleSize ? payload.size() : kStrideSampleSize;
+    const unsigned char* sample = payload.data() + (payload.size() - sampleSize) / 2;
+
+    std::vector<size_t> matches(kMaxRecordStride + 1, 0);
+    for (size_t lag = 1; lag <= kMaxRecordStride; lag++) {
+        size_t count = 0;
+        for (size_t i = lag; i < sampleSize; i++) count += sample[i] == sample[i - lag];
+        matches[lag] = count;
+    }
+
+    size_t best = 1;
+    double mean = 0.0;
+    for (size_t lag = 1; lag <= kMaxRecordStride; lag++) {
+        mean += (double)matches[lag] / kMaxRecordStride;
+        if (matches[lag] > matches[best]) best = lag;
+    }
+    if (matches[best] < mean * kStrideSignificance) return 0;
+
+    // Multiples of the record size match about as well as the record size itself: take the smallest divisor
+    // of the best lag that still scores close to it.
+    for (size_t lag = 1; lag < best; lag++) {
+        if (best % lag == 0 && matches[lag] >= matches[best] * kFundamentalShare) return lag == 1 ? 0 : lag;
+    }
+    return best == 1 ? 0 : best;
+}
+
+FlimageLayout flimagePlanStrideLayout(size_t payloadSize, FlimagePixelFormat format, size_t recordStride) {
+    FlimageLayout layout;
+    layout.format = format;
+    if (recordStride == 0) return layout;
+
+    size_t bytesPerPixel = flimageBytesPerPixel(format);
+    size_t rowBytes = recordStride;
+    while (rowBytes % bytesPerPixel != 0) rowBytes += recordStride;
+    if (rowBytes > kMaxRowBytes) return layout;
+
+    size_t width = rowBytes / bytesPerPixel;
+    size_t height = (payloadSize + rowBytes - 1) / rowBytes;
+    if (height == 0) height = 1;
+    if (height > 0x7FFFFFFFu) return layout;
+
+    layout.width = (unsigned)width;
+    layout.height = (unsigned)height;
+    return layout;
+}
@@ -0,0 +1,47 @@
+#ifndef FLIMAGE_LAYOUT_H
+#define FLIMAGE_LAYOUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+
+// How payload bytes are laid out as pixels. The pixel size is also the distance the PNG Sub/Avg/Paeth
+// filters predict from, so it decides which byte of the previous "record" each byte is delta coded against.
+
+enum class FlimagePixelFormat : uint8_t {
+    Auto = 0,   // encoder option only, never stored
+    Grey8 = 1,
+    RGB8 = 2,
+    RGBA8 = 3,
+    RGBA16 = 4,
+};
+
+struct FlimageLayout {
+    FlimagePixelFormat format = FlimagePixelFormat::RGBA8;
+    unsigned width = 0;
+    unsigned height = 0;
+};
+
+unsigned flimageBytesPerPixel(FlimagePixelFormat format);
+LodePNGColorType flimageColorType(FlimagePixelFormat format);
+unsigned flimageBitDepth(FlimagePixelFormat format);
+
+const char* flimagePixelFormatName(FlimagePixelFormat format);
+bool flimageParsePixelFormat(const std::string& name, FlimagePixelFormat& format);
+
+// Nearly square image that holds payloadSize bytes in the given format.
+FlimageLayout flimagePlanLayout(size_t payloadSize, FlimagePixelFormat format);
+
+// Dominant record size of the payload in bytes, found by autocorrelation on a sample: the smallest lag at
+// which bytes repeat clearly more often than at other lags. 0 when the payload shows no record structure.
+size_t flimageDetectRecordStride(const std::vector<unsigned char>& payload);
+
+// Image whose rows hold exactly one record (or the fewest records that fill whole pixels), so the Up filter
+// predicts every byte from the same field of the previous record. Returns a layout with width 0 when the
+// stride doesn't give a usable image.
+FlimageLayout flimagePlanStrideLayout(size_t payloadSize, FlimagePixelFormat format, size_t recordStride);
+
+#endif
@@ -0,0 +1,100 @@
+#include <atomic>
+
+#include "Flimage_Pace.h"
+#include "Flimage_Stats.h"
+
+// Fastest first. The relative speeds are rounded medians over the payloads of text, an executable, float and
+// integer tables as laid out by the encoder. The last level is the unpaced encoder's own settings, so a deadline
+// that leaves time to spare gives the same output as none. The one before drops lazy matching, and the fastest
+// also the filter search and half the window.
+const FlimagePaceLevel kFlimagePaceLevel[kFlimagePaceLevels] = {
+    {"zero", LFS_ZERO, 1024, 64, 0, 1.5},
+    {"minsum", LFS_MINSUM, 2048, 128, 0, 1.1},
+    {"default", LFS_MINSUM, 2048, 128, 1, 1.0},
+};
+
+// Weight of the latest band in the speed estimate: the data changes along the image, so old bands fade fast.
+static const double kPaceSmoothing = 0.5;
+
+static std::atomic<uint64_t> paceEncodes(0);
+
+static const char* filterName(LodePNGFilterStrategy strategy) {
+    switch (strategy) {
+    case LFS_ZERO: return "zero";
+    case LFS_SAMPLED: return "sampled";
+    case LFS_ENTROPY: return "entropy";
+    case LFS_MINSUM: return "minsum";
+    case LFS_BRUTE_FORCE: return "brute_force";
+    default: return "other";
+    }
+}
+
+void FlimagePace::install(LodePNGEncoderSettings& settings) {
+    settings.tune_band = tuneBand;
+    settings.tune_band_context = this;
+    encode_ = paceEncodes.fetch_add(1, std::memory_order_relaxed);
+}
+
+void FlimagePace::tuneBand(LodePNGEncoderSettings* band, size_t done, size_t total, size_t outsize,
+                           const LodePNGEncoderSettings* settings) {
+    static_cast<FlimagePace*>(const_cast<void*>(settings->tune_band_context))->tune(*band, done, total, outsize);
+}
+
+void FlimagePace::tune(LodePNGEncoderSettings& band, size_t done, size_t total, size_t outsize) {
+    auto now = std::chrono::steady_clock::now();
+    double secondsLeft = std::chrono::duration<double>(deadline_ - now).count();
+
+    // The band that just finished: its speed rescales the estimate of every level.
+    if (done > bandDone_) {
+        const FlimagePaceLevel& level = kFlimagePaceLevel[level_];
+        double seconds = std::chrono::duration<double>(now - bandStart_).count();
+        double measured = seconds > 0 ? (done - bandDone_) / seconds / level.relativeSpeed : 0;
+        if (measured > 0) scale_ = scale_ > 0 ? scale_ + kPaceSmoothing * (measured - scale_) : measured;
+        stats_.blocks++;
+        stats_.levelBlocks[level_]++;
+        stats_.seconds += seconds;
+
+        FlimagePacedBlock block;
+        block.encode = encode_;
+        block.offset = bandDone_;
+        block.bytesIn = done - bandDone_;
+        block.bytesOut = outsize - bandOutsize_;
+        block.level = level.name;
+        block.filter = filterName(band.filter_strategy);
+        block.windowsize = band.zlibsettings.windowsize;
+        block.nicematch = band.zlibsettings.nicematch;
+        block.lazymatching = band.zlibsettings.lazymatching != 0;
+        block.seconds = seconds;
+        block.neededMegabytesPerSecond = neededSpeed_ / 1e6;
+        flimageStatsPacedBlock(block);
+    }
+    if (done >= total) {
+        stats_.secondsToDeadline = secondsLeft;
+        return;
+    }
+
+    // Past the deadline every band runs at the fastest level.
+    neededSpeed_ = secondsLeft > 0 ? (total - done) / secondsLeft : 0;
+    if (secondsLeft <= 0) {
+        level_ = 0;
+    } else if (scale_ > 0) {
+        level_ = 0;
+        for (size_t i = kFlimagePaceLevels; i-- > 1;) {
+            if (scale_ * kFlimagePaceLevel[i].relativeSpeed >= neededSpeed_ * kFlimagePaceMargin) {
+                level_ = i;
+                break;
+            }
+        }
+    } else {
+        level_ = kFlimagePaceFirstLevel;
+    }
+
+    const FlimagePaceLevel& level = kFlimagePaceLevel[level_];
+    band.filter_strategy = level.filter;
+    band.zlibsettings.windowsize = level.windowsize;
+    band.zlibsettings.nicematch = level.nicematch;
+    band.zlibsettings.lazymatching = level.lazymatching;
+    bandDone_ = done;
+    bandOutsize_ = outsize;
+    bandStart_ = std::chrono::steady_clock::now();
+}
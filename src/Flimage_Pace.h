@@ -0,0 +1,73 @@
+#ifndef FLIMAGE_PACE_H
+#define FLIMAGE_PACE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "lodepng.h"
+
+// Paces a PNG encode to a deadline: before every band of the banded IDAT encoding (LodePNGEncoderSettings.banded)
+// the controller picks the densest level that its speed estimate says still finishes on time. The estimate is
+// one scale factor on the levels' relative speeds, updated from the measured speed of every band, so a level
+// that hasn't run yet is judged by how fast the data went through the others.
+
+struct FlimagePaceLevel {
+    const char* name;
+    LodePNGFilterStrategy filter;
+    unsigned windowsize;
+    unsigned nicematch;
+    unsigned lazymatching;
+    double relativeSpeed;  // to the densest level
+};
+
+static const size_t kFlimagePaceLevels = 3;
+// The level of the first band, before there is a speed to go by: the densest, which is the unpaced encode.
+static const size_t kFlimagePaceFirstLevel = kFlimagePaceLevels - 1;
+extern const FlimagePaceLevel kFlimagePaceLevel[kFlimagePaceLevels];
+
+// A band gets the densest level estimated to be this much faster than needed.
+static const double kFlimagePaceMargin = 1.1;
+
+struct FlimagePaceOptions {
+    // Both count from the end of the transform and layout trials, which the pace can't speed up.
+    double megabytesPerSecond = 0;  // target speed of every image encode, per core
+    double seconds = 0;             // or time budget of every image encode; a sharded file has it for every shard
+
+    bool enabled() const { return megabytesPerSecond > 0 || seconds > 0; }
+};
+
+struct FlimagePaceStats {
+    size_t blocks = 0;
+    size_t levelBlocks[kFlimagePaceLevels] = {};
+    double seconds = 0;            // of the paced bands
+    double secondsToDeadline = 0;  // when they were done, negative when late
+};
+
+class FlimagePace {
+public:
+    explicit FlimagePace(std::chrono::steady_clock::time_point deadline) : deadline_(deadline) {}
+
+    // Hooks the controller into the encoder; the pace must outlive the encode. Only the banded IDAT encoding
+    // calls it, so it has no effect on interlaced images.
+    void install(LodePNGEncoderSettings& settings);
+
+    const FlimagePaceStats& stats() const { return stats_; }
+
+private:
+    void tune(LodePNGEncoderSettings& band, size_t done, size_t total, size_t outsize);
+    static void tuneBand(LodePNGEncoderSettings* band, size_t done, size_t total, size_t outsize,
+                         const LodePNGEncoderSettings* settings);
+
+    std::chrono::steady_clock::time_point deadline_;
+    uint64_t encode_ = 0;  // numbers the paced encodes of the program in the stats
+    std::chrono::steady_clock::time_point bandStart_;
+    size_t bandDone_ = 0;
+    size_t bandOutsize_ = 0;
+    size_t level_ = kFlimagePaceFirstLevel;
+    double neededSpeed_ = 0;  // bytes per second the band needed to finish on time, 0 when late
+    double scale_ = 0;        // bytes per second of relative speed 1, 0 until a band was measured
+    FlimagePaceStats stats_;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Flimage_Parallel.h"
+#include "Flimage_Stats.h"
+
+size_t flimageThreadCount() {
+    unsigned count = std::thread::hardware_concurrency();
+    return count ? count : 1;
+}
+
+void flimageParallelFor(size_t count, const std::function<void(size_t)>& job, size_t threads) {
+    if (threads == 0) threads = flimageThreadCount();
+    if (threads > count) threads = count;
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto worker = [&]() {
+        for (size_t i = next++; i < count && !failed; i = next++) {
+            try {
+                job(i);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::string phasePath = flimagePhasePath();
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++) {
+        pool.emplace_back([&]() {
+            flimagePhaseAdopt(phasePath);
+            worker();
+        });
+    }
+    worker();
+    for (std::thread& thread : pool) thread.join();
+    if (error) std::rethrow_exception(error);
+}
+
+void FlimageMemoryBudget::acquire(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_.wait(lock, [&]() { return used_ == 0 || bytes <= budget_ - std::min(used_, budget_); });
+    used_ += bytes;
+}
+
+void FlimageMemoryBudget::release(uint64_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= bytes;
+    }
+    released_.notify_all();
+}
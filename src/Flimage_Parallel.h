@@ -0,0 +1,51 @@
+#ifndef FLIMAGE_PARALLEL_H
+#define FLIMAGE_PARALLEL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// Hardware threads, at least 1.
+size_t flimageThreadCount();
+
+// Runs job(0) .. job(count - 1) on up to `threads` threads (0: one per core), the calling thread included.
+// Jobs are handed out in order as threads become free. If a job throws, no new jobs start and the first
+// exception is rethrown once all threads have finished. Threads that call into lodepng need their own
+// FlimageArenaScope and compression context.
+void flimageParallelFor(size_t count, const std::function<void(size_t)>& job, size_t threads = 0);
+
+// Memory shared by the jobs of a parallel loop whose needs differ: a job waits in acquire() until its estimate
+// fits next to those of the running jobs. A job runs anyway when nothing else holds memory, so one larger than
+// the whole budget runs alone instead of never.
+class FlimageMemoryBudget {
+public:
+    explicit FlimageMemoryBudget(uint64_t bytes) : budget_(bytes) {}
+
+    void acquire(uint64_t bytes);
+    void release(uint64_t bytes);
+
+private:
+    std::mutex mutex_;
+    std::condition_variable released_;
+    uint64_t budget_;
+    uint64_t used_ = 0;
+};
+
+// Holds memory of the budget for the enclosing scope.
+class FlimageMemoryReservation {
+public:
+    FlimageMemoryReservation(FlimageMemoryBudget& budget, uint64_t bytes) : budget_(budget), bytes_(bytes) {
+        budget_.acquire(bytes_);
+    }
+    ~FlimageMemoryReservation() { budget_.release(bytes_); }
+    FlimageMemoryReservation(const FlimageMemoryReservation&) = delete;
+    FlimageMemoryReservation& operator=(const FlimageMemoryReservation&) = delete;
+
+private:
+    FlimageMemoryBudget& budget_;
+    uint64_t bytes_;
+};
+
+#endif
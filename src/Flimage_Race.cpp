@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+
+#include "Flimage_Race.h"
+#include "Flimage_Parallel.h"
+#include "Flimage_Stats.h"
+
+struct RaceSample {
+    double fraction;  // of the input compressed
+    uint64_t outsize;
+};
+
+struct RaceEntry {
+    std::vector<RaceSample> samples;  // one per deflate block, in order
+    bool finished = false;
+    bool cancelled = false;
+};
+
+class FlimageRace {
+public:
+    explicit FlimageRace(size_t count) : entries_(count) {}
+
+    bool report(size_t candidate, size_t done, size_t total, size_t outsize);
+    bool cancelled(size_t candidate);
+
+private:
+    std::mutex mutex_;
+    std::vector<RaceEntry> entries_;
+};
+
+// Stream size of the entry at the fraction of its input, interpolated between its blocks; negative when it
+// hasn't got that far yet.
+static double outsizeAt(const RaceEntry& entry, double fraction) {
+    double previousFraction = 0, previousSize = 0;
+    for (const RaceSample& sample : entry.samples) {
+        if (sample.fraction >= fraction) {
+            double span = sample.fraction - previousFraction;
+            if (span <= 0) return (double)sample.outsize;
+            return previousSize + (sample.outsize - previousSize) * (fraction - previousFraction) / span;
+        }
+        previousFraction = sample.fraction;
+        previousSize = (double)sample.outsize;
+    }
+    return -1;
+}
+
+// The last block always completes: a finished stream is judged by the size of its output.
+bool FlimageRace::report(size_t candidate, size_t done, size_t total, size_t outsize) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RaceEntry& entry = entries_[candidate];
+    double fraction = total ? (double)done / total : 1;
+    entry.samples.push_back({fraction, outsize});
+    if (done >= total) {
+        entry.finished = true;
+        return false;
+    }
+    for (size_t i = 0; i < entries_.size(); i++) {
+        const RaceEntry& other = entries_[i];
+        if (i == candidate || other.cancelled) continue;
+        double otherSize = outsizeAt(other, fraction);
+        if (otherSize < 0) continue;
+        bool lost = other.finished && outsize > other.samples.back().outsize;
+        bool losing = entry.samples.size() >= kFlimageRaceMinBlocks && outsize > otherSize * kFlimageRaceCancelMargin;
+        if (lost || losing) {
+            entry.cancelled = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FlimageRace::cancelled(size_t candidate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_[candidate].cancelled;
+}
+
+static unsigned raceProgress(size_t done, size_t total, size_t outsize, const LodePNGCompressSettings* settings) {
+    const FlimageRaceWatch* watch = static_cast<const FlimageRaceWatch*>(settings->progress_context);
+    return watch->report(done, total, outsize) ? 1 : 0;
+}
+
+void FlimageRaceWatch::watch(LodePNGCompressSettings& settings) const {
+    settings.progress = raceProgress;
+    settings.progress_context = this;
+}
+
+bool FlimageRaceWatch::report(size_t done, size_t total, size_t outsize) const {
+    return race_.report(candidate_, done, total, outsize);
+}
+
+std::vector<unsigned char> flimageRace(const std::vector<std::string>& names, uint64_t candidateMemory,
+                                       const FlimageRaceOptions& options, const FlimageRaceEncode& encode,
+                                       FlimageRaceStats* stats) {
+    auto start = std::chrono::steady_clock::now();
+    size_t count = names.size();
+    if (count == 0) throw std::runtime_error("No race candidates");
+    size_t threads = options.threads ? options.threads : flimageThreadCount();
+    uint64_t fit = candidateMemory ? options.memoryBudget / candidateMemory : count;
+    threads = std::max<size_t>(1, std::min<uint64_t>(std::min(threads, count), fit));
+
+    // Only the smallest output so far is kept.
+    FlimageRace race(count);
+    std::mutex bestMutex;
+    std::vector<unsigned char> best;
+    size_t bestIndex = count;
+    uint64_t defaultSize = 0;
+    size_t cancelled = 0;
+    flimageParallelFor(count, [&](size_t index) {
+        FlimagePhase phase("candidate", names[index].c_str());
+        FlimageRaceWatch watch(race, index);
+        std::vector<unsigned char> output;
+        try {
+            output = encode(index, watch);
+        }
+        catch (const std::exception&) {
+            if (!race.cancelled(index)) throw;
+            std::lock_guard<std::mutex> lock(bestMutex);
+            cancelled++;
+            return;
+        }
+        phase.setBytes(0, output.size());
+        std::lock_guard<std::mutex> lock(bestMutex);
+        if (index == 0) defaultSize = output.size();
+        if (bestIndex == count || output.size() < best.size() || (output.size() == best.size() && index < bestIndex)) {
+            best.swap(output);
+            bestIndex = index;
+        }
+    }, threads);
+    if (bestIndex == count) throw std::runtime_error("Every race candidate was cancelled");
+
+    if (stats) {
+        stats->candidates = count;
+        stats->threads = threads;
+        stats->cancelled = cancelled;
+        stats->winner = names[bestIndex];
+        stats->size = best.size();
+        stats->defaultSize = defaultSize;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return best;
+}
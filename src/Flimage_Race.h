@@ -0,0 +1,68 @@
+#ifndef FLIMAGE_RACE_H
+#define FLIMAGE_RACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+
+// Races several encodings of the same data and keeps the smallest, trading cores for size without more wall
+// time. The candidates run at once on a thread pool, as many as the core and memory budgets allow. Every
+// candidate reports the size of its deflate stream after each block, and one whose stream is clearly larger than
+// another's at the same point of the input is cancelled: after kFlimageRaceMinBlocks blocks when it is more than
+// kFlimageRaceCancelMargin larger, at once when it is already larger than a finished one.
+
+static const size_t kFlimageRaceMinBlocks = 2;
+static const double kFlimageRaceCancelMargin = 1.10;
+
+struct FlimageRaceOptions {
+    bool enabled = false;
+    size_t threads = 0;                          // candidates running at once at most, 0: one per core
+    uint64_t memoryBudget = (uint64_t)1 << 30;  // bytes the running candidates may use together
+};
+
+struct FlimageRaceStats {
+    size_t candidates = 0;
+    size_t threads = 0;  // candidates that ran at once
+    size_t cancelled = 0;
+    std::string winner;
+    uint64_t size = 0;         // of the winner
+    uint64_t defaultSize = 0;  // of the first candidate, 0 when it was cancelled
+    double seconds = 0;
+};
+
+class FlimageRace;
+
+// Handed to a candidate's encode: ties the candidate's deflate to the race.
+class FlimageRaceWatch {
+public:
+    FlimageRaceWatch(FlimageRace& race, size_t candidate) : race_(race), candidate_(candidate) {}
+
+    // Installs the progress function of these settings; the watch must outlive the encode.
+    void watch(LodePNGCompressSettings& settings) const;
+
+    // Records that the candidate's deflate stream is outsize bytes after done of total input bytes. Returns
+    // true when the candidate is cancelled.
+    bool report(size_t done, size_t total, size_t outsize) const;
+
+private:
+    FlimageRace& race_;
+    size_t candidate_;
+};
+
+// Encodes candidate `index` with its watch installed and returns the output. A cancelled candidate fails with
+// lodepng error 123; the exception it throws for that is caught by the race.
+using FlimageRaceEncode = std::function<std::vector<unsigned char>(size_t index, const FlimageRaceWatch& watch)>;
+
+// Runs the candidates, the first of which is the default, and returns the smallest output; ties go to the
+// earlier candidate. candidateMemory is the estimated peak memory of one candidate: at least one runs whatever
+// the budget. Threads that call into lodepng need their own FlimageArenaScope and compression context. Throws
+// the first error of a candidate that wasn't cancelled.
+std::vector<unsigned char> flimageRace(const std::vector<std::string>& names, uint64_t candidateMemory,
+                                       const FlimageRaceOptions& options, const FlimageRaceEncode& encode,
+                                       FlimageRaceStats* stats = nullptr);
+
+#endif
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "Flimage_Shard.h"
+#include "Flimage_Arena.h"
+#include "Flimage_Container.h"
+#include "Flimage_Crypto.h"
+#include "Flimage_Parallel.h"
+#include "Flimage_Stats.h"
+
+size_t flimageShardCount(uint64_t dataSize, uint64_t shardSize) {
+    if (shardSize == 0 || dataSize <= shardSize) return 1;
+    return (size_t)((dataSize + shardSize - 1) / shardSize);
+}
+
+uint64_t flimageShardEncodeMemory(uint64_t sliceSize) {
+    return 5 * sliceSize + ((uint64_t)2 << 20);
+}
+
+void flimageEncodeShards(const FlimageFile& file, const FlimageEncodeOptions& options, uint64_t shardSize,
+                         const std::function<void(const FlimageShard&, const std::vector<unsigned char>&)>& sink,
+                         uint64_t memoryBudget) {
+    size_t count = flimageShardCount(file.data.size(), shardSize);
+    unsigned char fileId[16];
+    flimageRandomBytes(fileId, sizeof(fileId));
+
+    size_t threads = 1;
+    if (!options.race.enabled) {
+        uint64_t shardMemory = flimageShardEncodeMemory((file.data.size() + count - 1) / count);
+        uint64_t fit = memoryBudget / shardMemory;
+        threads = (size_t)std::max<uint64_t>(1, std::min<uint64_t>(std::min(flimageThreadCount(), count), fit));
+    }
+
+    // Equal slices, so the last shard isn't a small leftover that finishes long before the others.
+    flimageParallelFor(count, [&](size_t index) {
+        std::string label = std::to_string(index + 1) + " of " + std::to_string(count);
+        FlimagePhase phase("shard", label.c_str());
+        FlimageArenaScope arena;
+        lodepng::CompressContext context;
+
+        FlimageFile slice;
+        slice.name = file.name;
+        slice.ext = file.ext;
+        slice.sparse = file.sparse;
+        slice.size = file.size;
+        slice.extents = file.extents;
+        slice.sharded = true;
+        FlimageShard& shard = slice.shard;
+        std::copy(fileId, fileId + sizeof(fileId), shard.fileId);
+        shard.index = (uint32_t)index;
+        shard.count = (uint32_t)count;
+        shard.offset = file.data.size() * index / count;
+        shard.dataSize = file.data.size();
+        size_t end = file.data.size() * (index + 1) / count;
+
+        sink(shard, flimageEncode(slice, file.data.data() + shard.offset, end - (size_t)shard.offset, options,
+                                  context));
+    }, threads);
+}
+
+static std::string idString(const unsigned char* fileId) {
+    return std::string(reinterpret_cast<const char*>(fileId), 16);
+}
+
+void FlimageShardAssembler::add(const FlimageFile& file, const std::string& outPath) {
+    const FlimageShard& shard = file.shard;
+    FlimageOutputFile* output = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto inserted = outputs_.emplace(idString(shard.fileId), Output());
+        Output& entry = inserted.first->second;
+        if (inserted.second) {
+            entry.path = outPath;
+            entry.first = shard;
+            entry.seen.assign(shard.count, 0);
+            entry.offsets.assign(shard.count, 0);
+            entry.sizes.assign(shard.count, 0);
+            std::vector<FlimageExtent> extents = file.extents;
+            uint64_t size = file.size;
+            if (!file.sparse) {
+                size = shard.dataSize;
+                extents.clear();
+                if (size) extents.push_back({0, size});
+            }
+            entry.file.reset(new FlimageOutputFile(outPath, size, extents));
+        }
+        if (shard.count != entry.first.count || shard.dataSize != entry.first.dataSize || entry.path != outPath)
+            throw std::runtime_error("Shard doesn't belong with the others of its file");
+        if (entry.seen[shard.index]) throw std::runtime_error("Duplicate shard");
+        entry.seen[shard.index] = 1;
+        entry.offsets[shard.index] = shard.offset;
+        entry.sizes[shard.index] = file.data.size();
+        output = entry.file.get();
+    }
+    output->write(shard.offset, file.data.data(), file.data.size());
+}
+
+// Empty when the shards cover the file data exactly.
+static std::string incompleteReason(const std::vector<char>& seen, const std::vector<uint64_t>& offsets,
+                                    const std::vector<uint64_t>& sizes, uint64_t dataSize) {
+    uint64_t end = 0;
+    for (size_t i = 0; i < seen.size(); i++) {
+        if (!seen[i]) return "shard " + std::to_string(i) + " of " + std::to_string(seen.size()) + " is missing";
+        if (offsets[i] != end) return "shards don't line up";
+        end += sizes[i];
+    }
+    return end != dataSize ? "shards don't line up" : "";
+}
+
+// Complete files are committed even when another one fails; the incomplete ones are removed with their outputs.
+void FlimageShardAssembler::finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string error;
+    for (auto& item : outputs_) {
+        Output& entry = item.second;
+        std::string reason = incompleteReason(entry.seen, entry.offsets, entry.sizes, entry.first.dataSize);
+        if (reason.empty()) entry.file->commit();
+        else if (error.empty()) error = entry.path + ": " + reason;
+    }
+    outputs_.clear();
+    if (!error.empty()) throw std::runtime_error(error);
+}
@@ -0,0 +1,77 @@
+#ifndef FLIMAGE_SHARD_H
+#define FLIMAGE_SHARD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Flimage_Sparse.h"
+
+// Large files are split into shards: consecutive slices of the file data, each encoded into a PNG of its own.
+// A shard is a complete Flimage PNG with its own content hash; its header adds the file ID shared by all
+// shards of the file, its index and the shard count, and where its slice lies in the file data. Every shard
+// carries the full name and sparse extents, so any of them can create the output.
+
+struct FlimageFile;
+struct FlimageEncodeOptions;
+
+struct FlimageShard {
+    unsigned char fileId[16] = {};
+    uint32_t index = 0;
+    uint32_t count = 0;
+    uint64_t offset = 0;    // start of this shard's slice in the file data
+    uint64_t dataSize = 0;  // file data size of all shards together
+};
+
+// Shards above one PNG's worth of data; also keeps every IDAT far below the 2^31 byte chunk limit.
+static const uint64_t kFlimageDefaultShardSize = (uint64_t)1 << 30;
+// Bytes the shards being encoded or decoded at once may use together.
+static const uint64_t kFlimageDefaultShardMemory = (uint64_t)4 << 30;
+
+// Number of shards the file data is split into for the given maximum shard size, at least 1.
+size_t flimageShardCount(uint64_t dataSize, uint64_t shardSize);
+
+// Encodes the shards in parallel, as many at once as there are cores and as fit the memory budget, or one after
+// the other when the options race, which keeps the race within its core and memory budget. Each shard is encoded
+// from its slice of file.data where it lies. The sink receives every finished PNG, from the worker threads and
+// in no particular order. Throws std::runtime_error on failure.
+void flimageEncodeShards(const FlimageFile& file, const FlimageEncodeOptions& options, uint64_t shardSize,
+                         const std::function<void(const FlimageShard&, const std::vector<unsigned char>&)>& sink,
+                         uint64_t memoryBudget = kFlimageDefaultShardMemory);
+
+// Estimated peak memory of encoding a shard of the given size: the payload, the dedup or delta stream, the padded
+// pixels, the filtered scanlines and the PNG each hold about a slice at once, plus the compression context.
+uint64_t flimageShardEncodeMemory(uint64_t sliceSize);
+
+// Puts decoded shards back together, from any number of threads and in any order. The first shard of a file
+// creates a temporary output at full size next to the real one; every shard is written to its place as soon as
+// it arrives, and finish() moves the file to its name once all shards are in. An incomplete file never
+// replaces one already there.
+class FlimageShardAssembler {
+public:
+    // Throws std::runtime_error when the shard doesn't fit the others of its file.
+    void add(const FlimageFile& file, const std::string& outPath);
+
+    // Throws std::runtime_error when a file is missing shards.
+    void finish();
+
+private:
+    struct Output {
+        std::string path;
+        std::unique_ptr<FlimageOutputFile> file;
+        FlimageShard first;
+        std::vector<char> seen;
+        std::vector<uint64_t> offsets;
+        std::vector<uint64_t> sizes;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, Output> outputs_;  // by file ID
+};
+
+#endif
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+
+#include "Flimage_Sparse.h"
+#include "Flimage_Crypto.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FLIMAGE_POSIX_IO
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const size_t kZeroBlock = 64 * 1024;
+static const size_t kReadBuffer = 16 * kZeroBlock;
+
+static bool isZero(const unsigned char* data, size_t size) {
+    size_t i = 0;
+    uint64_t acc = 0;
+    for (; i + 32 <= size; i += 32) {
+        uint64_t words[4];
+        std::memcpy(words, data + i, 32);
+        acc |= words[0] | words[1] | words[2] | words[3];
+        if (acc) return false;
+    }
+    for (; i < size; i++) acc |= data[i];
+    return !acc;
+}
+
+// Appends a region of the file block by block, leaving out zero blocks aligned to kZeroBlock.
+class ExtentBuilder {
+public:
+    explicit ExtentBuilder(FlimageSparseData& file) : file_(file) {}
+
+    void add(uint64_t offset, const unsigned char* data, size_t size) {
+        while (size) {
+            size_t block = kZeroBlock - (size_t)(offset % kZeroBlock);
+            if (block > size) block = size;
+            if (block != kZeroBlock || !isZero(data, block)) {
+                std::vector<FlimageExtent>& extents = file_.extents;
+                if (!extents.empty() && extents.back().offset + extents.back().length == offset)
+                    extents.back().length += block;
+                else
+                    extents.push_back({offset, block});
+                file_.data.insert(file_.data.end(), data, data + block);
+            }
+            offset += block;
+            data += block;
+            size -= block;
+        }
+    }
+
+private:
+    FlimageSparseData& file_;
+};
+
+#ifdef FLIMAGE_POSIX_IO
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd) : fd_(fd) {}
+    ~FileDescriptor() { if (fd_ >= 0) close(fd_); }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    int get() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+static void readRegion(int fd, uint64_t offset, uint64_t length, ExtentBuilder& builder) {
+    std::vector<unsigned char> buffer(kReadBuffer);
+    while (length) {
+        size_t want = length < buffer.size() ? (size_t)length : buffer.size();
+        ssize_t got = pread(fd, buffer.data(), want, (off_t)offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) throw std::runtime_error("Failed to read file");
+        builder.add(offset, buffer.data(), (size_t)got);
+        offset += (uint64_t)got;
+        length -= (uint64_t)got;
+    }
+}
+
+FlimageSparseData flimageReadSparseFile(const std::string& path) {
+    FileDescriptor fd(open(path.c_str(), O_RDONLY));
+    if (fd.get() < 0) throw std::runtime_error("Failed to open file");
+    struct stat st;
+    if (fstat(fd.get(), &st) != 0) throw std::runtime_error("Failed to read file");
+
+    FlimageSparseData file;
+    file.size = (uint64_t)st.st_size;
+    ExtentBuilder builder(file);
+    uint64_t offset = 0;
+    while (offset < file.size) {
+        uint64_t dataStart = offset, dataEnd = file.size;
+#ifdef SEEK_DATA
+        off_t found = lseek(fd.get(), (off_t)offset, SEEK_DATA);
+        if (found < 0 && errno == ENXIO) break;  // only a hole is left
+        if (found >= 0) {
+            dataStart = (uint64_t)found;
+            off_t hole = lseek(fd.get(), found, SEEK_HOLE);
+            if (hole >= 0) dataEnd = (uint64_t)hole;
+        }
+        // Any other error: the file system can't report holes, so everything counts as data.
+#endif
+        readRegion(fd.get(), dataStart, dataEnd - dataStart, builder);
+        offset = dataEnd;
+    }
+    return file;
+}
+#else
+FlimageSparseData flimageReadSparseFile(const std::string& path) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open()) throw std::runtime_error("Failed to open file");
+
+    FlimageSparseData file;
+    ExtentBuilder builder(file);
+    std::vector<unsigned char> buffer(kReadBuffer);
+    while (ifs) {
+        ifs.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        size_t got = (size_t)ifs.gcount();
+        builder.add(file.size, buffer.data(), got);
+        file.size += got;
+    }
+    if (!ifs.eof()) throw std::runtime_error("Failed to read file");
+    return file;
+}
+#endif
+
+#ifdef FLIMAGE_POSIX_IO
+struct FlimageOutputFile::Handle {
+    FileDescriptor fd;
+    explicit Handle(int descriptor) : fd(descriptor) {}
+};
+
+FlimageOutputFile::FlimageOutputFile(const std::string& path, uint64_t size, const std::vector<FlimageExtent>& extents)
+    : path_(path), tempPath_(flimageTempPath(path)), extents_(extents) {
+    handle_.reset(new Handle(open(tempPath_.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666)));
+    if (handle_->fd.get() < 0) throw std::runtime_error("Failed to write file");
+    if (ftruncate(handle_->fd.get(), (off_t)size) != 0) {
+        handle_.reset();
+        std::error_code ec;
+        std::filesystem::remove(tempPath_, ec);
+        throw std::runtime_error("Failed to write file");
+    }
+    for (const FlimageExtent& extent : extents_) {
+        dataStarts_.push_back(dataSize_);
+        dataSize_ += extent.length;
+    }
+}
+
+void FlimageOutputFile::writeAt(uint64_t offset, const unsigned char* data, size_t size) {
+    while (size) {
+        ssize_t written = pwrite(handle_->fd.get(), data, size < kReadBuffer ? size : kReadBuffer, (off_t)offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) throw std::runtime_error("Failed to write file");
+        data += written;
+        offset += (uint64_t)written;
+        size -= (size_t)written;
+    }
+}
+#else
+struct FlimageOutputFile::Handle {
+    std::fstream stream;
+    std::mutex mutex;
+};
+
+FlimageOutputFile::FlimageOutputFile(const std::string& path, uint64_t size, const std::vector<FlimageExtent>& extents)
+    : path_(path), tempPath_(flimageTempPath(path)), handle_(new Handle), extents_(extents) {
+    std::fstream& stream = handle_->stream;
+    stream.open(tempPath_, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!stream.is_open()) throw std::runtime_error("Failed to write file");
+    std::vector<char> zeros(kReadBuffer, 0);
+    for (uint64_t offset = 0; offset < size; offset += kReadBuffer)
+        stream.write(zeros.data(), (std::streamsize)(size - offset < kReadBuffer ? size - offset : kReadBuffer));
+    if (!stream) {
+        handle_.reset();
+        std::error_code ec;
+        std::filesystem::remove(tempPath_, ec);
+        throw std::runtime_error("Failed to write file");
+    }
+    for (const FlimageExtent& extent : extents_) {
+        dataStarts_.push_back(dataSize_);
+        dataSize_ += extent.length;
+    }
+}
+
+void FlimageOutputFile::writeAt(uint64_t offset, const unsigned char* data, size_t size) {
+    std::lock_guard<std::mutex> lock(handle_->mutex);
+    handle_->stream.seekp((std::streamoff)offset);
+    handle_->stream.write(reinterpret_cast<const char*>(data), (std::streamsize)size);
+    if (!handle_->stream) throw std::runtime_error("Failed to write file");
+}
+#endif
+
+FlimageOutputFile::~FlimageOutputFile() {
+    if (!handle_) return;
+    handle_.reset();
+    std::error_code ec;
+    std::filesystem::remove(tempPath_, ec);
+}
+
+// The handle is closed first: a file still open can't be renamed everywhere.
+void FlimageOutputFile::commit() {
+    if (!handle_) throw std::runtime_error("Output file already committed");
+    handle_.reset();
+    std::error_code ec;
+    std::filesystem::rename(tempPath_, path_, ec);
+    if (ec) {
+        std::filesystem::remove(tempPath_, ec);
+        throw std::runtime_error("Failed to write file");
+    }
+}
+
+void FlimageOutputFile::write(uint64_t dataOffset, const unsigned char* data, size_t size) {
+    if (dataOffset > dataSize_ || size > dataSize_ - dataOffset) throw std::runtime_error("Write outside the file data");
+    // The last extent starting at or before dataOffset, then on through the following ones.
+    size_t i = std::upper_bound(dataStarts_.begin(), dataStarts_.end(), dataOffset) - dataStarts_.begin() - 1;
+    for (; size; i++) {
+        const FlimageExtent& extent = extents_[i];
+        uint64_t within = dataOffset - dataStarts_[i];
+        size_t count = extent.length - within < size ? (size_t)(extent.length - within) : size;
+        writeAt(extent.offset + within, data, count);
+        data += count;
+        dataOffset += count;
+        size -= count;
+    }
+}
+
+std::string flimageTempPath(const std::string& path) {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char random[8];
+    flimageRandomBytes(random, sizeof(random));
+    std::string temp = path + kFlimageTempMarker;
+    for (unsigned char byte : random) {
+        temp += digits[byte >> 4];
+        temp += digits[byte & 15];
+    }
+    return temp;
+}
+
+void flimageWriteSparseFile(const std::string& path, uint64_t size, const std::vector<FlimageExtent>& extents,
+                            const std::vector<unsigned char>& data) {
+    FlimageOutputFile out(path, size, extents);
+    out.write(0, data.data(), data.size());
+    out.commit();
+}
+
+void flimageWriteFile(const std::string& path, const unsigned char* data, size_t size) {
+    std::vector<FlimageExtent> extents;
+    if (size) extents.push_back(FlimageExtent{0, size});
+    FlimageOutputFile out(path, size, extents);
+    out.write(0, data, size);
+    out.commit();
+}
+
+bool flimageValidExtents(const std::vector<FlimageExtent>& extents, uint64_t size, uint64_t dataSize) {
+    uint64_t end = 0, total = 0;
+    for (const FlimageExtent& extent : extents) {
+        if (extent.offset < end || extent.offset > size || extent.length == 0 || extent.length > size - extent.offset)
+            return false;
+        end = extent.offset + extent.length;
+        total += extent.length;
+    }
+    return total == dataSize;
+}
@@ -0,0 +1,76 @@
+#ifndef FLIMAGE_SPARSE_H
+#define FLIMAGE_SPARSE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Sparse files. Disk images and database files are mostly holes or zero blocks; only their data extents
+// are read, stored and written back. Holes are found with SEEK_DATA/SEEK_HOLE where the system has them,
+// and aligned all-zero blocks inside the data count as holes too, so preallocated zeros are skipped as well.
+// The decoder sizes the file with ftruncate and writes only the extents, which recreates the holes.
+
+struct FlimageExtent {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+struct FlimageSparseData {
+    uint64_t size = 0;                    // logical file size
+    std::vector<FlimageExtent> extents;   // sorted, non-overlapping data regions
+    std::vector<unsigned char> data;      // the bytes of all extents, back to back
+};
+
+// Throws std::runtime_error if the file can't be read.
+FlimageSparseData flimageReadSparseFile(const std::string& path);
+
+// A name next to path that no other writer picks: path + kFlimageTempMarker + 16 random hex digits. Files are
+// written there and renamed over path once complete, which keeps the rename on one file system.
+static const char kFlimageTempMarker[] = ".tmp-";
+std::string flimageTempPath(const std::string& path);
+
+// Creates the file with the given logical size and writes only the extents, through FlimageOutputFile so a
+// failed write leaves whatever was at the path untouched. Throws std::runtime_error on failure.
+void flimageWriteSparseFile(const std::string& path, uint64_t size, const std::vector<FlimageExtent>& extents,
+                            const std::vector<unsigned char>& data);
+
+// The same for a dense file holding size bytes of data.
+void flimageWriteFile(const std::string& path, const unsigned char* data, size_t size);
+
+// A file written in pieces, possibly by several threads at once: created at its logical size up front, then
+// every piece of the data goes to its place with pwrite. Pass a single extent {0, size} for a dense file.
+// Without POSIX I/O the writes are serialized and the holes written out as zeros. The pieces go to a temporary
+// file next to the path, which commit() renames over it; a file destroyed before that is removed, leaving
+// whatever was at the path untouched.
+class FlimageOutputFile {
+public:
+    FlimageOutputFile(const std::string& path, uint64_t size, const std::vector<FlimageExtent>& extents);
+    ~FlimageOutputFile();
+    FlimageOutputFile(const FlimageOutputFile&) = delete;
+    FlimageOutputFile& operator=(const FlimageOutputFile&) = delete;
+
+    // Writes data bytes [dataOffset, dataOffset + size) to the file positions the extents map them to.
+    // Throws std::runtime_error on failure or when the range lies outside the extents.
+    void write(uint64_t dataOffset, const unsigned char* data, size_t size);
+
+    // Closes the file and moves it to the path. Throws std::runtime_error on failure.
+    void commit();
+
+private:
+    void writeAt(uint64_t offset, const unsigned char* data, size_t size);
+
+    struct Handle;
+    std::string path_;
+    std::string tempPath_;
+    std::unique_ptr<Handle> handle_;
+    std::vector<FlimageExtent> extents_;
+    std::vector<uint64_t> dataStarts_;  // data offset of each extent
+    uint64_t dataSize_ = 0;
+};
+
+// True when the extents are sorted, don't overlap, lie within size and hold exactly dataSize bytes.
+bool flimageValidExtents(const std::vector<FlimageExtent>& extents, uint64_t size, uint64_t dataSize);
+
+#endif
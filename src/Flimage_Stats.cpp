@@ -0,0 +1,288 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#include "Flimage_Stats.h"
+#include "Flimage_Trace.h"
+
+struct PhaseFrame {
+    size_t index;       // of the phase in phases
+    size_t pathLength;  // length of the parent's path, restored when the phase ends
+    std::chrono::steady_clock::time_point start;
+};
+
+struct ThreadPhases {
+    std::string path;
+    std::vector<PhaseFrame> stack;
+};
+
+// Memory is accounted per site without locks, as the allocators call in for every block: site 0 is "not
+// accounted", site 1 collects the allocations outside of any phase (and of phases past the table), and phase i
+// is site i + 2.
+struct MemorySite {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> reallocations{0};
+    std::atomic<uint64_t> reallocGrowth{0};
+    std::atomic<uint64_t> liveBytes{0};
+    std::atomic<uint64_t> peakBytes{0};
+};
+
+static const uint32_t kOtherSite = 1;
+static const size_t kMemorySites = 1024;
+
+static std::atomic<bool> enabled(false);
+static std::mutex phasesMutex;
+static std::vector<FlimagePhaseStats> phases;
+static std::map<std::string, size_t> phaseIndex;
+static MemorySite memorySites[kMemorySites];
+static MemorySite memoryTotal;
+static std::mutex pacedBlocksMutex;
+static std::vector<FlimagePacedBlock> pacedBlocks;
+
+static thread_local ThreadPhases current;
+// Kept apart from current, which the allocators can't touch: it allocates itself and is destroyed before the
+// thread's last frees.
+static thread_local uint32_t currentSite = kOtherSite;
+static thread_local uint32_t adoptedSite = kOtherSite;
+
+static uint32_t siteOf(size_t index) {
+    return index + 2 < kMemorySites ? (uint32_t)(index + 2) : kOtherSite;
+}
+
+void flimageStatsEnable() {
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+void flimagePhaseBegin(const char* name, const char* detail) {
+    if (flimageTraceEnabled()) flimageTraceBegin(name, detail);
+    if (!enabled.load(std::memory_order_relaxed)) return;
+    size_t pathLength = current.path.size();
+    if (pathLength) current.path += '/';
+    current.path += name;
+    size_t index;
+    {
+        std::lock_guard<std::mutex> lock(phasesMutex);
+        auto inserted = phaseIndex.emplace(current.path, phases.size());
+        if (inserted.second) {
+            phases.emplace_back();
+            phases.back().name = current.path;
+        }
+        index = inserted.first->second;
+    }
+    current.stack.push_back({index, pathLength, std::chrono::steady_clock::now()});
+    currentSite = siteOf(index);
+}
+
+void flimagePhaseEnd(uint64_t bytesIn, uint64_t bytesOut) {
+    if (flimageTraceEnabled()) flimageTraceEnd();
+    if (!enabled.load(std::memory_order_relaxed) || current.stack.empty()) return;
+    PhaseFrame frame = current.stack.back();
+    current.stack.pop_back();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame.start).count();
+    current.path.resize(frame.pathLength);
+    currentSite = current.stack.empty() ? adoptedSite : siteOf(current.stack.back().index);
+
+    std::lock_guard<std::mutex> lock(phasesMutex);
+    FlimagePhaseStats& stats = phases[frame.index];
+    stats.calls++;
+    stats.seconds += seconds;
+    stats.bytesIn += bytesIn;
+    stats.bytesOut += bytesOut;
+}
+
+std::string flimagePhasePath() {
+    return current.path;
+}
+
+void flimagePhaseAdopt(const std::string& path) {
+    if (!current.stack.empty()) return;
+    current.path = path;
+    std::lock_guard<std::mutex> lock(phasesMutex);
+    auto it = phaseIndex.find(path);
+    adoptedSite = currentSite = it != phaseIndex.end() ? siteOf(it->second) : kOtherSite;
+}
+
+static void addLive(MemorySite& site, uint64_t bytes) {
+    uint64_t live = site.liveBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    uint64_t peak = site.peakBytes.load(std::memory_order_relaxed);
+    while (live > peak && !site.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+}
+
+uint32_t flimageMemoryAllocated(size_t size) {
+    if (!enabled.load(std::memory_order_relaxed)) return 0;
+    uint32_t site = currentSite;
+    memorySites[site].allocations.fetch_add(1, std::memory_order_relaxed);
+    memoryTotal.allocations.fetch_add(1, std::memory_order_relaxed);
+    addLive(memorySites[site], size);
+    addLive(memoryTotal, size);
+    return site;
+}
+
+uint32_t flimageMemoryReallocated(uint32_t site, size_t oldSize, size_t newSize) {
+    flimageMemoryFreed(site, oldSize);
+    if (!enabled.load(std::memory_order_relaxed)) return 0;
+    site = currentSite;
+    uint64_t growth = newSize > oldSize ? newSize - oldSize : 0;
+    for (MemorySite* s : {&memorySites[site], &memoryTotal}) {
+        s->reallocations.fetch_add(1, std::memory_order_relaxed);
+        s->reallocGrowth.fetch_add(growth, std::memory_order_relaxed);
+        addLive(*s, newSize);
+    }
+    return site;
+}
+
+void flimageMemoryFreed(uint32_t site, size_t size) {
+    if (!site) return;
+    memorySites[site].liveBytes.fetch_sub(size, std::memory_order_relaxed);
+    memoryTotal.liveBytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+static FlimageMemoryStats memoryStats(const MemorySite& site) {
+    FlimageMemoryStats stats;
+    stats.allocations = site.allocations.load(std::memory_order_relaxed);
+    stats.reallocations = site.reallocations.load(std::memory_order_relaxed);
+    stats.reallocGrowth = site.reallocGrowth.load(std::memory_order_relaxed);
+    stats.liveBytes = site.liveBytes.load(std::memory_order_relaxed);
+    stats.peakBytes = site.peakBytes.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::vector<FlimagePhaseStats> flimageStatsPhases() {
+    std::vector<FlimagePhaseStats> all;
+    {
+        std::lock_guard<std::mutex> lock(phasesMutex);
+        all = phases;
+    }
+    for (size_t i = 0; i < all.size(); i++) {
+        uint32_t site = siteOf(i);
+        if (site != kOtherSite) all[i].memory = memoryStats(memorySites[site]);
+    }
+    FlimageMemoryStats other = memoryStats(memorySites[kOtherSite]);
+    if (other.allocations || other.reallocations) {
+        all.emplace_back();
+        all.back().name = "(other)";
+        all.back().memory = other;
+    }
+    return all;
+}
+
+FlimageMemoryStats flimageStatsMemory() {
+    return memoryStats(memoryTotal);
+}
+
+void flimageStatsPacedBlock(const FlimagePacedBlock& block) {
+    if (!enabled.load(std::memory_order_relaxed)) return;
+    std::lock_guard<std::mutex> lock(pacedBlocksMutex);
+    pacedBlocks.push_back(block);
+}
+
+std::vector<FlimagePacedBlock> flimageStatsPacedBlocks() {
+    std::lock_guard<std::mutex> lock(pacedBlocksMutex);
+    return pacedBlocks;
+}
+
+std::string flimageStatsJson(const std::string& program, double wallSeconds) {
+    std::ostringstream os;
+    FlimageMemoryStats memory = flimageStatsMemory();
+    os << std::fixed << std::setprecision(6) << "{\"program\": \"" << program << "\", \"wall_seconds\": " << wallSeconds
+       << ", \"memory\": {\"allocations\": " << memory.allocations << ", \"reallocations\": " << memory.reallocations
+       << ", \"realloc_growth\": " << memory.reallocGrowth << ", \"live_bytes\": " << memory.liveBytes
+       << ", \"peak_bytes\": " << memory.peakBytes << "}, \"phases\": [";
+    std::vector<FlimagePhaseStats> all = flimageStatsPhases();
+    for (size_t i = 0; i < all.size(); i++) {
+        const FlimagePhaseStats& p = all[i];
+        double megabytesPerSecond = p.seconds > 0 ? p.bytesIn / 1e6 / p.seconds : 0;
+        os << (i ? ",\n  " : "\n  ") << "{\"phase\": \"" << p.name << "\", \"calls\": " << p.calls
+           << ", \"seconds\": " << p.seconds << ", \"bytes_in\": " << p.bytesIn << ", \"bytes_out\": " << p.bytesOut
+           << ", \"mb_per_s\": " << std::setprecision(1) << megabytesPerSecond << std::setprecision(6)
+           << ", \"allocations\": " << p.memory.allocations << ", \"reallocations\": " << p.memory.reallocations
+           << ", \"realloc_growth\": " << p.memory.reallocGrowth << ", \"peak_bytes\": " << p.memory.peakBytes << "}";
+    }
+    os << (all.empty() ? "]" : "\n]");
+    std::vector<FlimagePacedBlock> blocks = flimageStatsPacedBlocks();
+    if (!blocks.empty()) {
+        os << ", \"paced_blocks\": [";
+        for (size_t i = 0; i < blocks.size(); i++) {
+            const FlimagePacedBlock& b = blocks[i];
+            double megabytesPerSecond = b.seconds > 0 ? b.bytesIn / 1e6 / b.seconds : 0;
+            os << (i ? ",\n  " : "\n  ") << "{\"encode\": " << b.encode << ", \"offset\": " << b.offset
+               << ", \"bytes_in\": " << b.bytesIn << ", \"bytes_out\": " << b.bytesOut << ", \"level\": \""
+               << b.level << "\", \"filter\": \"" << b.filter << "\", \"windowsize\": " << b.windowsize
+               << ", \"nicematch\": " << b.nicematch << ", \"lazymatching\": " << (b.lazymatching ? "true" : "false")
+               << ", \"seconds\": " << b.seconds << std::setprecision(1) << ", \"mb_per_s\": " << megabytesPerSecond
+               << ", \"needed_mb_per_s\": " << b.neededMegabytesPerSecond << std::setprecision(6) << "}";
+        }
+        os << "\n]";
+    }
+    os << "}";
+    return os.str();
+}
+
+void flimageStatsWrite(const std::string& path, const std::string& program, double wallSeconds) {
+    std::string json = flimageStatsJson(program, wallSeconds);
+    if (path.empty()) {
+        std::cout << json << std::endl;
+        return;
+    }
+    std::ofstream ofs(path);
+    ofs << json << std::endl;
+    if (!ofs) throw std::runtime_error("Failed to write " + path);
+}
+
+// The hooks lodepng.cpp calls when built with -DLODEPNG_COMPILE_PHASE_HOOKS.
+void lodepng_phase_begin(const char* name) {
+    flimagePhaseBegin(name);
+}
+
+void lodepng_phase_end(size_t bytes_in, size_t bytes_out) {
+    flimagePhaseEnd(bytes_in, bytes_out);
+}
+
+#ifdef FLIMAGE_MEMORY_STATS
+// Every other heap allocation of the program: each block carries its size and site in front, in a header that
+// keeps the 16-byte alignment of new. Only built with -DFLIMAGE_MEMORY_STATS, as every allocation then pays for
+// the header and the accounting call, with --stats or without.
+struct NewHeader {
+    size_t size;
+    uint32_t site;
+    uint32_t reserved;
+};
+static_assert(sizeof(NewHeader) == 16, "new header must keep 16-byte alignment");
+
+void* operator new(size_t size) {
+    NewHeader* header = static_cast<NewHeader*>(std::malloc(sizeof(NewHeader) + size));
+    if (!header) throw std::bad_alloc();
+    header->size = size;
+    header->site = flimageMemoryAllocated(size);
+    return header + 1;
+}
+
+// GCC inlines this into the standard containers and, not seeing that the block came from the operator new above,
+// warns that malloc's memory is freed after a new; the header in front is exactly what malloc returned.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept {
+    if (!ptr) return;
+    NewHeader* header = static_cast<NewHeader*>(ptr) - 1;
+    flimageMemoryFreed(header->site, header->size);
+    std::free(header);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+#endif
@@ -0,0 +1,121 @@
+#ifndef FLIMAGE_STATS_H
+#define FLIMAGE_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Per-phase timing for --stats. A phase started inside another one is recorded under "outer/inner", so the
+// report is a tree: "encode/png/filter" is the filter step of the PNG encode. Every thread keeps its own nesting;
+// phases of the same name are summed over calls and threads, so parallel work can add up to more than the
+// wall time.
+//
+// Nothing is recorded until flimageStatsEnable() is called, and a disabled phase costs two relaxed atomic
+// loads; phases also go to the trace of Flimage_Trace.h when that is enabled. Define FLIMAGE_NO_STATS to
+// compile the phases out entirely. lodepng reports its own phases (color stats, conversion, filter, deflate
+// blocks, LZ77, Huffman, CRC, chunk reading, Adler-32, inflate, unfilter) through lodepng_phase_begin and
+// lodepng_phase_end when it is built with -DLODEPNG_COMPILE_PHASE_HOOKS.
+//
+// Heap memory is accounted too: the arena reports lodepng's blocks and, in a build with -DFLIMAGE_MEMORY_STATS,
+// the operator new of Flimage_Stats.cpp every other allocation, the container's vectors included (the scripts
+// leave it off, as it costs every allocation a header). Each allocation is charged to the phase that made
+// it (a reallocation to the phase that grew it), so the peak of a phase is the most memory its allocations
+// held at once, wherever they were freed.
+
+struct FlimageMemoryStats {
+    uint64_t allocations = 0;
+    uint64_t reallocations = 0;
+    uint64_t reallocGrowth = 0;  // bytes added by growing reallocations
+    uint64_t liveBytes = 0;
+    uint64_t peakBytes = 0;
+};
+
+struct FlimagePhaseStats {
+    std::string name;
+    uint64_t calls = 0;
+    double seconds = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    FlimageMemoryStats memory;
+};
+
+// One band of a paced encode (Flimage_Pace.h) and the settings it ran with.
+struct FlimagePacedBlock {
+    uint64_t encode = 0;  // numbers the paced encodes of the program: a sharded file has one per shard
+    uint64_t offset = 0;  // in the filtered scanlines
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;  // of the deflate stream
+    std::string level;
+    std::string filter;
+    unsigned windowsize = 0;
+    unsigned nicematch = 0;
+    bool lazymatching = false;
+    double seconds = 0;
+    double neededMegabytesPerSecond = 0;  // to finish on time when the band started, 0 when it was late already
+};
+
+void flimageStatsEnable();
+
+// Every phase recorded so far, in the order they first started. Memory allocated outside of any phase is
+// listed as "(other)" at the end.
+std::vector<FlimagePhaseStats> flimageStatsPhases();
+
+// All memory accounted since flimageStatsEnable().
+FlimageMemoryStats flimageStatsMemory();
+
+// Records a paced band; does nothing until flimageStatsEnable() is called.
+void flimageStatsPacedBlock(const FlimagePacedBlock& block);
+std::vector<FlimagePacedBlock> flimageStatsPacedBlocks();
+
+// {"program": ..., "wall_seconds": ..., "memory": {...}, "phases": [{"phase", "calls", "seconds", "bytes_in",
+// "bytes_out", "mb_per_s", "allocations", "reallocations", "realloc_growth", "peak_bytes"}, ...]}; throughput
+// is bytes in per second. Paced encodes add "paced_blocks": [{"encode", "offset", "bytes_in", "bytes_out",
+// "level", "filter", "windowsize", "nicematch", "lazymatching", "seconds", "mb_per_s", "needed_mb_per_s"}, ...].
+std::string flimageStatsJson(const std::string& program, double wallSeconds);
+
+// Writes the JSON report to the file, or to stdout when the path is empty. Throws std::runtime_error.
+void flimageStatsWrite(const std::string& path, const std::string& program, double wallSeconds);
+
+// The detail, such as the file a phase works on, only shows in the trace.
+void flimagePhaseBegin(const char* name, const char* detail = nullptr);
+void flimagePhaseEnd(uint64_t bytesIn, uint64_t bytesOut);
+
+// Path of the innermost open phase of this thread. A worker thread adopts the path of the thread that started
+// it, so its phases land in the same place of the tree.
+std::string flimagePhasePath();
+void flimagePhaseAdopt(const std::string& path);
+
+// Accounting hooks for allocators. The site returned for a block is kept with it and handed back when the block
+// is reallocated or freed; 0 means the block isn't accounted. None of them allocate.
+uint32_t flimageMemoryAllocated(size_t size);
+uint32_t flimageMemoryReallocated(uint32_t site, size_t oldSize, size_t newSize);
+void flimageMemoryFreed(uint32_t site, size_t size);
+
+#ifndef FLIMAGE_NO_STATS
+// Times the enclosing scope as one phase.
+class FlimagePhase {
+public:
+    explicit FlimagePhase(const char* name, const char* detail = nullptr) { flimagePhaseBegin(name, detail); }
+    ~FlimagePhase() { flimagePhaseEnd(bytesIn_, bytesOut_); }
+    FlimagePhase(const FlimagePhase&) = delete;
+    FlimagePhase& operator=(const FlimagePhase&) = delete;
+
+    void setBytes(uint64_t bytesIn, uint64_t bytesOut) {
+        bytesIn_ = bytesIn;
+        bytesOut_ = bytesOut;
+    }
+
+private:
+    uint64_t bytesIn_ = 0;
+    uint64_t bytesOut_ = 0;
+};
+#else
+class FlimagePhase {
+public:
+    explicit FlimagePhase(const char*, const char* = nullptr) {}
+    void setBytes(uint64_t, uint64_t) {}
+};
+#endif
+
+#endif
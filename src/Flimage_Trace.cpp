@@ -0,0 +1,156 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Flimage_Trace.h"
+
+// A whole event fills one cache line; the detail is stored in it, so recording never allocates.
+struct TraceEvent {
+    const char* name;      // nullptr for an end
+    uint64_t nanoseconds;  // since flimageTraceEnable
+    char detail[kFlimageTraceDetailSize + 1];  // empty for none
+};
+static_assert(sizeof(TraceEvent) == 64, "a trace event must fill one cache line");
+
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> written{0};  // events ever recorded; the ring holds the last events.size() of them
+    uint32_t thread = 0;
+    bool main = false;
+};
+
+static std::atomic<bool> tracing(false);
+static size_t ringSize = kFlimageTraceDefaultEvents;
+static std::chrono::steady_clock::time_point traceStart;
+static std::thread::id mainThread;
+static std::mutex buffersMutex;
+static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+
+static thread_local TraceBuffer* threadBuffer = nullptr;
+
+void flimageTraceEnable(size_t eventsPerThread) {
+    ringSize = eventsPerThread ? eventsPerThread : 1;
+    traceStart = std::chrono::steady_clock::now();
+    mainThread = std::this_thread::get_id();
+    tracing.store(true, std::memory_order_release);
+}
+
+bool flimageTraceEnabled() {
+    return tracing.load(std::memory_order_relaxed);
+}
+
+// The ring of this thread, registered with its first event; buffers outlive their threads.
+static TraceBuffer& currentBuffer() {
+    if (!threadBuffer) {
+        std::unique_ptr<TraceBuffer> buffer(new TraceBuffer);
+        buffer->events.resize(ringSize);
+        buffer->main = std::this_thread::get_id() == mainThread;
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        buffer->thread = (uint32_t)buffers.size();
+        threadBuffer = buffer.get();
+        buffers.push_back(std::move(buffer));
+    }
+    return *threadBuffer;
+}
+
+static void record(const char* name, const char* detail) {
+    if (!tracing.load(std::memory_order_acquire)) return;
+    TraceBuffer& buffer = currentBuffer();
+    uint64_t n = buffer.written.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer.events[n % buffer.events.size()];
+    event.name = name;
+    event.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - traceStart).count();
+    event.detail[0] = 0;
+    if (detail) {
+        // The end of a path tells files apart, so a long detail keeps its end.
+        size_t length = std::strlen(detail);
+        if (length <= kFlimageTraceDetailSize) {
+            std::memcpy(event.detail, detail, length + 1);
+        } else {
+            const char* tail = detail + length - (kFlimageTraceDetailSize - 3);
+            while (((unsigned char)*tail & 0xc0) == 0x80) tail++;  // not in the middle of a UTF-8 character
+            std::memcpy(event.detail, "...", 3);
+            std::memcpy(event.detail + 3, tail, (size_t)(detail + length - tail) + 1);
+        }
+    }
+    buffer.written.store(n + 1, std::memory_order_release);
+}
+
+void flimageTraceBegin(const char* name, const char* detail) {
+    record(name ? name : "?", detail);
+}
+
+void flimageTraceEnd() {
+    record(nullptr, nullptr);
+}
+
+static std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)(unsigned char)c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+void flimageTraceWrite(const std::string& path, const std::string& program) {
+    std::ofstream ofs(path);
+    if (!ofs.is_open()) throw std::runtime_error("Failed to write " + path);
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    ofs << "{\"traceEvents\": [\n";
+    ofs << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": " << jsonString(program)
+        << "}}";
+    uint64_t dropped = 0;
+    char timestamp[32];
+    for (const std::unique_ptr<TraceBuffer>& buffer : buffers) {
+        std::string threadName = buffer->main ? "main" : "thread " + std::to_string(buffer->thread);
+        ofs << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->thread
+            << ", \"args\": {\"name\": " << jsonString(threadName) << "}}";
+
+        // An end whose begin was overwritten has nothing to close.
+        uint64_t written = buffer->written.load(std::memory_order_acquire);
+        uint64_t size = buffer->events.size();
+        uint64_t first = written > size ? written - size : 0;
+        dropped += first;
+        size_t depth = 0;
+        for (uint64_t n = first; n < written; n++) {
+            const TraceEvent& event = buffer->events[n % size];
+            if (!event.name && depth == 0) {
+                dropped++;
+                continue;
+            }
+            std::snprintf(timestamp, sizeof(timestamp), "%.3f", event.nanoseconds / 1000.0);
+            if (event.name) {
+                depth++;
+                ofs << ",\n{\"name\": " << jsonString(event.name) << ", \"ph\": \"B\", \"ts\": " << timestamp
+                    << ", \"pid\": 1, \"tid\": " << buffer->thread;
+                if (event.detail[0]) ofs << ", \"args\": {\"detail\": " << jsonString(event.detail) << "}";
+                ofs << "}";
+            } else {
+                depth--;
+                ofs << ",\n{\"ph\": \"E\", \"ts\": " << timestamp << ", \"pid\": 1, \"tid\": " << buffer->thread << "}";
+            }
+        }
+    }
+    ofs << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped_events\": " << dropped << "}}" << std::endl;
+    if (!ofs) throw std::runtime_error("Failed to write " + path);
+}
@@ -0,0 +1,33 @@
+#ifndef FLIMAGE_TRACE_H
+#define FLIMAGE_TRACE_H
+
+#include <cstddef>
+#include <string>
+
+// Timeline of the phases for --trace, in the Chrome trace-event format (chrome://tracing, ui.perfetto.dev).
+// Where --stats sums the phases up, the trace keeps every begin and end with its thread, so stragglers,
+// idle workers and scheduling gaps show up.
+//
+// Every thread records into its own ring buffer without locks; only the first event of a thread takes a
+// lock to register the buffer. A full ring overwrites its oldest events, which are then left out of the
+// trace and counted as dropped. An event takes 64 bytes, its detail included, so recording never allocates
+// and a ring of the default size takes 4 MiB. The phases of Flimage_Stats.h are traced while tracing is enabled.
+
+static const size_t kFlimageTraceDefaultEvents = 1 << 16;
+// Characters of an event's detail that are kept; a longer one keeps its end, after "...".
+static const size_t kFlimageTraceDetailSize = 47;
+
+// Starts recording, with room for eventsPerThread events in every thread's ring.
+void flimageTraceEnable(size_t eventsPerThread = kFlimageTraceDefaultEvents);
+bool flimageTraceEnabled();
+
+// Name must outlive the trace (a string literal); detail, such as the file a phase works on, is copied into
+// the event (up to kFlimageTraceDetailSize characters) and shown as its argument.
+void flimageTraceBegin(const char* name, const char* detail = nullptr);
+void flimageTraceEnd();
+
+// Writes the events of all threads as {"traceEvents": [...]}. Call it once the worker threads are done:
+// a thread still recording may overwrite events while they are read. Throws std::runtime_error.
+void flimageTraceWrite(const std::string& path, const std::string& program);
+
+#endif
@@ -0,0 +1,323 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "Flimage_Transform.h"
+
+#if !defined(FLIMAGE_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64))
+#define FLIMAGE_SSE2
+#include <emmintrin.h>
+#endif
+
+static const uint32_t kMaxShuffleElement = 16;
+static const uint32_t kMaxDeltaDistance = 64;
+
+// Operands whose top byte is 0x00 or 0xFF hold "small" call targets: both relative and absolute
+// forms of real calls inside a module are in this 25-bit signed range. Conversion maps the range onto itself,
+// so the decoder sees exactly the same candidate positions as the encoder did.
+static const uint32_t kX86AddressMask = 0x01FFFFFF;
+
+#ifdef FLIMAGE_SSE2
+struct InterleaveRound {
+    unsigned step;   // registers a and a + step are interleaved
+    unsigned width;  // in bytes
+};
+
+static void interleave(__m128i* regs, unsigned count, const InterleaveRound& round) {
+    for (unsigned a = 0; a < count; a++) {
+        if ((a / round.step) % 2) continue;
+        unsigned b = a + round.step;
+        __m128i lo, hi;
+        switch (round.width) {
+        case 1: lo = _mm_unpacklo_epi8(regs[a], regs[b]); hi = _mm_unpackhi_epi8(regs[a], regs[b]); break;
+        case 2: lo = _mm_unpacklo_epi16(regs[a], regs[b]); hi = _mm_unpackhi_epi16(regs[a], regs[b]); break;
+        case 4: lo = _mm_unpacklo_epi32(regs[a], regs[b]); hi = _mm_unpackhi_epi32(regs[a], regs[b]); break;
+        default: lo = _mm_unpacklo_epi64(regs[a], regs[b]); hi = _mm_unpackhi_epi64(regs[a], regs[b]); break;
+        }
+        regs[a] = lo;
+        regs[b] = hi;
+    }
+}
+
+// Unpack sequences that transpose 16 elements of 2, 4 or 8 bytes (held in as many registers) into byte
+// planes of 16 bytes each, and back.
+static const InterleaveRound kShuffle2[] = {{1, 1}, {1, 1}, {1, 1}, {1, 1}};
+static const InterleaveRound kShuffle4[] = {{1, 1}, {1, 1}, {2, 4}, {1, 1}};
+static const InterleaveRound kShuffle8[] = {{1, 1}, {4, 2}, {2, 2}, {1, 1}};
+static const InterleaveRound kUnshuffle2[] = {{1, 1}};
+static const InterleaveRound kUnshuffle4[] = {{2, 1}, {1, 1}};
+static const InterleaveRound kUnshuffle8[] = {{4, 1}, {2, 1}, {1, 1}};
+
+static bool shuffleRounds(uint32_t element, bool inverse, const InterleaveRound*& rounds, unsigned& count) {
+    switch (element) {
+    case 2: rounds = inverse ? kUnshuffle2 : kShuffle2; count = inverse ? 1 : 4; return true;
+    case 4: rounds = inverse ? kUnshuffle4 : kShuffle4; count = inverse ? 2 : 4; return true;
+    case 8: rounds = inverse ? kUnshuffle8 : kShuffle8; count = inverse ? 3 : 4; return true;
+    default: return false;
+    }
+}
+#endif
+
+static void shuffle(unsigned char* out, const unsigned char* in, size_t size, uint32_t element) {
+    size_t elements = size / element;
+    size_t e = 0;
+#ifdef FLIMAGE_SSE2
+    const InterleaveRound* rounds;
+    unsigned numRounds;
+    if (shuffleRounds(element, false, rounds, numRounds)) {
+        __m128i regs[8];
+        for (; e + 16 <= elements; e += 16) {
+            for (uint32_t r = 0; r < element; r++) regs[r] = _mm_loadu_si128((const __m128i*)(in + e * element + r * 16));
+            for (unsigned i = 0; i < numRounds; i++) interleave(regs, element, rounds[i]);
+            for (uint32_t r = 0; r < element; r++) _mm_storeu_si128((__m128i*)(out + r * elements + e), regs[r]);
+        }
+    }
+#endif
+    for (; e < elements; e++) {
+        for (uint32_t b = 0; b < element; b++) out[b * elements + e] = in[e * element + b];
+    }
+    std::memcpy(out + elements * element, in + elements * element, size - elements * element);
+}
+
+static void unshuffle(unsigned char* out, const unsigned char* in, size_t size, uint32_t element) {
+    size_t elements = size / element;
+    size_t e = 0;
+#ifdef FLIMAGE_SSE2
+    const InterleaveRound* rounds;
+    unsigned numRounds;
+    if (shuffleRounds(element, true, rounds, numRounds)) {
+        __m128i regs[8];
+        for (; e + 16 <= elements; e += 16) {
+            for (uint32_t r = 0; r < element; r++) regs[r] = _mm_loadu_si128((const __m128i*)(in + r * elements + e));
+            for (unsigned i = 0; i < numRounds; i++) interleave(regs, element, rounds[i]);
+            for (uint32_t r = 0; r < element; r++) _mm_storeu_si128((__m128i*)(out + e * element + r * 16), regs[r]);
+        }
+    }
+#endif
+    for (; e < elements; e++) {
+        for (uint32_t b = 0; b < element; b++) out[e * element + b] = in[b * elements + e];
+    }
+    std::memcpy(out + elements * element, in + elements * element, size - elements * element);
+}
+
+// Runs backwards so every byte is still unmodified when the byte after it reads it.
+static void deltaEncode(unsigned char* data, size_t size, size_t distance) {
+    if (size <= distance) return;
+    size_t i = size;
+#ifdef FLIMAGE_SSE2
+    while (i >= distance + 16) {
+        i -= 16;
+        __m128i cur = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i prev = _mm_loadu_si128((const __m128i*)(data + i - distance));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_sub_epi8(cur, prev));
+    }
+#endif
+    while (i > distance) {
+        i--;
+        data[i] = (unsigned char)(data[i] - data[i - distance]);
+    }
+}
+
+#ifdef FLIMAGE_SSE2
+// The distance bytes before pos, repeated over a register.
+static __m128i broadcastPrevious(const unsigned char* pos, size_t distance) {
+    switch (distance) {
+    case 1: return _mm_set1_epi8((char)pos[-1]);
+    case 2: { int16_t v; std::memcpy(&v, pos - 2, 2); return _mm_set1_epi16(v); }
+    case 4: { int32_t v; std::memcpy(&v, pos - 4, 4); return _mm_set1_epi32(v); }
+    default: { __m128i v = _mm_loadl_epi64((const __m128i*)(pos - 8)); return _mm_unpacklo_epi64(v, v); }
+    }
+}
+
+// Running sum of every distance-th byte within a register, for distances 1, 2, 4 and 8.
+static __m128i prefixSum(__m128i x, size_t distance) {
+    switch (distance) {
+    case 1: x = _mm_add_epi8(x, _mm_slli_si128(x, 1)); // fall through
+    case 2: x = _mm_add_epi8(x, _mm_slli_si128(x, 2)); // fall through
+    case 4: x = _mm_add_epi8(x, _mm_slli_si128(x, 4)); // fall through
+    default: x = _mm_add_epi8(x, _mm_slli_si128(x, 8)); break;
+    }
+    return x;
+}
+#endif
+
+static void deltaDecode(unsigned char* data, size_t size, size_t distance) {
+    size_t i = distance;
+#ifdef FLIMAGE_SSE2
+    if (distance >= 16) {
+        for (; i + 16 <= size; i += 16) {
+            __m128i cur = _mm_loadu_si128((const __m128i*)(data + i));
+            __m128i prev = _mm_loadu_si128((const __m128i*)(data + i - distance));
+            _mm_storeu_si128((__m128i*)(data + i), _mm_add_epi8(cur, prev));
+        }
+    } else if (distance == 1 || distance == 2 || distance == 4 || distance == 8) {
+        // The first distance bytes are stored as is, so the running sum starts after them.
+        for (; i + 16 <= size; i += 16) {
+            __m128i sum = prefixSum(_mm_loadu_si128((const __m128i*)(data + i)), distance);
+            _mm_storeu_si128((__m128i*)(data + i), _mm_add_epi8(sum, broadcastPrevious(data + i, distance)));
+        }
+    }
+#endif
+    for (; i < size; i++) data[i] = (unsigned char)(data[i] + data[i - distance]);
+}
+
+static void convertX86(unsigned char* data, size_t size, bool encode) {
+    if (size < 5) return;
+    size_t end = size - 4;
+    size_t i = 0;
+    while (i < end) {
+#ifdef FLIMAGE_SSE2
+        // Skip 16 bytes at a time while there is no E8/E9 opcode.
+        const __m128i opcodeMask = _mm_set1_epi8((char)0xFE);
+        const __m128i opcode = _mm_set1_epi8((char)0xE8);
+        while (i + 16 <= end) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), opcodeMask);
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, opcode));
+            if (mask) {
+                while (!(mask & 1)) { mask >>= 1; i++; }
+                break;
+            }
+            i += 16;
+        }
+        if (i >= end) break;
+#endif
+        if ((data[i] & 0xFE) != 0xE8) {
+            i++;
+            continue;
+        }
+        // Operand bytes are never examined as opcodes, converted or not: the decoder must visit exactly the
+        // positions the encoder visited, and only the operand at i changes what is seen at i.
+        if (data[i + 4] != 0x00 && data[i + 4] != 0xFF) {
+            i += 5;
+            continue;
+        }
+        uint32_t value = (uint32_t)data[i + 1] | ((uint32_t)data[i + 2] << 8) | ((uint32_t)data[i + 3] << 16)
+                       | ((uint32_t)data[i + 4] << 24);
+        uint32_t position = (uint32_t)(i + 5);
+        value = encode ? value + position : value - position;
+        value &= kX86AddressMask;
+        if (value & 0x01000000) value |= ~kX86AddressMask;
+        data[i + 1] = (unsigned char)(value);
+        data[i + 2] = (unsigned char)(value >> 8);
+        data[i + 3] = (unsigned char)(value >> 16);
+        data[i + 4] = (unsigned char)(value >> 24);
+        i += 5;
+    }
+}
+
+void flimageValidateTransform(const FlimageTransform& transform) {
+    switch (transform.kind) {
+    case FlimageTransformKind::None:
+    case FlimageTransformKind::X86:
+        return;
+    case FlimageTransformKind::Shuffle:
+        if (transform.param < 2 || transform.param > kMaxShuffleElement)
+            throw std::runtime_error("Invalid shuffle element size");
+        return;
+    case FlimageTransformKind::Delta:
+        if (transform.param < 1 || transform.param > kMaxDeltaDistance)
+            throw std::runtime_error("Invalid delta distance");
+        return;
+    default:
+        throw std::runtime_error("Unknown transform");
+    }
+}
+
+void flimageApplyTransform(std::vector<unsigned char>& data, const FlimageTransform& transform) {
+    flimageValidateTransform(transform);
+    switch (transform.kind) {
+    case FlimageTransformKind::Shuffle: {
+        std::vector<unsigned char> out(data.size());
+        if (!data.empty()) shuffle(out.data(), data.data(), data.size(), transform.param);
+        data.swap(out);
+        break;
+    }
+    case FlimageTransformKind::Delta:
+        deltaEncode(data.data(), data.size(), transform.param);
+        break;
+    case FlimageTransformKind::X86:
+        convertX86(data.data(), data.size(), true);
+        break;
+    default:
+        break;
+    }
+}
+
+void flimageRevertTransform(std::vector<unsigned char>& data, const FlimageTransform& transform) {
+    flimageValidateTransform(transform);
+    switch (transform.kind) {
+    case FlimageTransformKind::Shuffle: {
+        std::vector<unsigned char> out(data.size());
+        if (!data.empty()) unshuffle(out.data(), data.data(), data.size(), transform.param);
+        data.swap(out);
+        break;
+    }
+    case FlimageTransformKind::Delta:
+        deltaDecode(data.data(), data.size(), transform.param);
+        break;
+    case FlimageTransformKind::X86:
+        convertX86(data.data(), data.size(), false);
+        break;
+    default:
+        break;
+    }
+}
+
+std::string flimageTransformName(const FlimageTransform& transform) {
+    switch (transform.kind) {
+    case FlimageTransformKind::None: return "none";
+    case FlimageTransformKind::Shuffle: return "shuffle" + std::to_string(transform.param);
+    case FlimageTransformKind::Delta: return "delta" + std::to_string(transform.param);
+    case FlimageTransformKind::X86: return "x86";
+    case FlimageTransformKind::Auto: return "auto";
+    }
+    return "unknown";
+}
+
+static bool parseNumbered(const std::string& name, const char* prefix, uint32_t& param) {
+    size_t length = std::strlen(prefix);
+    if (name.compare(0, length, prefix) != 0 || name.size() == length || name.size() > length + 3) return false;
+    for (size_t i = length; i < name.size(); i++) {
+        if (name[i] < '0' || name[i] > '9') return false;
+    }
+    param = (uint32_t)std::stoul(name.substr(length));
+    return true;
+}
+
+bool flimageParseTransform(const std::string& name, FlimageTransform& transform) {
+    FlimageTransform parsed;
+    if (name == "none") {
+        parsed.kind = FlimageTransformKind::None;
+    } else if (name == "auto") {
+        parsed.kind = FlimageTransformKind::Auto;
+    } else if (name == "x86") {
+        parsed.kind = FlimageTransformKind::X86;
+    } else if (parseNumbered(name, "shuffle", parsed.param)) {
+        parsed.kind = FlimageTransformKind::Shuffle;
+    } else if (parseNumbered(name, "delta", parsed.param)) {
+        parsed.kind = FlimageTransformKind::Delta;
+    } else {
+        return false;
+    }
+    if (parsed.kind != FlimageTransformKind::Auto) {
+        try {
+            flimageValidateTransform(parsed);
+        } catch (const std::runtime_error&) {
+            return false;
+        }
+    }
+    transform = parsed;
+    return true;
+}
+
+std::vector<FlimageTransform> flimageTransformCandidates() {
+    std::vector<FlimageTransform> candidates;
+    candidates.push_back({FlimageTransformKind::None, 0});
+    candidates.push_back({FlimageTransformKind::Shuffle, 2});
+    candidates.push_back({FlimageTransformKind::Shuffle, 4});
+    candidates.push_back({FlimageTransformKind::Shuffle, 8});
+    candidates.push_back({FlimageTransformKind::Delta, 1});
+    candidates.push_back({FlimageTransformKind::Delta, 2});
+    candidates.push_back({FlimageTransformKind::Delta, 4});
+    candidates.push_back({FlimageTransformKind::X86, 0});
+    return candidates;
+}
@@ -0,0 +1,41 @@
+#ifndef FLIMAGE_TRANSFORM_H
+#define FLIMAGE_TRANSFORM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Reversible, size preserving payload transforms applied before the bytes become pixels:
+//   shuffleN  groups byte k of every N-byte element together (byte planes), for numeric arrays
+//   deltaN    replaces every byte by its difference to the byte N positions earlier
+//   x86       turns relative E8/E9 call/jump targets into absolute ones, so repeated calls to the
+//             same function become repeated byte strings (the BCJ filter of executable packers)
+// All have SSE2 paths with plain C++ fallbacks.
+
+enum class FlimageTransformKind : uint8_t {
+    None = 0,
+    Shuffle = 1,
+    Delta = 2,
+    X86 = 3,
+    Auto = 255,  // encoder option only, never stored
+};
+
+struct FlimageTransform {
+    FlimageTransformKind kind = FlimageTransformKind::None;
+    uint32_t param = 0;  // element size for Shuffle, distance for Delta
+};
+
+void flimageApplyTransform(std::vector<unsigned char>& data, const FlimageTransform& transform);
+void flimageRevertTransform(std::vector<unsigned char>& data, const FlimageTransform& transform);
+
+// Throws std::runtime_error if the kind or parameter is not supported.
+void flimageValidateTransform(const FlimageTransform& transform);
+
+std::string flimageTransformName(const FlimageTransform& transform);
+bool flimageParseTransform(const std::string& name, FlimageTransform& transform);
+
+// The transforms auto mode tries.
+std::vector<FlimageTransform> flimageTransformCandidates();
+
+#endif
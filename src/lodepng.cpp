@@ -39,6 +39,30 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdlib.h> /* allocations */
 #endif /* LODEPNG_COMPILE_ALLOCATORS */
 
+/*SSE2 fast paths for a few pixel scanning loops, with plain C fallbacks. SSE2 is always
+available on x86-64. Define LODEPNG_NO_SSE2 to use the plain C code only.*/
+#if !defined(LODEPNG_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LODEPNG_SSE2
+#include <emmintrin.h>
+#endif /*LODEPNG_SSE2*/
+
+/*SSSE3 paths for the conversions that need a byte shuffle (pshufb), which SSE2 lacks. SSSE3 isn't part of
+x86-64, so unless the build targets it, gcc and clang compile these kernels for SSSE3 on their own and they
+are picked at run time. Other compilers use them only when building for SSSE3 or later. Define LODEPNG_NO_SSSE3
+to use the SSE2 and plain C code only.*/
+#if defined(LODEPNG_SSE2) && !defined(LODEPNG_NO_SSSE3) && (defined(__SSSE3__) || defined(__AVX__) || \
+    (defined(__GNUC__) && !defined(__INTEL_COMPILER)))
+#define LODEPNG_SSSE3
+#include <tmmintrin.h>
+#if defined(__SSSE3__) || defined(__AVX__)
+#define LODEPNG_SSSE3_TARGET
+#define lodepng_has_ssse3() 1
+#else
+#define LODEPNG_SSSE3_TARGET __attribute__((target("ssse3")))
+#define lodepng_has_ssse3() __builtin_cpu_supports("ssse3")
+#endif
+#endif /*LODEPNG_SSSE3*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -96,6 +120,19 @@ void* lodepng_realloc(void* ptr, size_t new_size);
 void lodepng_free(void* ptr);
 #endif /*LODEPNG_COMPILE_ALLOCATORS*/
 
+/*Phase hooks for profiling, defined externally: every phase_begin is matched by one phase_end on the
+same thread, phases may nest. Without LODEPNG_COMPILE_PHASE_HOOKS they compile to nothing; the byte counts
+are then not evaluated, only named so variables kept for them don't warn as unused.*/
+#ifdef LODEPNG_COMPILE_PHASE_HOOKS
+void lodepng_phase_begin(const char* name);
+void lodepng_phase_end(size_t bytes_in, size_t bytes_out);
+#define LODEPNG_PHASE_BEGIN(name) lodepng_phase_begin(name)
+#define LODEPNG_PHASE_END(bytes_in, bytes_out) lodepng_phase_end(bytes_in, bytes_out)
+#else /*LODEPNG_COMPILE_PHASE_HOOKS*/
+#define LODEPNG_PHASE_BEGIN(name) ((void)0)
+#define LODEPNG_PHASE_END(bytes_in, bytes_out) ((void)sizeof(bytes_in), (void)sizeof(bytes_out))
+#endif /*LODEPNG_COMPILE_PHASE_HOOKS*/
+
 /* convince the compiler to inline a function, for use when this measurably improves performance */
 /* inline is not available in C90, but use it when supported by the compiler */
 #if (defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)) || (defined(__cplusplus) && (__cplusplus >= 199711L))
@@ -1481,10 +1518,27 @@ typedef struct Hash {
   int* headz; /*similar to head, but for chainz*/
   unsigned short* chainz; /*those with same amount of zeros*/
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
+
+  /*the input positions [dirty_begin, dirty_end) were hashed since the last reset, with window dirty_windowsize
+  (0 if unknown); while they don't wrap around the window, hash_reset only has to clean their slots*/
+  size_t dirty_begin;
+  size_t dirty_end;
+  unsigned dirty_windowsize;
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize) {
-  unsigned i;
+static void hash_init(Hash* hash) {
+  hash->head = 0;
+  hash->val = 0;
+  hash->chain = 0;
+  hash->zeros = 0;
+  hash->headz = 0;
+  hash->chainz = 0;
+  hash->dirty_begin = 0;
+  hash->dirty_end = 0;
+  hash->dirty_windowsize = 0;
+}
+
+static unsigned hash_alloc(Hash* hash, unsigned windowsize) {
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1496,18 +1550,56 @@ static unsigned hash_init(Hash* hash, unsigned windowsize) {
   if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros) {
     return 83; /*alloc fail*/
   }
-
-  /*initialize hash table*/
-  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
-
-  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
-
   return 0;
 }
 
+/*puts the hash back in its initial state for windowsize without reallocating; allocsize is the windowsize it
+was allocated with. A full reset rewrites head (256 KiB) and the window arrays, which costs more than deflating
+a small input does, so when the positions hashed since the last reset didn't wrap around the window, only their
+slots are cleaned: every head entry in use points at one of them, and that slot's val and zeros hold its index.
+Cleaning a slot costs about as much as 8 entries of a full reset, so few positions are cleaned that way. Either
+way all slots up to allocsize end up clean, so any windowsize can follow.*/
+static void hash_reset(Hash* hash, unsigned windowsize, unsigned allocsize) {
+  unsigned i;
+  size_t dirty = hash->dirty_end - hash->dirty_begin;
+  if(dirty < hash->dirty_windowsize && dirty <= (HASH_NUM_VALUES + (size_t)allocsize) / 8u) {
+    size_t pos;
+    for(pos = hash->dirty_begin; pos != hash->dirty_end; ++pos) {
+      unsigned wpos = (unsigned)(pos & (hash->dirty_windowsize - 1));
+      if(hash->val[wpos] < 0) continue; /*not hashed after all, e.g. when the encoding stopped on an error*/
+      hash->head[hash->val[wpos]] = -1;
+      hash->headz[hash->zeros[wpos]] = -1;
+      hash->val[wpos] = -1;
+      hash->chain[wpos] = wpos; /*same value as index indicates uninitialized*/
+      hash->chainz[wpos] = wpos;
+    }
+  } else {
+    /*initialize hash table*/
+    for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+    for(i = 0; i != allocsize; ++i) hash->val[i] = -1;
+    for(i = 0; i != allocsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
+
+    for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
+    for(i = 0; i != allocsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+  }
+  hash->dirty_begin = 0;
+  hash->dirty_end = 0;
+  hash->dirty_windowsize = windowsize;
+}
+
+/*records that encodeLZ77 hashes the positions [inpos, insize) with the given windowsize*/
+static void hash_mark_dirty(Hash* hash, size_t inpos, size_t insize, unsigned windowsize) {
+  if(inpos >= insize) return;
+  if(windowsize != hash->dirty_windowsize) hash->dirty_windowsize = 0; /*slots of two layouts: clean all*/
+  if(hash->dirty_begin == hash->dirty_end) {
+    hash->dirty_begin = inpos;
+    hash->dirty_end = insize;
+  } else {
+    if(inpos < hash->dirty_begin) hash->dirty_begin = inpos;
+    if(insize > hash->dirty_end) hash->dirty_end = insize;
+  }
+}
+
 static void hash_cleanup(Hash* hash) {
   lodepng_free(hash->head);
   lodepng_free(hash->val);
@@ -1516,9 +1608,63 @@ static void hash_cleanup(Hash* hash) {
   lodepng_free(hash->zeros);
   lodepng_free(hash->headz);
   lodepng_free(hash->chainz);
+  hash_init(hash);
 }
 
+/*
+The compressor context owns every buffer the deflate encoder needs that doesn't depend on the
+input size in a way that forces reallocation: the hash chains, the LZ77 symbol buffer, the
+Huffman frequency and code length scratch arrays and the deflate output buffer. Between
+inputs only the hash tables are re-initialized, mostly just the slots the last input used; the
+buffers keep their capacity.
+*/
+struct LodePNGCompressContext {
+  Hash hash;
+  unsigned hash_windowsize; /*windowsize the hash buffers are allocated for, 0 if not allocated yet*/
+  uivector lz77_encoded;
+  unsigned frequencies_ll[286]; /*frequency of lit,len codes*/
+  unsigned frequencies_d[30]; /*frequency of dist codes*/
+  unsigned frequencies_cl[NUM_CODE_LENGTH_CODES]; /*frequency of code length codes*/
+  unsigned bitlen_lld[286 + 30]; /*lit,len,dist code lengths (int bits), literally (without repeat codes).*/
+  unsigned bitlen_lld_e[286 + 30]; /*bitlen_lld encoded with repeat codes*/
+  ucvector deflated; /*deflate output of lodepng_zlib_compress, before the zlib header is added*/
+};
 
+LodePNGCompressContext* lodepng_compress_context_create(void) {
+  LodePNGCompressContext* context = (LodePNGCompressContext*)lodepng_malloc(sizeof(LodePNGCompressContext));
+  if(!context) return 0;
+  hash_init(&context->hash);
+  context->hash_windowsize = 0;
+  uivector_init(&context->lz77_encoded);
+  context->deflated = ucvector_init(NULL, 0);
+  return context;
+}
+
+void lodepng_compress_context_destroy(LodePNGCompressContext* context) {
+  if(!context) return;
+  hash_cleanup(&context->hash);
+  uivector_cleanup(&context->lz77_encoded);
+  lodepng_free(context->deflated.data);
+  lodepng_free(context);
+}
+
+/*get the context ready for compressing a new input with the given windowsize*/
+static unsigned compress_context_reset(LodePNGCompressContext* context, unsigned windowsize) {
+  if(!context->hash.head || windowsize > context->hash_windowsize) {
+    unsigned error;
+    hash_cleanup(&context->hash);
+    context->hash_windowsize = 0;
+    error = hash_alloc(&context->hash, windowsize);
+    if(error) {
+      hash_cleanup(&context->hash);
+      return error;
+    }
+    context->hash_windowsize = windowsize;
+  }
+  hash_reset(&context->hash, windowsize, context->hash_windowsize);
+  context->lz77_encoded.size = 0;
+  return 0;
+}
 
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos) {
   unsigned result = 0;
@@ -1595,6 +1741,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
 
   if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+  hash_mark_dirty(hash, inpos, insize, windowsize);
 
   for(pos = inpos; pos < insize; ++pos) {
     size_t wpos = pos & (windowsize - 1); /*position for in 'circular' hash buffers*/
@@ -1726,6 +1873,8 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
 
   size_t i, numdeflateblocks = (datasize + 65534u) / 65535u;
   size_t datapos = 0;
+  /*the output size is known up front, growing block by block would copy it over and over*/
+  if(!ucvector_reserve(out, out->size + datasize + numdeflateblocks * 5u)) return 83; /*alloc fail*/
   for(i = 0; i != numdeflateblocks; ++i) {
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
@@ -1783,7 +1932,7 @@ static void writeLZ77data(LodePNGBitWriter* writer, const uivector* lz77_encoded
 }
 
 /*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
+static unsigned deflateDynamic(LodePNGBitWriter* writer, LodePNGCompressContext* context,
                                const unsigned char* data, size_t datapos, size_t dataend,
                                const LodePNGCompressSettings* settings, unsigned final) {
   unsigned error = 0;
@@ -1800,16 +1949,17 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   */
 
   /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
+  uivector* lz77_encoded = &context->lz77_encoded;
   HuffmanTree tree_ll; /*tree for lit,len values*/
   HuffmanTree tree_d; /*tree for distance codes*/
   HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
-  unsigned* frequencies_ll = 0; /*frequency of lit,len codes*/
-  unsigned* frequencies_d = 0; /*frequency of dist codes*/
-  unsigned* frequencies_cl = 0; /*frequency of code length codes*/
-  unsigned* bitlen_lld = 0; /*lit,len,dist code lengths (int bits), literally (without repeat codes).*/
-  unsigned* bitlen_lld_e = 0; /*bitlen_lld encoded with repeat codes (this is a rudimentary run length compression)*/
+  unsigned* frequencies_ll = context->frequencies_ll; /*frequency of lit,len codes*/
+  unsigned* frequencies_d = context->frequencies_d; /*frequency of dist codes*/
+  unsigned* frequencies_cl = context->frequencies_cl; /*frequency of code length codes*/
+  unsigned* bitlen_lld = context->bitlen_lld; /*lit,len,dist code lengths (int bits), literally (without repeat codes).*/
+  unsigned* bitlen_lld_e = context->bitlen_lld_e; /*bitlen_lld encoded with repeat codes (this is a rudimentary run length compression)*/
   size_t datasize = dataend - datapos;
+  size_t huffman_start = 0; /*output size + 1 when the "huffman" phase started, 0 if it didn't*/
 
   /*
   If we could call "bitlen_cl" the the code length code lengths ("clcl"), that is the bit lengths of codes to represent
@@ -1825,16 +1975,10 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   size_t numcodes_ll, numcodes_d, numcodes_lld, numcodes_lld_e, numcodes_cl;
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
+  lz77_encoded->size = 0;
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
-  /* could fit on stack, but >1KB is on the larger side so allocate instead */
-  frequencies_ll = (unsigned*)lodepng_malloc(286 * sizeof(*frequencies_ll));
-  frequencies_d = (unsigned*)lodepng_malloc(30 * sizeof(*frequencies_d));
-  frequencies_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
-
-  if(!frequencies_ll || !frequencies_d || !frequencies_cl) error = 83; /*alloc fail*/
 
   /*This while loop never loops due to a break at the end, it is here to
   allow breaking out of it to the cleanup phase on error conditions.*/
@@ -1844,20 +1988,26 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     lodepng_memset(frequencies_cl, 0, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
     if(settings->use_lz77) {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+      LODEPNG_PHASE_BEGIN("lz77");
+      error = encodeLZ77(lz77_encoded, &context->hash, data, datapos, dataend, settings->windowsize,
                          settings->minmatch, settings->nicematch, settings->lazymatching);
+      LODEPNG_PHASE_END(datasize, lz77_encoded->size * sizeof(unsigned));
       if(error) break;
     } else {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; ++i) lz77_encoded.data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
+      if(!uivector_resize(lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
+      for(i = datapos; i < dataend; ++i) lz77_encoded->data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
     }
 
+    /*everything from here on: tree construction and entropy coding*/
+    LODEPNG_PHASE_BEGIN("huffman");
+    huffman_start = writer->data->size + 1;
+
     /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i != lz77_encoded.size; ++i) {
-      unsigned symbol = lz77_encoded.data[i];
+    for(i = 0; i != lz77_encoded->size; ++i) {
+      unsigned symbol = lz77_encoded->data[i];
       ++frequencies_ll[symbol];
       if(symbol > 256) {
-        unsigned dist = lz77_encoded.data[i + 2];
+        unsigned dist = lz77_encoded->data[i + 2];
         ++frequencies_d[dist];
         i += 3;
       }
@@ -1874,11 +2024,8 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     numcodes_ll = LODEPNG_MIN(tree_ll.numcodes, 286);
     numcodes_d = LODEPNG_MIN(tree_d.numcodes, 30);
     /*store the code lengths of both generated trees in bitlen_lld*/
-    numcodes_lld = numcodes_ll + numcodes_d;
-    bitlen_lld = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld));
     /*numcodes_lld_e never needs more size than bitlen_lld*/
-    bitlen_lld_e = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld_e));
-    if(!bitlen_lld || !bitlen_lld_e) ERROR_BREAK(83); /*alloc fail*/
+    numcodes_lld = numcodes_ll + numcodes_d;
     numcodes_lld_e = 0;
 
     for(i = 0; i != numcodes_ll; ++i) bitlen_lld[i] = tree_ll.lengths[i];
@@ -1981,7 +2128,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
+    writeLZ77data(writer, lz77_encoded, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
     if(tree_ll.lengths[256] == 0) ERROR_BREAK(64);
 
@@ -1990,22 +2137,17 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
 
     break; /*end of error-while*/
   }
+  if(huffman_start) LODEPNG_PHASE_END(lz77_encoded->size * sizeof(unsigned), writer->data->size + 1 - huffman_start);
 
   /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
-  lodepng_free(frequencies_ll);
-  lodepng_free(frequencies_d);
-  lodepng_free(frequencies_cl);
-  lodepng_free(bitlen_lld);
-  lodepng_free(bitlen_lld_e);
 
   return error;
 }
 
-static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
+static unsigned deflateFixed(LodePNGBitWriter* writer, LodePNGCompressContext* context,
                              const unsigned char* data,
                              size_t datapos, size_t dataend,
                              const LodePNGCompressSettings* settings, unsigned final) {
@@ -2028,12 +2170,12 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
     writeBits(writer, 0, 1); /*second bit of BTYPE*/
 
     if(settings->use_lz77) /*LZ77 encoded*/ {
-      uivector lz77_encoded;
-      uivector_init(&lz77_encoded);
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+      context->lz77_encoded.size = 0;
+      LODEPNG_PHASE_BEGIN("lz77");
+      error = encodeLZ77(&context->lz77_encoded, &context->hash, data, datapos, dataend, settings->windowsize,
                          settings->minmatch, settings->nicematch, settings->lazymatching);
-      if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
-      uivector_cleanup(&lz77_encoded);
+      LODEPNG_PHASE_END(dataend - datapos, context->lz77_encoded.size * sizeof(unsigned));
+      if(!error) writeLZ77data(writer, &context->lz77_encoded, &tree_ll, &tree_d);
     } else /*no LZ77, but still will be Huffman compressed*/ {
       for(i = datapos; i < dataend; ++i) {
         writeBitsReversed(writer, tree_ll.codes[data[i]], tree_ll.lengths[data[i]]);
@@ -2050,11 +2192,20 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
+/*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
+static size_t dynamicBlockSize(size_t insize) {
+  size_t blocksize = insize / 8u + 8;
+  if(blocksize < 65536) blocksize = 65536;
+  if(blocksize > 262144) blocksize = 262144;
+  return blocksize;
+}
+
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
                                  const LodePNGCompressSettings* settings) {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  Hash hash;
+  size_t outbase = out->size;
+  LodePNGCompressContext* context = settings->context;
   LodePNGBitWriter writer;
 
   LodePNGBitWriter_init(&writer, out);
@@ -2062,31 +2213,34 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   if(settings->btype > 2) return 61;
   else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
   else if(settings->btype == 1) blocksize = insize;
-  else /*if(settings->btype == 2)*/ {
-    /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
-    blocksize = insize / 8u + 8;
-    if(blocksize < 65536) blocksize = 65536;
-    if(blocksize > 262144) blocksize = 262144;
-  }
+  else /*if(settings->btype == 2)*/ blocksize = dynamicBlockSize(insize);
 
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
+  /*without a context from the user, use a temporary one for this call only*/
+  if(!context) context = lodepng_compress_context_create();
+  if(!context) return 83; /*alloc fail*/
+
+  error = compress_context_reset(context, settings->windowsize);
 
   if(!error) {
     for(i = 0; i != numdeflateblocks && !error; ++i) {
       unsigned final = (i == numdeflateblocks - 1);
       size_t start = i * blocksize;
       size_t end = start + blocksize;
+      size_t outstart = out->size;
       if(end > insize) end = insize;
 
-      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+      LODEPNG_PHASE_BEGIN("deflate_block");
+      if(settings->btype == 1) error = deflateFixed(&writer, context, in, start, end, settings, final);
+      else if(settings->btype == 2) error = deflateDynamic(&writer, context, in, start, end, settings, final);
+      LODEPNG_PHASE_END(end - start, out->size - outstart);
+      if(!error && settings->progress && settings->progress(end, insize, out->size - outbase, settings)) error = 123;
     }
   }
 
-  hash_cleanup(&hash);
+  if(context != settings->context) lodepng_compress_context_destroy(context);
 
   return error;
 }
@@ -2179,12 +2333,17 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
     return 26;
   }
 
+  LODEPNG_PHASE_BEGIN("inflate");
   error = inflatev(out, in + 2, insize - 2, settings);
+  LODEPNG_PHASE_END(insize, out->size);
   if(error) return error;
 
   if(!settings->ignore_adler32) {
     unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(out->data, (unsigned)(out->size));
+    unsigned checksum;
+    LODEPNG_PHASE_BEGIN("adler32");
+    checksum = adler32(out->data, (unsigned)(out->size));
+    LODEPNG_PHASE_END(out->size, 0);
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
@@ -2216,8 +2375,9 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
   } else {
     ucvector v = ucvector_init(*out, *outsize);
     if(expected_size) {
-      /*reserve the memory to avoid intermediate reallocations*/
-      ucvector_resize(&v, *outsize + expected_size);
+      /*reserve the memory to avoid intermediate reallocations, including the 260 bytes inflateHuffmanBlock keeps
+      reserved past its output: without them the last symbols grow the buffer by half, copying all of it*/
+      ucvector_resize(&v, *outsize + expected_size + 260);
       v.size = *outsize;
     }
     error = lodepng_zlib_decompressv(&v, in, insize, settings);
@@ -2237,8 +2397,17 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned error;
   unsigned char* deflatedata = 0;
   size_t deflatesize = 0;
-
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  LodePNGCompressContext* context = settings->custom_deflate ? 0 : settings->context;
+
+  if(context) {
+    /*deflate into the buffer kept by the context, it keeps its capacity between calls*/
+    context->deflated.size = 0;
+    error = lodepng_deflatev(&context->deflated, in, insize, settings);
+    deflatedata = context->deflated.data;
+    deflatesize = context->deflated.size;
+  } else {
+    error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  }
 
   *out = NULL;
   *outsize = 0;
@@ -2249,7 +2418,10 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   }
 
   if(!error) {
-    unsigned ADLER32 = adler32(in, (unsigned)insize);
+    unsigned ADLER32;
+    LODEPNG_PHASE_BEGIN("adler32");
+    ADLER32 = adler32(in, (unsigned)insize);
+    LODEPNG_PHASE_END(insize, 0);
     /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
     unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
     unsigned FLEVEL = 0;
@@ -2264,7 +2436,7 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
     lodepng_set32bitInt(&(*out)[*outsize - 4], ADLER32);
   }
 
-  lodepng_free(deflatedata);
+  if(!context) lodepng_free(deflatedata);
   return error;
 }
 
@@ -2321,9 +2493,14 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
+
+  settings->context = 0;
+
+  settings->progress = 0;
+  settings->progress_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2639,10 +2816,9 @@ static const unsigned lodepng_crc32_table7[256] = {
   0x2c8e0fffu, 0xe0240f61u, 0x6eab0882u, 0xa201081cu, 0xa8c40105u, 0x646e019bu, 0xeae10678u, 0x264b06e6u
 };
 
-/* Computes the cyclic redundancy check as used by PNG chunks*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+/*Continues a CRC over more data: r is the register, 0xffffffff at the start, and the CRC is r ^ 0xffffffff.*/
+static unsigned lodepng_crc32_update(unsigned r, const unsigned char* data, size_t length) {
   /*Using the Slicing by Eight algorithm*/
-  unsigned r = 0xffffffffu;
   while(length >= 8) {
     r = lodepng_crc32_table7[(data[0] ^ (r & 0xffu))] ^
         lodepng_crc32_table6[(data[1] ^ ((r >> 8) & 0xffu))] ^
@@ -2658,7 +2834,12 @@ unsigned lodepng_crc32(const unsigned char* data, size_t length) {
   while(length--) {
     r = lodepng_crc32_table0[(r ^ *data++) & 0xffu] ^ (r >> 8);
   }
-  return r ^ 0xffffffffu;
+  return r;
+}
+
+/* Computes the cyclic redundancy check as used by PNG chunks*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+  return lodepng_crc32_update(0xffffffffu, data, length) ^ 0xffffffffu;
 }
 #else /* LODEPNG_COMPILE_CRC */
 /*in this case, the function is only declared here, and must be defined externally
@@ -2775,14 +2956,20 @@ unsigned lodepng_chunk_check_crc(const unsigned char* chunk) {
   unsigned length = lodepng_chunk_length(chunk);
   unsigned CRC = lodepng_read32bitInt(&chunk[length + 8]);
   /*the CRC is taken of the data and the 4 chunk type letters, not the length*/
-  unsigned checksum = lodepng_crc32(&chunk[4], length + 4);
+  unsigned checksum;
+  LODEPNG_PHASE_BEGIN("crc");
+  checksum = lodepng_crc32(&chunk[4], length + 4);
+  LODEPNG_PHASE_END((size_t)length + 4, 0);
   if(CRC != checksum) return 1;
   else return 0;
 }
 
 void lodepng_chunk_generate_crc(unsigned char* chunk) {
   unsigned length = lodepng_chunk_length(chunk);
-  unsigned CRC = lodepng_crc32(&chunk[4], length + 4);
+  unsigned CRC;
+  LODEPNG_PHASE_BEGIN("crc");
+  CRC = lodepng_crc32(&chunk[4], length + 4);
+  LODEPNG_PHASE_END((size_t)length + 4, 0);
   lodepng_set32bitInt(chunk + 8 + length, CRC);
 }
 
@@ -3467,12 +3654,6 @@ static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, uns
   return tree ? tree->index : -1;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
-  return color_tree_get(tree, r, g, b, a) >= 0;
-}
-#endif /*LODEPNG_COMPILE_ENCODER*/
-
 /*color is not allowed to already exist.
 Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")
 Returns error code, or 0 if ok*/
@@ -3650,6 +3831,193 @@ static void getPixelColorRGBA8(unsigned char* r, unsigned char* g,
   }
 }
 
+/*
+Bulk kernels for the most common conversions, with SSE2 paths for 16 bytes at a time (SSSE3 for those that
+shuffle bytes) and plain C loops for the rest. They take whole buffers, the conversion is chosen once per call in lodepng_convert or in
+getPixelColorsRGBA8/getPixelColorsRGB8.
+*/
+
+/*16-bit to 8-bit samples, keeping the most significant byte (the first one, PNG is big endian)*/
+static void narrowSamples16(unsigned char* LODEPNG_RESTRICT out, const unsigned char* LODEPNG_RESTRICT in,
+                            size_t numsamples) {
+  size_t i = 0;
+#ifdef LODEPNG_SSE2
+  const __m128i lowmask = _mm_set1_epi16(0x00ff);
+  for(; i + 16 <= numsamples; i += 16) {
+    __m128i v0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 2)), lowmask);
+    __m128i v1 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 2 + 16)), lowmask);
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(v0, v1));
+  }
+#endif /*LODEPNG_SSE2*/
+  for(; i != numsamples; ++i) out[i] = in[i * 2];
+}
+
+/*8-bit to 16-bit samples, repeating each byte like rgba8ToPixel does*/
+static void widenSamples8(unsigned char* LODEPNG_RESTRICT out, const unsigned char* LODEPNG_RESTRICT in,
+                          size_t numsamples) {
+  size_t i = 0;
+#ifdef LODEPNG_SSE2
+  for(; i + 16 <= numsamples; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm_storeu_si128((__m128i*)(out + i * 2), _mm_unpacklo_epi8(v, v));
+    _mm_storeu_si128((__m128i*)(out + i * 2 + 16), _mm_unpackhi_epi8(v, v));
+  }
+#endif /*LODEPNG_SSE2*/
+  for(; i != numsamples; ++i) out[i * 2] = out[i * 2 + 1] = in[i];
+}
+
+/*8-bit grey to RGBA, opaque. The color key, if any, must be applied afterwards.*/
+static void grey8ToRGBA8(unsigned char* LODEPNG_RESTRICT out, const unsigned char* LODEPNG_RESTRICT in,
+                         size_t numpixels) {
+  size_t i = 0;
+#ifdef LODEPNG_SSE2
+  const __m128i opaque = _mm_set1_epi8((char)255);
+  for(; i + 16 <= numpixels; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i gg0 = _mm_unpacklo_epi8(v, v), gg1 = _mm_unpackhi_epi8(v, v);
+    __m128i ga0 = _mm_unpacklo_epi8(v, opaque), ga1 = _mm_unpackhi_epi8(v, opaque);
+    _mm_storeu_si128((__m128i*)(out + i * 4), _mm_unpacklo_epi16(gg0, ga0));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 16), _mm_unpackhi_epi16(gg0, ga0));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 32), _mm_unpacklo_epi16(gg1, ga1));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 48), _mm_unpackhi_epi16(gg1, ga1));
+  }
+#endif /*LODEPNG_SSE2*/
+  for(; i != numpixels; ++i) {
+    out[i * 4 + 0] = out[i * 4 + 1] = out[i * 4 + 2] = in[i];
+    out[i * 4 + 3] = 255;
+  }
+}
+
+#ifdef LODEPNG_SSSE3
+/*16 pixels at a time; returns the number of pixels done*/
+LODEPNG_SSSE3_TARGET
+static size_t rgb8ToRGBA8SSSE3(unsigned char* LODEPNG_RESTRICT out, const unsigned char* LODEPNG_RESTRICT in,
+                               size_t numpixels) {
+  size_t i = 0;
+  const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i opaque = _mm_set1_epi32((int)0xff000000u);
+  for(; i + 16 <= numpixels; i += 16) {
+    /*48 bytes of RGB, of which every 12 become 16 bytes of RGBA*/
+    __m128i v0 = _mm_loadu_si128((const __m128i*)(in + i * 3));
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(in + i * 3 + 16));
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(in + i * 3 + 32));
+    _mm_storeu_si128((__m128i*)(out + i * 4), _mm_or_si128(_mm_shuffle_epi8(v0, spread), opaque));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 16),
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(v1, v0, 12), spread), opaque));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 32),
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(v2, v1, 8), spread), opaque));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 48),
+                     _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(v2, 4), spread), opaque));
+  }
+  return i;
+}
+
+/*4-bit palette indices to RGBA, 16 pixels at a time: the 16 colors fit the table of one pshufb per channel.
+palette must have the 1024 bytes of LodePNGColorMode. Returns the number of pixels done.*/
+LODEPNG_SSSE3_TARGET
+static size_t palette4ToRGBA8SSSE3(unsigned char* LODEPNG_RESTRICT out, const unsigned char* LODEPNG_RESTRICT in,
+                                   size_t numpixels, const unsigned char* palette) {
+  size_t i = 0;
+  const __m128i planar = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+  const __m128i nibble = _mm_set1_epi8(15);
+  /*the palette as one table per channel: every 4 colors to r0-3 g0-3 b0-3 a0-3, then those transposed*/
+  __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(palette)), planar);
+  __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(palette + 16)), planar);
+  __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(palette + 32)), planar);
+  __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(palette + 48)), planar);
+  __m128i rg01 = _mm_unpacklo_epi32(p0, p1), ba01 = _mm_unpackhi_epi32(p0, p1);
+  __m128i rg23 = _mm_unpacklo_epi32(p2, p3), ba23 = _mm_unpackhi_epi32(p2, p3);
+  __m128i red = _mm_unpacklo_epi64(rg01, rg23), green = _mm_unpackhi_epi64(rg01, rg23);
+  __m128i blue = _mm_unpacklo_epi64(ba01, ba23), alpha = _mm_unpackhi_epi64(ba01, ba23);
+  for(; i + 16 <= numpixels; i += 16) {
+    /*the high nibble is the first pixel*/
+    __m128i v = _mm_loadl_epi64((const __m128i*)(in + i / 2));
+    __m128i index = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), nibble), _mm_and_si128(v, nibble));
+    __m128i r = _mm_shuffle_epi8(red, index), g = _mm_shuffle_epi8(green, index);
+    __m128i b = _mm_shuffle_epi8(blue, index), a = _mm_shuffle_epi8(alpha, index);
+    __m128i rg0 = _mm_unpacklo_epi8(r, g), rg1 = _mm_unpackhi_epi8(r, g);
+    __m128i ba0 = _mm_unpacklo_epi8(b, a), ba1 = _mm_unpackhi_epi8(b, a);
+    _mm_storeu_si128((__m128i*)(out + i * 4), _mm_unpacklo_epi16(rg0, ba0));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 16), _mm_unpackhi_epi16(rg0, ba0));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 32), _mm_unpacklo_epi16(rg1, ba1));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 48), _mm_unpackhi_epi16(rg1, ba1));
+  }
+  return i;
+}
+#endif /*LODEPNG_SSSE3*/
+
+/*8-bit RGB to RGBA, opaque. The color key, if any, must be applied afterwards.*/
+static void rgb8ToRGBA8(unsigned char* LODEPNG_RESTRICT out, const unsigned char* LODEPNG_RESTRICT in,
+                        size_t numpixels) {
+  size_t i = 0;
+#ifdef LODEPNG_SSSE3
+  if(lodepng_has_ssse3()) i = rgb8ToRGBA8SSSE3(out, in, numpixels);
+#endif /*LODEPNG_SSSE3*/
+  for(; i != numpixels; ++i) {
+    lodepng_memcpy(&out[i * 4], &in[i * 3], 3);
+    out[i * 4 + 3] = 255;
+  }
+}
+
+/*8-bit grey with alpha to RGBA*/
+static void greyAlpha8ToRGBA8(unsigned char* LODEPNG_RESTRICT out, const unsigned char* LODEPNG_RESTRICT in,
+                              size_t numpixels) {
+  size_t i = 0;
+#ifdef LODEPNG_SSE2
+  const __m128i lowmask = _mm_set1_epi16(0x00ff);
+  for(; i + 8 <= numpixels; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i * 2)); /*16-bit lanes hold grey | alpha << 8*/
+    __m128i grey = _mm_and_si128(v, lowmask);
+    __m128i gg = _mm_or_si128(grey, _mm_slli_epi16(grey, 8));
+    _mm_storeu_si128((__m128i*)(out + i * 4), _mm_unpacklo_epi16(gg, v));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 16), _mm_unpackhi_epi16(gg, v));
+  }
+#endif /*LODEPNG_SSE2*/
+  for(; i != numpixels; ++i) {
+    out[i * 4 + 0] = out[i * 4 + 1] = out[i * 4 + 2] = in[i * 2 + 0];
+    out[i * 4 + 3] = in[i * 2 + 1];
+  }
+}
+
+/*8-bit RGBA to 8-bit grey (with alpha if alpha is 1). Like rgba8ToPixel, the grey value is taken
+from the red channel.*/
+static void rgba8ToGrey8(unsigned char* LODEPNG_RESTRICT out, const unsigned char* LODEPNG_RESTRICT in,
+                         size_t numpixels, unsigned alpha) {
+  size_t i = 0;
+#ifdef LODEPNG_SSE2
+  const __m128i redmask = _mm_set1_epi32(0x000000ff);
+  const __m128i alphamask = _mm_set1_epi32(0x0000ff00);
+  if(alpha) {
+    for(; i + 8 <= numpixels; i += 8) {
+      __m128i v0 = _mm_loadu_si128((const __m128i*)(in + i * 4));
+      __m128i v1 = _mm_loadu_si128((const __m128i*)(in + i * 4 + 16));
+      /*32-bit lanes of red | alpha << 8, sign extended so that the signed pack keeps the bits*/
+      v0 = _mm_or_si128(_mm_and_si128(v0, redmask), _mm_and_si128(_mm_srli_epi32(v0, 16), alphamask));
+      v1 = _mm_or_si128(_mm_and_si128(v1, redmask), _mm_and_si128(_mm_srli_epi32(v1, 16), alphamask));
+      v0 = _mm_srai_epi32(_mm_slli_epi32(v0, 16), 16);
+      v1 = _mm_srai_epi32(_mm_slli_epi32(v1, 16), 16);
+      _mm_storeu_si128((__m128i*)(out + i * 2), _mm_packs_epi32(v0, v1));
+    }
+  } else {
+    for(; i + 16 <= numpixels; i += 16) {
+      __m128i v0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 4)), redmask);
+      __m128i v1 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 4 + 16)), redmask);
+      __m128i v2 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 4 + 32)), redmask);
+      __m128i v3 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 4 + 48)), redmask);
+      _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3)));
+    }
+  }
+#endif /*LODEPNG_SSE2*/
+  if(alpha) {
+    for(; i != numpixels; ++i) {
+      out[i * 2 + 0] = in[i * 4 + 0];
+      out[i * 2 + 1] = in[i * 4 + 3];
+    }
+  } else {
+    for(; i != numpixels; ++i) out[i] = in[i * 4];
+  }
+}
+
 /*Similar to getPixelColorRGBA8, but with all the for loops inside of the color
 mode test cases, optimized to convert the colors much faster, when converting
 to the common case of RGBA with 8 bit per channel. buffer must be RGBA with
@@ -3661,12 +4029,8 @@ static void getPixelColorsRGBA8(unsigned char* LODEPNG_RESTRICT buffer, size_t n
   size_t i;
   if(mode->colortype == LCT_GREY) {
     if(mode->bitdepth == 8) {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        buffer[0] = buffer[1] = buffer[2] = in[i];
-        buffer[3] = 255;
-      }
+      grey8ToRGBA8(buffer, in, numpixels);
       if(mode->key_defined) {
-        buffer -= numpixels * num_channels;
         for(i = 0; i != numpixels; ++i, buffer += num_channels) {
           if(buffer[0] == mode->key_r) buffer[3] = 0;
         }
@@ -3687,12 +4051,8 @@ static void getPixelColorsRGBA8(unsigned char* LODEPNG_RESTRICT buffer, size_t n
     }
   } else if(mode->colortype == LCT_RGB) {
     if(mode->bitdepth == 8) {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        lodepng_memcpy(buffer, &in[i * 3], 3);
-        buffer[3] = 255;
-      }
+      rgb8ToRGBA8(buffer, in, numpixels);
       if(mode->key_defined) {
-        buffer -= numpixels * num_channels;
         for(i = 0; i != numpixels; ++i, buffer += num_channels) {
           if(buffer[0] == mode->key_r && buffer[1]== mode->key_g && buffer[2] == mode->key_b) buffer[3] = 0;
         }
@@ -3716,8 +4076,18 @@ static void getPixelColorsRGBA8(unsigned char* LODEPNG_RESTRICT buffer, size_t n
         lodepng_memcpy(buffer, &mode->palette[index * 4], 4);
       }
     } else {
+      /*4-bit indices fit the 16-byte table of a pshufb. 8-bit ones would take 16 of them per channel, more than
+      the copy per pixel above, and 1- and 2-bit images are rare enough to stay bit by bit.*/
       size_t j = 0;
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
+      i = 0;
+#ifdef LODEPNG_SSSE3
+      if(mode->bitdepth == 4 && lodepng_has_ssse3()) {
+        i = palette4ToRGBA8SSSE3(buffer, in, numpixels, mode->palette);
+        j = i * 4;
+        buffer += i * num_channels;
+      }
+#endif /*LODEPNG_SSSE3*/
+      for(; i != numpixels; ++i, buffer += num_channels) {
         unsigned index = readBitsFromReversedStream(&j, in, mode->bitdepth);
         /*out of bounds of palette not checked: see lodepng_color_mode_alloc_palette.*/
         lodepng_memcpy(buffer, &mode->palette[index * 4], 4);
@@ -3725,10 +4095,7 @@ static void getPixelColorsRGBA8(unsigned char* LODEPNG_RESTRICT buffer, size_t n
     }
   } else if(mode->colortype == LCT_GREY_ALPHA) {
     if(mode->bitdepth == 8) {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        buffer[0] = buffer[1] = buffer[2] = in[i * 2 + 0];
-        buffer[3] = in[i * 2 + 1];
-      }
+      greyAlpha8ToRGBA8(buffer, in, numpixels);
     } else {
       for(i = 0; i != numpixels; ++i, buffer += num_channels) {
         buffer[0] = buffer[1] = buffer[2] = in[i * 4 + 0];
@@ -3739,12 +4106,7 @@ static void getPixelColorsRGBA8(unsigned char* LODEPNG_RESTRICT buffer, size_t n
     if(mode->bitdepth == 8) {
       lodepng_memcpy(buffer, in, numpixels * 4);
     } else {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        buffer[0] = in[i * 8 + 0];
-        buffer[1] = in[i * 8 + 2];
-        buffer[2] = in[i * 8 + 4];
-        buffer[3] = in[i * 8 + 6];
-      }
+      narrowSamples16(buffer, in, numpixels * 4);
     }
   }
 }
@@ -3776,11 +4138,7 @@ static void getPixelColorsRGB8(unsigned char* LODEPNG_RESTRICT buffer, size_t nu
     if(mode->bitdepth == 8) {
       lodepng_memcpy(buffer, in, numpixels * 3);
     } else {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        buffer[0] = in[i * 6 + 0];
-        buffer[1] = in[i * 6 + 2];
-        buffer[2] = in[i * 6 + 4];
-      }
+      narrowSamples16(buffer, in, numpixels * 3);
     }
   } else if(mode->colortype == LCT_PALETTE) {
     if(mode->bitdepth == 8) {
@@ -3809,9 +4167,11 @@ static void getPixelColorsRGB8(unsigned char* LODEPNG_RESTRICT buffer, size_t nu
     }
   } else if(mode->colortype == LCT_RGBA) {
     if(mode->bitdepth == 8) {
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        lodepng_memcpy(buffer, &in[i * 4], 3);
+      /*copy 4 bytes per pixel, the 4th is overwritten by the next pixel, which is faster than copying 3*/
+      for(i = 0; i + 1 < numpixels; ++i, buffer += num_channels) {
+        lodepng_memcpy(buffer, &in[i * 4], 4);
       }
+      if(numpixels) lodepng_memcpy(buffer, &in[i * 4], 3);
     } else {
       for(i = 0; i != numpixels; ++i, buffer += num_channels) {
         buffer[0] = in[i * 8 + 0];
@@ -3897,7 +4257,18 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
   }
 
   if(!error) {
-    if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16) {
+    /*same channels, only the bit depth differs: the 8-bit value of a 16-bit sample is its first byte,
+    and an 8-bit sample becomes 16-bit by repeating it. Color keys don't matter without an alpha channel
+    in the output, and for those with alpha channel there is no color key.*/
+    unsigned same_channels = mode_in->colortype == mode_out->colortype && mode_in->colortype != LCT_PALETTE;
+    if(same_channels && mode_in->bitdepth == 16 && mode_out->bitdepth == 8) {
+      narrowSamples16(out, in, numpixels * lodepng_get_channels(mode_in));
+    } else if(same_channels && mode_in->bitdepth == 8 && mode_out->bitdepth == 16) {
+      widenSamples8(out, in, numpixels * lodepng_get_channels(mode_in));
+    } else if(mode_in->colortype == LCT_RGBA && mode_in->bitdepth == 8 && mode_out->bitdepth == 8 &&
+              (mode_out->colortype == LCT_GREY || mode_out->colortype == LCT_GREY_ALPHA)) {
+      rgba8ToGrey8(out, in, numpixels, mode_out->colortype == LCT_GREY_ALPHA);
+    } else if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16) {
       for(i = 0; i != numpixels; ++i) {
         unsigned short r = 0, g = 0, b = 0, a = 0;
         getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
@@ -4017,12 +4388,110 @@ static unsigned getValueRequiredBits(unsigned char value) {
   return 8;
 }
 
+/*
+Open addressing hash set of RGBA colors, used to count the distinct colors of an image. A color
+costs one multiply and usually one probe into a flat table, instead of walking the 8 levels of
+pointers of a ColorTree.
+*/
+#define COLOR_SET_SIZE 1024u /*power of two, at least 4x the maximum of 257 colors that get counted*/
+
+typedef struct ColorSet {
+  unsigned* keys; /*RGBA packed in 32 bits*/
+  unsigned char* used;
+} ColorSet;
+
+static unsigned color_set_init(ColorSet* set) {
+  set->keys = (unsigned*)lodepng_malloc(COLOR_SET_SIZE * (sizeof(*set->keys) + 1));
+  if(!set->keys) return 83; /*alloc fail*/
+  set->used = (unsigned char*)(set->keys + COLOR_SET_SIZE);
+  lodepng_memset(set->used, 0, COLOR_SET_SIZE);
+  return 0;
+}
+
+static void color_set_cleanup(ColorSet* set) {
+  lodepng_free(set->keys);
+}
+
+/*returns 1 if the color was added, 0 if it was already present*/
+static unsigned color_set_insert(ColorSet* set, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+  unsigned key = ((unsigned)r << 24u) | ((unsigned)g << 16u) | ((unsigned)b << 8u) | (unsigned)a;
+  unsigned pos = ((key * 2654435761u) & 0xffffffffu) >> 22u; /*top 10 bits of a multiplicative hash*/
+  while(set->used[pos]) {
+    if(set->keys[pos] == key) return 0;
+    pos = (pos + 1u) & (COLOR_SET_SIZE - 1u);
+  }
+  set->used[pos] = 1;
+  set->keys[pos] = key;
+  return 1;
+}
+
+/*Returns 1 if any 16-bit sample in the buffer has a different high and low byte, that is, if the
+image really needs 16 bits per channel. Works on the raw bytes, so it handles all 16-bit color types.*/
+static unsigned has_16bit_samples(const unsigned char* in, size_t numbytes) {
+  size_t i = 0;
+#ifdef LODEPNG_SSE2
+  const __m128i lowmask = _mm_set1_epi16(0x00ff);
+  for(; i + 16 <= numbytes; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i diff = _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi16(v, 8)), lowmask);
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff) return 1;
+  }
+#endif /*LODEPNG_SSE2*/
+  for(; i + 1 < numbytes; i += 2) {
+    if(in[i] != in[i + 1]) return 1;
+  }
+  return 0;
+}
+
+/*
+For 8-bit RGBA or RGB input: returns how many pixels, starting at pixel i, cannot change the color stats
+anymore once palette and bit depth are decided: opaque pixels while alpha is undecided, gray pixels while
+colored is undecided. Checks blocks of 16 pixels and stops at the first block with a pixel that needs a
+closer look, so the result is a multiple of 16.
+*/
+static size_t countPlainPixels8(const unsigned char* in, size_t i, size_t numpixels, unsigned channels,
+                                unsigned check_gray, unsigned check_alpha) {
+  size_t start = i;
+  for(; i + 16 <= numpixels; i += 16) {
+    const unsigned char* p = &in[i * channels];
+#ifdef LODEPNG_SSE2
+    if(channels == 4) {
+      const __m128i alphamask = _mm_set1_epi32((int)0xff000000u);
+      const __m128i lowmask = _mm_set1_epi32(0xff);
+      __m128i bad = _mm_setzero_si128();
+      unsigned k;
+      for(k = 0; k != 4; ++k) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + k * 16));
+        /*alpha: ~a is 0 only for opaque pixels*/
+        if(check_alpha) bad = _mm_or_si128(bad, _mm_andnot_si128(v, alphamask));
+        /*gray: (r ^ g) | (r ^ b) is 0 only for gray pixels*/
+        if(check_gray) {
+          __m128i x = _mm_or_si128(_mm_xor_si128(v, _mm_srli_epi32(v, 8)), _mm_xor_si128(v, _mm_srli_epi32(v, 16)));
+          bad = _mm_or_si128(bad, _mm_and_si128(x, lowmask));
+        }
+      }
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff) break;
+      continue;
+    }
+#endif /*LODEPNG_SSE2*/
+    {
+      unsigned bad = 0, k;
+      for(k = 0; k != 16; ++k, p += channels) {
+        if(check_alpha && channels == 4) bad |= p[3] ^ 255u;
+        if(check_gray) bad |= (p[0] ^ p[1]) | (p[0] ^ p[2]);
+      }
+      if(bad) break;
+    }
+  }
+  return i - start;
+}
+
 /*stats must already have been inited. */
 unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
                                      const unsigned char* in, unsigned w, unsigned h,
                                      const LodePNGColorMode* mode_in) {
   size_t i;
-  ColorTree tree;
+  ColorSet colorset;
   size_t numpixels = (size_t)w * (size_t)h;
   unsigned error = 0;
 
@@ -4031,9 +4500,14 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   unsigned alpha_done = lodepng_can_have_alpha(mode_in) ? 0 : 1;
   unsigned numcolors_done = 0;
   unsigned bpp = lodepng_get_bpp(mode_in);
+  /*the most bits per channel the < 16-bit scan can find, it caps at 8 for multi-channel and 16-bit input*/
+  unsigned bits_max = bpp < 8 ? bpp : 8;
   unsigned bits_done = (stats->bits == 1 && bpp == 1) ? 1 : 0;
   unsigned sixteen = 0; /* whether the input image is 16 bit */
   unsigned maxnumcolors = 257;
+  /*8-bit RGB(A) input without color key can skip over pixels that can't change the stats anymore*/
+  unsigned plain_channels = (mode_in->bitdepth == 8 && !mode_in->key_defined) ?
+      (mode_in->colortype == LCT_RGBA ? 4 : mode_in->colortype == LCT_RGB ? 3 : 0) : 0;
   if(bpp <= 8) maxnumcolors = LODEPNG_MIN(257, stats->numcolors + (1u << bpp));
 
   stats->numpixels += numpixels;
@@ -4041,37 +4515,31 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   /*if palette not allowed, no need to compute numcolors*/
   if(!stats->allow_palette) numcolors_done = 1;
 
-  color_tree_init(&tree);
-
-  /*If the stats was already filled in from previous data, fill its palette in tree
+  /*If the stats was already filled in from previous data, fill its palette in the color set
   and mark things as done already if we know they are the most expensive case already*/
   if(stats->alpha) alpha_done = 1;
   if(stats->colored) colored_done = 1;
   if(stats->bits == 16) numcolors_done = 1;
-  if(stats->bits >= bpp) bits_done = 1;
+  if(stats->bits >= bits_max) bits_done = 1;
   if(stats->numcolors >= maxnumcolors) numcolors_done = 1;
 
+  error = color_set_init(&colorset);
+  if(error) return error;
+
   if(!numcolors_done) {
-    for(i = 0; i < stats->numcolors; i++) {
+    for(i = 0; i < stats->numcolors && i < 256; i++) {
       const unsigned char* color = &stats->palette[i * 4];
-      error = color_tree_add(&tree, color[0], color[1], color[2], color[3], (unsigned)i);
-      if(error) goto cleanup;
+      color_set_insert(&colorset, color[0], color[1], color[2], color[3]);
     }
   }
 
-  /*Check if the 16-bit input is truly 16-bit*/
+  /*Check if the 16-bit input is truly 16-bit, that is if the two bytes of any sample differ*/
   if(mode_in->bitdepth == 16 && !sixteen) {
-    unsigned short r = 0, g = 0, b = 0, a = 0;
-    for(i = 0; i != numpixels; ++i) {
-      getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
-      if((r & 255) != ((r >> 8) & 255) || (g & 255) != ((g >> 8) & 255) ||
-         (b & 255) != ((b >> 8) & 255) || (a & 255) != ((a >> 8) & 255)) /*first and second byte differ*/ {
-        stats->bits = 16;
-        sixteen = 1;
-        bits_done = 1;
-        numcolors_done = 1; /*counting colors no longer useful, palette doesn't support 16-bit*/
-        break;
-      }
+    if(has_16bit_samples(in, numpixels * (bpp / 8u))) {
+      stats->bits = 16;
+      sixteen = 1;
+      bits_done = 1;
+      numcolors_done = 1; /*counting colors no longer useful, palette doesn't support 16-bit*/
     }
   }
 
@@ -4122,10 +4590,15 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
     unsigned char r = 0, g = 0, b = 0, a = 0;
     unsigned char pr = 0, pg = 0, pb = 0, pa = 0;
     for(i = 0; i != numpixels; ++i) {
+      if(plain_channels && numcolors_done && bits_done && (i & 15u) == 0) {
+        /*only alpha and/or colored are still undecided: skip blocks of opaque and/or gray pixels*/
+        i += countPlainPixels8(in, i, numpixels, plain_channels, !colored_done, !alpha_done);
+        if(i == numpixels) break;
+      }
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
 
       /*skip if color same as before, this speeds up large non-photographic
-      images with many same colors by avoiding 'color_tree_has' below */
+      images with many same colors by avoiding the color set lookup below */
       if(i != 0 && r == pr && g == pg && b == pb && a == pa) continue;
       pr = r;
       pg = g;
@@ -4137,7 +4610,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
         unsigned bits = getValueRequiredBits(r);
         if(bits > stats->bits) stats->bits = bits;
       }
-      bits_done = (stats->bits >= bpp);
+      bits_done = (stats->bits >= bits_max);
 
       if(!colored_done && (r != g || r != b)) {
         stats->colored = 1;
@@ -4167,9 +4640,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
       }
 
       if(!numcolors_done) {
-        if(!color_tree_has(&tree, r, g, b, a)) {
-          error = color_tree_add(&tree, r, g, b, a, stats->numcolors);
-          if(error) goto cleanup;
+        if(color_set_insert(&colorset, r, g, b, a)) {
           if(stats->numcolors < 256) {
             unsigned char* p = stats->palette;
             unsigned n = stats->numcolors;
@@ -4205,8 +4676,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
     stats->key_b += (stats->key_b << 8);
   }
 
-cleanup:
-  color_tree_cleanup(&tree);
+  color_set_cleanup(&colorset);
   return error;
 }
 
@@ -5287,7 +5757,8 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
                           const unsigned char* in, size_t insize) {
   unsigned char IEND = 0;
   const unsigned char* chunk; /*points to beginning of next chunk*/
-  unsigned char* idat; /*the data from idat chunks, zlib compressed*/
+  const unsigned char* idat = 0; /*the data from idat chunks, zlib compressed: points into in while there's one*/
+  unsigned char* idat_buffer = 0; /*the concatenated data, only allocated when a second IDAT chunk follows*/
   size_t idatsize = 0;
   unsigned char* scanlines = 0;
   size_t scanlines_size = 0, expected_size = 0;
@@ -5311,14 +5782,11 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     CERROR_RETURN(state->error, 92); /*overflow possible due to amount of pixels*/
   }
 
-  /*the input filesize is a safe upper bound for the sum of idat chunks size*/
-  idat = (unsigned char*)lodepng_malloc(insize);
-  if(!idat) CERROR_RETURN(state->error, 83); /*alloc fail*/
-
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
-  IDAT data is put at the start of the in buffer*/
+  A single IDAT chunk is inflated where it is, several are concatenated into idat_buffer*/
+  LODEPNG_PHASE_BEGIN("chunks");
   while(!IEND && !state->error) {
     unsigned chunkLength;
     const unsigned char* data; /*the data in the chunk*/
@@ -5351,7 +5819,18 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       size_t newsize;
       if(lodepng_addofl(idatsize, chunkLength, &newsize)) CERROR_BREAK(state->error, 95);
       if(newsize > insize) CERROR_BREAK(state->error, 95);
-      lodepng_memcpy(idat + idatsize, data, chunkLength);
+      if(idatsize == 0) {
+        idat = data;
+      } else {
+        if(!idat_buffer) {
+          /*the input filesize is a safe upper bound for the sum of idat chunks size*/
+          idat_buffer = (unsigned char*)lodepng_malloc(insize);
+          if(!idat_buffer) CERROR_BREAK(state->error, 83); /*alloc fail*/
+          lodepng_memcpy(idat_buffer, idat, idatsize);
+          idat = idat_buffer;
+        }
+        lodepng_memcpy(idat_buffer + idatsize, data, chunkLength);
+      }
       idatsize += chunkLength;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
@@ -5458,6 +5937,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 
     if(!IEND) chunk = lodepng_chunk_next_const(chunk, in + insize);
   }
+  LODEPNG_PHASE_END(insize, idatsize);
 
   if(!state->error && state->info_png.color.colortype == LCT_PALETTE && !state->info_png.color.palette) {
     state->error = 106; /* error: PNG file must have PLTE chunk if color type is palette */
@@ -5482,19 +5962,38 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       expected_size += lodepng_get_raw_size_idat((*w + 0), (*h + 0) >> 1, bpp);
     }
 
+    LODEPNG_PHASE_BEGIN("zlib");
     state->error = zlib_decompress(&scanlines, &scanlines_size, expected_size, idat, idatsize, &state->decoder.zlibsettings);
+    LODEPNG_PHASE_END(idatsize, scanlines_size);
   }
   if(!state->error && scanlines_size != expected_size) state->error = 91; /*decompressed size doesn't match prediction*/
-  lodepng_free(idat);
+  lodepng_free(idat_buffer);
 
   if(!state->error) {
     outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!*out) state->error = 83; /*alloc fail*/
-  }
-  if(!state->error) {
-    lodepng_memset(*out, 0, outsize);
-    state->error = postProcessScanlines(*out, scanlines, *w, *h, &state->info_png);
+    LODEPNG_PHASE_BEGIN("unfilter");
+    if(state->info_png.interlace_method == 0) {
+      /*without interlacing the scanlines unfilter in place: the image ends up at the front of their own buffer,
+      which becomes the output, so the decoder never holds more than one copy of the image*/
+      size_t usedbits = ((size_t)(*w) * (*h) * lodepng_get_bpp(&state->info_png.color)) & 7u;
+      state->error = postProcessScanlines(scanlines, scanlines, *w, *h, &state->info_png);
+      if(!state->error) {
+        /*removing the padding bits compacts the rows in place, leaving the old bits after the last pixel: clear
+        them, as the zeroed buffer of the interlaced path would have them*/
+        if(usedbits) scanlines[outsize - 1] &= (unsigned char)(0xffu << (8u - usedbits));
+        *out = scanlines;
+        scanlines = 0;
+      }
+    } else {
+      /*Adam7 deinterlacing scatters pixels, and sets bits of partial bytes, so it needs a zeroed separate buffer*/
+      *out = (unsigned char*)lodepng_malloc(outsize);
+      if(!*out) state->error = 83; /*alloc fail*/
+      else {
+        lodepng_memset(*out, 0, outsize);
+        state->error = postProcessScanlines(*out, scanlines, *w, *h, &state->info_png);
+      }
+    }
+    LODEPNG_PHASE_END(scanlines_size, outsize);
   }
   lodepng_free(scanlines);
 }
@@ -5529,8 +6028,11 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
     if(!(*out)) {
       state->error = 83; /*alloc fail*/
     }
-    else state->error = lodepng_convert(*out, data, &state->info_raw,
-                                        &state->info_png.color, *w, *h);
+    else {
+      LODEPNG_PHASE_BEGIN("convert");
+      state->error = lodepng_convert(*out, data, &state->info_raw, &state->info_png.color, *w, *h);
+      LODEPNG_PHASE_END(lodepng_get_raw_size(*w, *h, &state->info_png.color), outsize);
+    }
     lodepng_free(data);
   }
   return state->error;
@@ -5733,7 +6235,9 @@ static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t d
   /* max chunk length allowed by the specification is 2147483647 bytes */
   const size_t max_chunk_length = 2147483647u;
 
+  LODEPNG_PHASE_BEGIN("zlib");
   error = zlib_compress(&zlib, &zlibsize, data, datasize, zlibsettings);
+  LODEPNG_PHASE_END(datasize, zlibsize);
   while(!error) {
     if(zlibsize - pos > max_chunk_length) {
       error = lodepng_chunk_createv(out, max_chunk_length, "IDAT", zlib + pos);
@@ -6106,12 +6610,53 @@ static size_t ilog2i(size_t i) {
   return i * l + ((i - (((size_t)1) << l)) << 1u);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+/*sum of the absolute values of a filtered scanline, the score of LFS_MINSUM: lower is better*/
+static size_t filterSum(const unsigned char* scanline, size_t length, unsigned char type) {
+  size_t x, sum = 0;
+  if(type == 0) {
+    for(x = 0; x != length; ++x) sum += scanline[x];
+  } else {
+    for(x = 0; x != length; ++x) {
+      /*For differences, each byte should be treated as signed, values above 127 are negative
+      (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+      This means filtertype 0 is almost never chosen, but that is justified.*/
+      unsigned char s = scanline[x];
+      sum += s < 128 ? s : (255U - s);
+    }
+  }
+  return sum;
+}
+
+/*sum of count * log2(count) over the byte histogram of a filtered scanline, the score of LFS_ENTROPY: higher
+is better, as the bytes are more concentrated*/
+static size_t filterEntropyScore(const unsigned char* scanline, size_t length, unsigned char type) {
+  unsigned count[256];
+  size_t x, sum = 0;
+  lodepng_memset(count, 0, 256 * sizeof(*count));
+  for(x = 0; x != length; ++x) ++count[scanline[x]];
+  ++count[type]; /*the filter type itself is part of the scanline*/
+  for(x = 0; x != 256; ++x) {
+    sum += ilog2i(count[x]);
+  }
+  return sum;
+}
+
+/*LFS_SAMPLED scores the filters of every this many rows*/
+static const unsigned FILTER_SAMPLE_PERIOD = 16;
+/*LFS_SAMPLED: the least rise of the filter sum over the previous row that counts as drift. On narrow rows the
+sums are small and jump by a few units all the time, which would try the filters on nearly every row*/
+static const size_t FILTER_SAMPLE_MIN_DRIFT = 8;
+/*LFS_SAMPLED scores rows shorter than this with filterSum like LFS_MINSUM: the histogram of filterEntropyScore
+costs 256 bins per try whatever the row length, and says little about a few bytes*/
+static const size_t FILTER_SAMPLE_MIN_HISTOGRAM = 64;
+
+static unsigned filterRows(unsigned char* out, const unsigned char* in, unsigned w, unsigned ystart, unsigned yend,
+                           const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
   the scanlines with 1 extra byte per scanline
+  Only the rows ystart..yend-1 are filtered, at their place in out; row ystart-1 of in is their previous line
   */
 
   unsigned bpp = lodepng_get_bpp(color);
@@ -6120,7 +6665,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7u) / 8u;
-  const unsigned char* prevline = 0;
+  const unsigned char* prevline = ystart ? &in[(size_t)(ystart - 1) * linebytes] : 0;
   unsigned x, y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
@@ -6135,7 +6680,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
   if(strategy >= LFS_ZERO && strategy <= LFS_FOUR) {
     unsigned char type = (unsigned char)strategy;
-    for(y = 0; y != h; ++y) {
+    for(y = ystart; y != yend; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       out[outindex] = type; /*filter type byte*/
@@ -6155,24 +6700,12 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = ystart; y != yend; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
+          size_t sum;
           filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          if(type == 0) {
-            for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
-          } else {
-            for(x = 0; x != linebytes; ++x) {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum += s < 128 ? s : (255U - s);
-            }
-          }
+          sum = filterSum(attempt[type], linebytes, type);
 
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum < smallest) {
@@ -6193,8 +6726,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   } else if(strategy == LFS_ENTROPY) {
     unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t bestSum = 0;
-    unsigned type, bestType = 0;
-    unsigned count[256];
+    unsigned char type, bestType = 0;
 
     for(type = 0; type != 5; ++type) {
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
@@ -6202,17 +6734,12 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = ystart; y != yend; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
+          size_t sum;
           filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-          lodepng_memset(count, 0, 256 * sizeof(*count));
-          for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
-          ++count[type]; /*the filter type itself is part of the scanline*/
-          for(x = 0; x != 256; ++x) {
-            sum += ilog2i(count[x]);
-          }
+          sum = filterEntropyScore(attempt[type], linebytes, type);
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum > bestSum) {
             bestType = type;
@@ -6228,9 +6755,65 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       }
     }
 
+    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+  } else if(strategy == LFS_SAMPLED) {
+    /*LFS_ENTROPY at close to the cost of a fixed filter: only every FILTER_SAMPLE_PERIOD-th row tries the 5 filter
+    types, and the rows in between reuse its choice. A row whose filter sum jumps well above that of the row before
+    means the data changed, and is tried right away. The choice and sum carried between rows are read back from
+    the previous row of out, so filtering in bands gives the same result as filtering all rows at once.*/
+    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
+    size_t prevSum = 0;
+    size_t drift = linebytes / 16u > FILTER_SAMPLE_MIN_DRIFT ? linebytes / 16u : FILTER_SAMPLE_MIN_DRIFT;
+    unsigned histogram = linebytes >= FILTER_SAMPLE_MIN_HISTOGRAM;
+    unsigned char type, bestType = 0;
+
+    for(type = 0; type != 5; ++type) {
+      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      if(!attempt[type]) error = 83; /*alloc fail*/
+    }
+
+    if(!error && ystart != 0) {
+      const unsigned char* previous = &out[(ystart - 1) * (linebytes + 1)];
+      bestType = previous[0];
+      prevSum = filterSum(previous + 1, linebytes, bestType);
+    }
+
+    if(!error) {
+      for(y = ystart; y != yend; ++y) {
+        unsigned char* scanline = &out[y * (linebytes + 1)];
+        size_t sum = 0;
+        /*row 0 has no previous row to filter against, so its choice says little about the next ones*/
+        unsigned sample = (y % FILTER_SAMPLE_PERIOD == 0 || y == 1);
+        if(!sample) {
+          filterScanline(scanline + 1, &in[y * linebytes], prevline, linebytes, bytewidth, bestType);
+          sum = filterSum(scanline + 1, linebytes, bestType);
+          sample = sum > prevSum + prevSum / 2u + drift;
+        }
+        if(sample) {
+          size_t bestScore = 0;
+          for(type = 0; type != 5; ++type) {
+            size_t score;
+            filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+            /*higher is better for both: the sum is negated*/
+            if(histogram) score = filterEntropyScore(attempt[type], linebytes, type);
+            else score = ~filterSum(attempt[type], linebytes, type);
+            if(type == 0 || score > bestScore) {
+              bestType = type;
+              bestScore = score;
+            }
+          }
+          lodepng_memcpy(scanline + 1, attempt[bestType], linebytes);
+          sum = filterSum(scanline + 1, linebytes, bestType);
+        }
+        scanline[0] = bestType; /*the first byte of a scanline will be the filter type*/
+        prevSum = sum;
+        prevline = &in[y * linebytes];
+      }
+    }
+
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   } else if(strategy == LFS_PREDEFINED) {
-    for(y = 0; y != h; ++y) {
+    for(y = ystart; y != yend; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       unsigned char type = settings->predefined_filters[y];
@@ -6258,12 +6841,18 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
+    /*these trial compressions aren't the progress of the image*/
+    zlibsettings.progress = 0;
+    /*nor may they touch the hash chains of the image's context: the banded encoding deflates the image in
+    between calls, with the window of the bands before still in that context*/
+    zlibsettings.context = lodepng_compress_context_create();
+    if(!zlibsettings.context) error = 83; /*alloc fail*/
     for(type = 0; type != 5; ++type) {
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
     if(!error) {
-      for(y = 0; y != h; ++y) /*try the 5 filter types*/ {
+      for(y = ystart; y != yend; ++y) /*try the 5 filter types*/ {
         for(type = 0; type != 5; ++type) {
           unsigned testsize = (unsigned)linebytes;
           /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
@@ -6285,12 +6874,18 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       }
     }
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    lodepng_compress_context_destroy(zlibsettings.context);
   }
   else return 88; /* unknown filter strategy */
 
   return error;
 }
 
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  return filterRows(out, in, w, 0, h, color, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h) {
   /*The opposite of the removePaddingBits function
@@ -6435,6 +7030,133 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   return error;
 }
 
+/*whether addChunk_IDAT_banded can encode this image: it needs whole bytes per scanline, no interlacing, and
+the built-in deflate with dynamic blocks, which is the case it reproduces exactly*/
+static unsigned useBandedIDAT(unsigned w, unsigned h, const LodePNGInfo* info_png,
+                              const LodePNGEncoderSettings* settings) {
+  size_t bpp = lodepng_get_bpp(&info_png->color);
+  const LodePNGCompressSettings* zlibsettings = &settings->zlibsettings;
+  if(!settings->banded || info_png->interlace_method != 0) return 0;
+  if(bpp < 8 && ((size_t)w * bpp) % 8u != 0) return 0; /*padding bits*/
+  if(zlibsettings->custom_zlib || zlibsettings->custom_deflate || zlibsettings->btype != 2) return 0;
+  /*the deflate stream must fit in one IDAT chunk of at most 2^31-1 bytes, even if it doesn't compress*/
+  return (size_t)h * (((size_t)w * bpp + 7u) / 8u + 1u) < (1u << 30);
+}
+
+/*
+Filters the image, deflates it and checksums it a band of rows at a time, writing the IDAT chunk straight into
+out. The separate passes (preProcessScanlines, zlib_compress, its Adler-32, and the chunk copy and CRC of
+addChunk_IDAT) each stream the whole image through memory; here every band is still in cache when the next step
+reads it. The bands are the deflate blocks lodepng_deflatev would make, so the PNG is the same byte for byte.
+The filtered data is still kept whole, as LZ77 looks back into the previous band.
+*/
+static unsigned addChunk_IDAT_banded(ucvector* out, const unsigned char* image, unsigned w, unsigned h,
+                                     const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings) {
+  unsigned error = 0;
+  const LodePNGCompressSettings* zlibsettings = &settings->zlibsettings;
+  LodePNGCompressContext* context = zlibsettings->context;
+  size_t linebytes = lodepng_get_raw_size_idat(w, 1, lodepng_get_bpp(&info_png->color)) - 1u;
+  size_t datasize = (size_t)h * (linebytes + 1u);
+  size_t blocksize = dynamicBlockSize(datasize);
+  size_t numdeflateblocks = (datasize + blocksize - 1u) / blocksize;
+  size_t chunkstart = out->size, crcpos = chunkstart + 4, i;
+  unsigned char* data;
+  unsigned rows = 0; /*rows filtered so far*/
+  unsigned ADLER32 = 1u;
+  unsigned CMFFLG = 256 * 120; /*zlib header as in lodepng_zlib_compress: CM 8, CINFO 7, no FDICT, FLEVEL 0*/
+  unsigned crc = 0xffffffffu; /*running CRC register of the chunk type and data*/
+  LodePNGBitWriter writer;
+  LodePNGEncoderSettings band = *settings; /*the settings of the current band, see tune_band*/
+
+  if(numdeflateblocks == 0) numdeflateblocks = 1;
+  CMFFLG += 31 - CMFFLG % 31;
+
+  data = (unsigned char*)lodepng_malloc(datasize);
+  if(!data && datasize) return 83; /*alloc fail*/
+  if(!context) context = lodepng_compress_context_create();
+  if(!context) error = 83; /*alloc fail*/
+  if(!error) error = compress_context_reset(context, zlibsettings->windowsize);
+
+  /*chunk length (written at the end), type, and the two zlib header bytes*/
+  if(!error && !ucvector_resize(out, out->size + 10)) error = 83; /*alloc fail*/
+  if(!error) {
+    lodepng_memcpy(out->data + chunkstart + 4, "IDAT", 4);
+    out->data[chunkstart + 8] = (unsigned char)(CMFFLG >> 8);
+    out->data[chunkstart + 9] = (unsigned char)(CMFFLG & 255);
+  }
+
+  LodePNGBitWriter_init(&writer, out);
+  for(i = 0; i != numdeflateblocks && !error; ++i) {
+    unsigned final = (i == numdeflateblocks - 1);
+    size_t start = i * blocksize;
+    size_t end = start + blocksize;
+    size_t outstart = out->size;
+    unsigned yend;
+    if(end > datasize) end = datasize;
+    yend = (unsigned)((end + linebytes) / (linebytes + 1u)); /*the rows overlapping the block*/
+
+    if(settings->tune_band) {
+      unsigned windowsize = band.zlibsettings.windowsize;
+      settings->tune_band(&band, start, datasize, out->size - (chunkstart + 10), settings);
+      /*the hash chains are laid out for one window size, so matches start over in this block*/
+      if(band.zlibsettings.windowsize != windowsize) {
+        error = compress_context_reset(context, band.zlibsettings.windowsize);
+        if(error) break;
+      }
+    }
+
+    LODEPNG_PHASE_BEGIN("filter");
+    error = filterRows(data, image, w, rows, yend, &info_png->color, &band);
+    LODEPNG_PHASE_END((yend - rows) * linebytes, (yend - rows) * (linebytes + 1u));
+    rows = yend;
+    if(error) break;
+
+    LODEPNG_PHASE_BEGIN("deflate_block");
+    error = deflateDynamic(&writer, context, data, start, end, &band.zlibsettings, final);
+    LODEPNG_PHASE_END(end - start, out->size - outstart);
+    if(!error && zlibsettings->progress && zlibsettings->progress(end, datasize, out->size - (chunkstart + 10),
+                                                                  zlibsettings)) {
+      error = 123;
+    }
+    if(error) break;
+
+    LODEPNG_PHASE_BEGIN("adler32");
+    ADLER32 = update_adler32(ADLER32, data + start, (unsigned)(end - start));
+    LODEPNG_PHASE_END(end - start, 0);
+
+#ifdef LODEPNG_COMPILE_CRC
+    /*the last byte can still get bits of the next block*/
+    LODEPNG_PHASE_BEGIN("crc");
+    crc = lodepng_crc32_update(crc, out->data + crcpos, out->size - 1u - crcpos);
+    LODEPNG_PHASE_END(out->size - 1u - crcpos, 0);
+    crcpos = out->size - 1u;
+#endif /*LODEPNG_COMPILE_CRC*/
+  }
+
+  if(!error && settings->tune_band) {
+    settings->tune_band(&band, datasize, datasize, out->size - (chunkstart + 10), settings);
+  }
+
+  if(!error && !ucvector_resize(out, out->size + 8)) error = 83; /*alloc fail*/
+  if(!error) {
+    size_t length = out->size - 4 - (chunkstart + 8); /*without the chunk header and the CRC to come*/
+    lodepng_set32bitInt(out->data + out->size - 8, ADLER32);
+    lodepng_set32bitInt(out->data + chunkstart, (unsigned)length);
+    LODEPNG_PHASE_BEGIN("crc");
+#ifdef LODEPNG_COMPILE_CRC
+    crc = lodepng_crc32_update(crc, out->data + crcpos, out->size - 4 - crcpos) ^ 0xffffffffu;
+#else /*LODEPNG_COMPILE_CRC*/
+    crc = lodepng_crc32(out->data + chunkstart + 4, length + 4);
+#endif /*LODEPNG_COMPILE_CRC*/
+    LODEPNG_PHASE_END(out->size - 4 - crcpos, 0);
+    lodepng_set32bitInt(out->data + out->size - 4, crc);
+  }
+
+  if(context != zlibsettings->context) lodepng_compress_context_destroy(context);
+  lodepng_free(data);
+  return error;
+}
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
 static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t datasize) {
   unsigned char* inchunk = data;
@@ -6472,6 +7194,9 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         LodePNGState* state) {
   unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
   size_t datasize = 0;
+  unsigned char* converted = 0;
+  const unsigned char* pixels = image; /*the image in the color mode of the PNG*/
+  unsigned banded;
   ucvector outv = ucvector_init(NULL, 0);
   LodePNGInfo info;
   const LodePNGInfo* info_png = &state->info_png;
@@ -6527,7 +7252,9 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
       stats.allow_greyscale = 0;
     }
 #endif /* LODEPNG_COMPILE_ANCILLARY_CHUNKS */
+    LODEPNG_PHASE_BEGIN("color_stats");
     state->error = lodepng_compute_color_stats(&stats, image, w, h, &state->info_raw);
+    LODEPNG_PHASE_END(lodepng_get_raw_size(w, h, &state->info_raw), 0);
     if(state->error) goto cleanup;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     if(info_png->background_defined) {
@@ -6632,22 +7359,27 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
   if(!lodepng_color_mode_equal(&state->info_raw, &info.color)) {
-    unsigned char* converted;
     size_t size = ((size_t)w * (size_t)h * (size_t)lodepng_get_bpp(&info.color) + 7u) / 8u;
 
     converted = (unsigned char*)lodepng_malloc(size);
     if(!converted && size) state->error = 83; /*alloc fail*/
     if(!state->error) {
+      LODEPNG_PHASE_BEGIN("convert");
       state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
+      LODEPNG_PHASE_END(lodepng_get_raw_size(w, h, &state->info_raw), size);
     }
-    if(!state->error) {
-      state->error = preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
-    }
-    lodepng_free(converted);
     if(state->error) goto cleanup;
-  } else {
-    state->error = preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+    pixels = converted;
+  }
+  /*the banded IDAT filters as it goes; otherwise the whole image is filtered up front*/
+  banded = useBandedIDAT(w, h, &info, &state->encoder);
+  if(!banded) {
+    LODEPNG_PHASE_BEGIN("filter");
+    state->error = preProcessScanlines(&data, &datasize, pixels, w, h, &info, &state->encoder);
+    LODEPNG_PHASE_END(lodepng_get_raw_size(w, h, &info.color), datasize);
     if(state->error) goto cleanup;
+    lodepng_free(converted);
+    converted = 0;
   }
 
   /* output all PNG chunks */ {
@@ -6736,7 +7468,8 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    if(banded) state->error = addChunk_IDAT_banded(&outv, pixels, w, h, &info, &state->encoder);
+    else state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
     if(state->error) goto cleanup;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
@@ -6809,6 +7542,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
 cleanup:
   lodepng_info_cleanup(&info);
   lodepng_free(data);
+  lodepng_free(converted);
   lodepng_color_mode_cleanup(&auto_color);
 
   /*instead of cleaning the vector up, give it to the output*/
@@ -6868,6 +7602,9 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings) {
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->banded = 1;
+  settings->tune_band = 0;
+  settings->tune_band_context = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -7013,6 +7750,7 @@ const char* lodepng_error_text(unsigned code) {
     case 120: return "invalid cLLi chunk size";
     case 121: return "invalid chunk type name: may only contain [a-zA-Z]";
     case 122: return "invalid chunk type name: third character must be uppercase";
+    case 123: return "compression stopped by the progress function";
   }
   return "unknown error code";
 }
@@ -7074,6 +7812,13 @@ unsigned decompress(std::vector<unsigned char>& out, const std::vector<unsigned
 #endif /* LODEPNG_COMPILE_DECODER */
 
 #ifdef LODEPNG_COMPILE_ENCODER
+CompressContext::CompressContext() : context_(lodepng_compress_context_create()) {
+}
+
+CompressContext::~CompressContext() {
+  lodepng_compress_context_destroy(context_);
+}
+
 unsigned compress(std::vector<unsigned char>& out, const unsigned char* in, size_t insize,
                   const LodePNGCompressSettings& settings) {
   unsigned char* buffer = 0;
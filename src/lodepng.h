@@ -102,6 +102,11 @@ or comment out LODEPNG_COMPILE_CRC below*/
 #define LODEPNG_COMPILE_CRC
 #endif
 
+/*Phase hooks for profiling, off by default: pass -DLODEPNG_COMPILE_PHASE_HOOKS to the compiler to have
+the encoder and decoder call lodepng_phase_begin(name) and lodepng_phase_end(bytes_in, bytes_out) around
+their phases (color_stats, convert, filter, zlib, deflate_block, lz77, huffman, adler32, crc, chunks,
+inflate, unfilter). As with custom allocators, these two functions must then be defined in your own source files.*/
+
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -343,6 +348,12 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*
+Reusable state of the built-in deflate encoder (hash chains, LZ77 and Huffman scratch
+buffers, output buffer), see lodepng_compress_context_create.
+*/
+typedef struct LodePNGCompressContext LodePNGCompressContext;
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -369,6 +380,16 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
                              const LodePNGCompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*optional compressor context to reuse between compressions instead of allocating and
+  initializing the encoder tables for every call (default: null). Ignored by custom functions.*/
+  LodePNGCompressContext* context;
+
+  /*optional, called after every deflate block with the bytes compressed so far, the total to compress and the
+  size of the deflate stream so far; returning nonzero stops the compression with error 123 (default: null).
+  Lets a caller give up on a compression that is going badly. Not called by custom functions.*/
+  unsigned (*progress)(size_t done, size_t total, size_t outsize, const LodePNGCompressSettings*);
+  const void* progress_context; /*optional settings for the progress function*/
 };
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
@@ -870,7 +891,12 @@ typedef enum LodePNGFilterStrategy {
   */
   LFS_BRUTE_FORCE,
   /*use predefined_filters buffer: you specify the filter type for each scanline*/
-  LFS_PREDEFINED
+  LFS_PREDEFINED,
+  /*Like LFS_ENTROPY, but only tries the filter types on every 16th scanline, or when a scanline filtered with the
+  current choice looks much worse than the one before; the other scanlines reuse the previous choice. Scanlines
+  shorter than 64 bytes are scored like LFS_MINSUM. Close to LFS_ENTROPY in size at little more than the cost of a
+  fixed filter.*/
+  LFS_SAMPLED
 } LodePNGFilterStrategy;
 
 /*Gives characteristics about the integer RGBA colors of the image (count, alpha channel usage, bit depth, ...),
@@ -931,6 +957,18 @@ typedef struct LodePNGEncoderSettings {
   NOTE: enabling this may worsen compression if auto_convert is used to choose
   optimal color mode, because it cannot use grayscale color modes in this case*/
   unsigned force_palette;
+  /*filter, deflate and checksum the image a band of rows at a time while it is in cache, instead of in
+  separate passes over the whole image. Only done for non-interlaced images of whole bytes per scanline with
+  the built-in deflate and btype 2; the PNG is the same either way. Default: true*/
+  unsigned banded;
+  /*optional, called by the banded encoding before every band with the bytes of filtered data done so far, the
+  total and the size of the deflate stream so far, and once more at the end with done equal to total. It may
+  change the filter strategy and the LZ77 settings (windowsize, minmatch, nicematch, lazymatching) in *band
+  for the bands that follow; band starts as a copy of these settings. A new windowsize starts the LZ77
+  matching over. Lets a caller trade compression for speed while encoding (default: null)*/
+  void (*tune_band)(struct LodePNGEncoderSettings* band, size_t done, size_t total, size_t outsize,
+                    const struct LodePNGEncoderSettings* settings);
+  const void* tune_band_context; /*optional settings for the tune_band function*/
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*add LodePNG identifier and version as a text chunk, for debugging*/
   unsigned add_id;
@@ -1148,6 +1186,16 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Create a compressor context, to set in LodePNGCompressSettings.context. The context keeps the
+hash tables and scratch buffers of the deflate encoder allocated, so that many compressions
+in a row (e.g. of many small images) only pay for resetting them, not for allocating them.
+A context may only be used by one compression at a time: give each thread its own.
+Returns NULL if allocation failed. Destroy it with lodepng_compress_context_destroy.
+*/
+LodePNGCompressContext* lodepng_compress_context_create(void);
+void lodepng_compress_context_destroy(LodePNGCompressContext* context);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -1244,6 +1292,21 @@ unsigned decompress(std::vector<unsigned char>& out, const std::vector<unsigned
 #endif /* LODEPNG_COMPILE_DECODER */
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*
+Owns a LodePNGCompressContext for its lifetime. Keep one per thread and set
+settings.context = context.get() (or state.encoder.zlibsettings.context) for every encode.
+*/
+class CompressContext {
+  public:
+    CompressContext();
+    ~CompressContext();
+    LodePNGCompressContext* get() const { return context_; }
+  private:
+    CompressContext(const CompressContext&); /*not copyable*/
+    CompressContext& operator=(const CompressContext&);
+    LodePNGCompressContext* context_;
+};
+
 /* Zlib-compress an unsigned char buffer */
 unsigned compress(std::vector<unsigned char>& out, const unsigned char* in, size_t insize,
                   const LodePNGCompressSettings& settings = lodepng_default_compress_settings);